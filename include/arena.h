@@ -0,0 +1,83 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+#include <utility>
+#include <vector>
+
+// Size of the first block; each further block is twice the last
+#define ARENA_BLOCK_SIZE 4096
+
+/**
+ * @brief Bump allocator for data that lives exactly as long as one input line
+ *
+ * Allocation is a pointer bump inside the current block. reset() rewinds
+ * to the first block in O(1) and keeps every block, so once the arena has
+ * grown to fit the widest line seen, later lines allocate nothing from the
+ * heap. Nothing is freed individually and no destructors run: callers
+ * destroy objects that own resources themselves before reset().
+ */
+class Arena {
+ public:
+  Arena() : current(0), used(0) {}
+  ~Arena() {
+    for (Block &block : blocks) free(block.data);
+  }
+
+  Arena(const Arena &) = delete;
+  Arena &operator=(const Arena &) = delete;
+
+  /**
+   * @brief size bytes aligned to align (a power of two)
+   */
+  void *allocate(size_t size, size_t align = alignof(std::max_align_t)) {
+    while (true) {
+      if (current < blocks.size()) {
+        Block &block = blocks[current];
+        size_t start = (used + align - 1) & ~(align - 1);
+        if (start + size <= block.size) {
+          used = start + size;
+          return block.data + start;
+        }
+        ++current;
+        used = 0;
+        continue;
+      }
+      size_t want = blocks.empty() ? ARENA_BLOCK_SIZE : blocks.back().size * 2;
+      while (want < size + align) want *= 2;
+      char *data = (char *)malloc(want);
+      if (!data) throw std::bad_alloc();
+      blocks.push_back(Block{data, want});
+    }
+  }
+
+  /**
+   * @brief Construct a T in the arena
+   */
+  template <typename T, typename... Args>
+  T *make(Args &&...args) {
+    return new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+  }
+
+  /**
+   * @brief Forget everything allocated, keeping the memory for reuse
+   */
+  void reset() {
+    current = 0;
+    used = 0;
+  }
+
+ private:
+  struct Block {
+    char *data;
+    size_t size;
+  };
+
+  std::vector<Block> blocks;
+  size_t current;  // block being filled
+  size_t used;     // bytes of it handed out
+};
+
+#endif
@@ -0,0 +1,162 @@
+#ifndef ASYNC_LOG_H
+#define ASYNC_LOG_H
+
+#include <pthread.h>
+#include <unistd.h>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <ctime>
+#include <string>
+#include <vector>
+
+enum LogLevel { LOG_ERROR, LOG_WARN, LOG_INFO, LOG_DEBUG };
+
+// Messages accepted per second; the rest are dropped and counted, and the
+// count is logged once the next second lets messages through again
+#define LOG_RATE_PER_SEC 2000
+// Lines waiting for the writer before new ones are dropped
+#define LOG_QUEUE_MAX 8192
+
+/**
+ * @brief Levelled log written by a thread of its own
+ *
+ * Callers check enabled() before formatting anything, so a message below
+ * the level costs one relaxed load. An accepted message is moved onto a
+ * queue under a short lock; the writer thread takes the whole queue and
+ * writes it with one write(). Until start(), and after stop(), messages
+ * are written directly.
+ */
+class AsyncLog {
+ public:
+  AsyncLog() : level(LOG_INFO), fd(STDOUT_FILENO), running(false), stopping(false),
+               window(0), window_count(0), suppressed(0), dropped_total(0) {
+    pthread_mutex_init(&lock, nullptr);
+    pthread_cond_init(&wake, nullptr);
+  }
+  ~AsyncLog() {
+    stop();
+    pthread_cond_destroy(&wake);
+    pthread_mutex_destroy(&lock);
+  }
+
+  AsyncLog(const AsyncLog &) = delete;
+  AsyncLog &operator=(const AsyncLog &) = delete;
+
+  void set_level(LogLevel l) { level.store(l, std::memory_order_relaxed); }
+  bool enabled(LogLevel l) const { return l <= level.load(std::memory_order_relaxed); }
+  uint64_t dropped() const { return dropped_total.load(std::memory_order_relaxed); }
+
+  /**
+   * @brief Start the writer thread, which writes to out_fd
+   */
+  bool start(int out_fd) {
+    pthread_mutex_lock(&lock);
+    fd = out_fd;
+    stopping = false;
+    if (!running) running = pthread_create(&writer, nullptr, writer_main, this) == 0;
+    bool ok = running;
+    pthread_mutex_unlock(&lock);
+    return ok;
+  }
+
+  /**
+   * @brief Write out what is queued and stop the writer thread
+   */
+  void stop() {
+    pthread_mutex_lock(&lock);
+    if (!running) {
+      pthread_mutex_unlock(&lock);
+      return;
+    }
+    stopping = true;
+    pthread_cond_signal(&wake);
+    pthread_mutex_unlock(&lock);
+    pthread_join(writer, nullptr);
+    pthread_mutex_lock(&lock);
+    running = false;
+    pthread_mutex_unlock(&lock);
+  }
+
+  /**
+   * @brief Log one line (without its newline)
+   */
+  void write(LogLevel l, std::string line) {
+    if (!enabled(l)) return;
+    line += '\n';
+    time_t now = time(nullptr);
+    pthread_mutex_lock(&lock);
+    if (now != window) {
+      if (suppressed > 0) {
+        pending.push_back("log: " + std::to_string(suppressed) + " messages suppressed\n");
+        suppressed = 0;
+      }
+      window = now;
+      window_count = 0;
+    }
+    // Errors always get through
+    if (l != LOG_ERROR && (window_count >= LOG_RATE_PER_SEC || pending.size() >= LOG_QUEUE_MAX)) {
+      ++suppressed;
+      dropped_total.fetch_add(1, std::memory_order_relaxed);
+      pthread_mutex_unlock(&lock);
+      return;
+    }
+    ++window_count;
+    if (!running) {
+      pthread_mutex_unlock(&lock);
+      write_all(line);
+      return;
+    }
+    pending.push_back(std::move(line));
+    if (pending.size() == 1) pthread_cond_signal(&wake);
+    pthread_mutex_unlock(&lock);
+  }
+
+ private:
+  static void *writer_main(void *arg) {
+    AsyncLog *log = (AsyncLog *)arg;
+    std::vector<std::string> batch;
+    std::string out;
+    pthread_mutex_lock(&log->lock);
+    while (true) {
+      while (log->pending.empty() && !log->stopping) pthread_cond_wait(&log->wake, &log->lock);
+      bool last = log->stopping;
+      batch.swap(log->pending);
+      pthread_mutex_unlock(&log->lock);
+
+      out.clear();
+      for (const std::string &line : batch) out += line;
+      batch.clear();
+      log->write_all(out);
+
+      pthread_mutex_lock(&log->lock);
+      if (last && log->pending.empty()) break;
+    }
+    pthread_mutex_unlock(&log->lock);
+    return nullptr;
+  }
+
+  void write_all(const std::string &text) const {
+    for (size_t done = 0; done < text.size(); ) {
+      ssize_t n = ::write(fd, text.data() + done, text.size() - done);
+      if (n < 0 && errno == EINTR) continue;
+      if (n <= 0) return;
+      done += n;
+    }
+  }
+
+  std::atomic<int> level;
+  int fd;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  pthread_t writer;
+  bool running;
+  bool stopping;
+  std::vector<std::string> pending;
+  time_t window;          // the second being rate limited
+  int window_count;       // messages accepted in it
+  uint64_t suppressed;    // dropped since the last notice
+  std::atomic<uint64_t> dropped_total;
+};
+
+#endif
@@ -0,0 +1,164 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <zlib.h>
+#include <endian.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "protocol.h"
+
+/*
+ * Compressed payloads (after HELLO|deflate is accepted) are a sequence of
+ * independent chunks, each an 8 byte header, big-endian:
+ *
+ *   u32 raw_len | u32 packed_len
+ *
+ * followed by packed_len bytes of zlib data that inflate to raw_len bytes,
+ * or, with packed_len 0, by raw_len bytes stored as they are. Chunks hold
+ * at most COMPRESS_CHUNK_SIZE raw bytes, so both ends stream with fixed
+ * buffers, and sizes announced in headers stay raw byte counts.
+ */
+#define COMPRESS_CHUNK_SIZE (128 * 1024)
+#define COMPRESS_HEADER_SIZE 8
+// After a chunk that did not shrink, this many are stored without trying
+#define COMPRESS_BACKOFF_CHUNKS 16
+
+/**
+ * @brief Turns raw data into compressed payload chunks
+ * Level 0 stores everything; incompressible input (already compressed
+ * media, archives) is detected per chunk and stops costing CPU for a while.
+ */
+class ChunkEncoder {
+ public:
+  explicit ChunkEncoder(int level) : level(level), skip(0) {}
+
+  /**
+   * @brief Append one chunk of len (<= COMPRESS_CHUNK_SIZE) raw bytes
+   */
+  void encode(const char *data, size_t len, std::string &out) {
+    uLongf packed_len = 0;
+    if (level > 0 && skip == 0) {
+      packed.resize(compressBound(len));
+      packed_len = packed.size();
+      if (compress2(packed.data(), &packed_len, (const Bytef *)data, len, level) != Z_OK
+          || packed_len >= len - len / 16) {
+        packed_len = 0;
+        skip = COMPRESS_BACKOFF_CHUNKS;
+      }
+    } else if (skip > 0) {
+      --skip;
+    }
+    char hdr[COMPRESS_HEADER_SIZE];
+    uint32_t raw_be = htobe32((uint32_t)len), packed_be = htobe32((uint32_t)packed_len);
+    memcpy(hdr, &raw_be, 4);
+    memcpy(hdr + 4, &packed_be, 4);
+    out.append(hdr, sizeof(hdr));
+    if (packed_len) {
+      out.append((const char *)packed.data(), packed_len);
+    } else {
+      out.append(data, len);
+    }
+  }
+
+ private:
+  int level;
+  int skip;
+  std::vector<Bytef> packed;
+};
+
+/**
+ * @brief Send len bytes of memory as compressed chunks
+ */
+inline bool send_packed(int sockfd, const char *data, size_t len, ChunkEncoder &encoder) {
+  std::string out;
+  for (size_t done = 0; done < len; ) {
+    size_t n = std::min((size_t)COMPRESS_CHUNK_SIZE, len - done);
+    out.clear();
+    encoder.encode(data + done, n, out);
+    if (!send_all(sockfd, out.data(), out.size())) return false;
+    done += n;
+  }
+  return true;
+}
+
+/**
+ * @brief Send count bytes of a file from offset as compressed chunks
+ */
+inline bool send_packed_file(int sockfd, int fd, off_t offset, size_t count, ChunkEncoder &encoder) {
+  std::vector<char> raw(std::min((size_t)COMPRESS_CHUNK_SIZE, std::max(count, (size_t)1)));
+  std::string out;
+  for (size_t done = 0; done < count; ) {
+    size_t want = std::min(raw.size(), count - done);
+    ssize_t n = pread(fd, raw.data(), want, offset + done);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    out.clear();
+    encoder.encode(raw.data(), n, out);
+    if (!send_all(sockfd, out.data(), out.size())) return false;
+    done += n;
+  }
+  return true;
+}
+
+/**
+ * @brief Reads compressed payload chunks back into raw bytes
+ */
+class ChunkDecoder {
+ public:
+  ChunkDecoder() : raw_len(0), corrupt(false) {}
+
+  /**
+   * @brief Read and unpack the next chunk of a payload
+   * @param remaining raw bytes the payload still owes; a chunk claiming
+   * more (or nothing) is corrupt
+   * @return false on disconnect or corrupt data (see is_corrupt()); the
+   * stream can't be resynchronised after the latter
+   */
+  bool next(SocketReader &reader, size_t remaining) {
+    char hdr[COMPRESS_HEADER_SIZE];
+    if (!reader.read_exact(hdr, sizeof(hdr))) return false;
+    uint32_t len, packed_len;
+    memcpy(&len, hdr, 4);
+    memcpy(&packed_len, hdr + 4, 4);
+    len = be32toh(len);
+    packed_len = be32toh(packed_len);
+    if (len == 0 || len > COMPRESS_CHUNK_SIZE || len > remaining
+        || packed_len > compressBound(COMPRESS_CHUNK_SIZE)) {
+      corrupt = true;
+      return false;
+    }
+
+    raw.resize(COMPRESS_CHUNK_SIZE);
+    if (packed_len == 0) {
+      if (!reader.read_exact(raw.data(), len)) return false;
+    } else {
+      packed.resize(packed_len);
+      if (!reader.read_exact(packed.data(), packed_len)) return false;
+      uLongf out_len = len;
+      if (uncompress((Bytef *)raw.data(), &out_len, (const Bytef *)packed.data(), packed_len) != Z_OK
+          || out_len != len) {
+        corrupt = true;
+        return false;
+      }
+    }
+    raw_len = len;
+    return true;
+  }
+
+  const char *data() const { return raw.data(); }
+  size_t size() const { return raw_len; }
+  bool is_corrupt() const { return corrupt; }
+
+ private:
+  std::vector<char> raw;
+  std::vector<char> packed;
+  size_t raw_len;
+  bool corrupt;
+};
+
+#endif
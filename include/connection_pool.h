@@ -0,0 +1,226 @@
+#ifndef CONNECTION_POOL_H
+#define CONNECTION_POOL_H
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// How long a resolved hostname is reused before it is looked up again
+#define DNS_CACHE_TTL_SEC 300
+// Idle connections kept for reuse; more are closed when handed back
+#define POOL_MAX_IDLE 16
+// Keepalive probes: first after this much idle time, then every
+// interval, giving up after count unanswered probes
+#define KEEPALIVE_IDLE_SEC 30
+#define KEEPALIVE_INTERVAL_SEC 10
+#define KEEPALIVE_COUNT 3
+
+/**
+ * @brief A resolved server address, ready for connect()
+ */
+struct ServerAddress {
+  struct sockaddr_storage addr;
+  socklen_t len;
+};
+
+/**
+ * @brief Hostname (or literal address) lookups, remembered for a while
+ * so reconnects and extra transfer streams skip the resolver.
+ */
+class DnsCache {
+ public:
+  DnsCache() { pthread_mutex_init(&lock, nullptr); }
+  ~DnsCache() { pthread_mutex_destroy(&lock); }
+
+  DnsCache(const DnsCache &) = delete;
+  DnsCache &operator=(const DnsCache &) = delete;
+
+  /**
+   * @brief Resolve host:port, from the cache while the entry is fresh
+   * @return false if the name does not resolve
+   */
+  bool resolve(const std::string &host, int port, ServerAddress &out) {
+    std::string key = host + ":" + std::to_string(port);
+    time_t now = time(nullptr);
+    pthread_mutex_lock(&lock);
+    auto it = entries.find(key);
+    if (it != entries.end() && now - it->second.resolved < DNS_CACHE_TTL_SEC) {
+      out = it->second.address;
+      pthread_mutex_unlock(&lock);
+      return true;
+    }
+    pthread_mutex_unlock(&lock);
+
+    struct addrinfo hints, *res = nullptr;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &res) != 0 || !res) {
+      return false;
+    }
+    memcpy(&out.addr, res->ai_addr, res->ai_addrlen);
+    out.len = res->ai_addrlen;
+    freeaddrinfo(res);
+
+    pthread_mutex_lock(&lock);
+    entries[key] = Entry{out, now};
+    pthread_mutex_unlock(&lock);
+    return true;
+  }
+
+  /**
+   * @brief Forget host:port (its address stopped answering)
+   */
+  void forget(const std::string &host, int port) {
+    pthread_mutex_lock(&lock);
+    entries.erase(host + ":" + std::to_string(port));
+    pthread_mutex_unlock(&lock);
+  }
+
+ private:
+  struct Entry {
+    ServerAddress address;
+    time_t resolved;
+  };
+
+  pthread_mutex_t lock;
+  std::unordered_map<std::string, Entry> entries;
+};
+
+/**
+ * @brief Options every client connection gets: no Nagle delay for the
+ * small request/status lines, and keepalive so a dead peer is noticed
+ */
+inline void tune_client_socket(int fd) {
+  int on = 1, idle = KEEPALIVE_IDLE_SEC, interval = KEEPALIVE_INTERVAL_SEC, count = KEEPALIVE_COUNT;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+  setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+  setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+  setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+  setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count));
+}
+
+/**
+ * @brief Open a tuned connection to a resolved address
+ * @return the socket, -1 on failure (errno is set)
+ */
+inline int connect_address(const ServerAddress &address) {
+  int fd = socket(address.addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) return -1;
+  if (connect(fd, (const struct sockaddr *)&address.addr, address.len) < 0) {
+    int err = errno;
+    close(fd);
+    errno = err;
+    return -1;
+  }
+  tune_client_socket(fd);
+  return fd;
+}
+
+/**
+ * @brief Whether an idle connection is still usable
+ * Idle means nothing is owed to us: readable data (or EOF, or an error)
+ * means the server hung up or the stream is out of step.
+ */
+inline bool connection_idle_ok(int fd) {
+  struct pollfd pfd = {fd, POLLIN, 0};
+  int n;
+  do {
+    n = poll(&pfd, 1, 0);
+  } while (n < 0 && errno == EINTR);
+  return n == 0;
+}
+
+/**
+ * @brief Idle plain connections to one server, kept for reuse
+ * Transfer streams ask for a connection and hand it back once their last
+ * response is read; connections that died while parked are dropped on
+ * the way out. Safe to share between threads.
+ */
+class ConnectionPool {
+ public:
+  ConnectionPool() : has_address(false) { pthread_mutex_init(&lock, nullptr); }
+  ~ConnectionPool() {
+    clear();
+    pthread_mutex_destroy(&lock);
+  }
+
+  ConnectionPool(const ConnectionPool &) = delete;
+  ConnectionPool &operator=(const ConnectionPool &) = delete;
+
+  /**
+   * @brief Point the pool at a (new) server, dropping idle connections
+   */
+  void reset(const ServerAddress &addr) {
+    clear();
+    pthread_mutex_lock(&lock);
+    address = addr;
+    has_address = true;
+    pthread_mutex_unlock(&lock);
+  }
+
+  /**
+   * @brief A healthy idle connection, else a new one
+   * @return -1 if the server can't be reached
+   */
+  int acquire() {
+    pthread_mutex_lock(&lock);
+    while (!idle.empty()) {
+      int fd = idle.back();
+      idle.pop_back();
+      if (connection_idle_ok(fd)) {
+        pthread_mutex_unlock(&lock);
+        return fd;
+      }
+      close(fd);
+    }
+    if (!has_address) {
+      pthread_mutex_unlock(&lock);
+      return -1;
+    }
+    ServerAddress addr = address;
+    pthread_mutex_unlock(&lock);
+    return connect_address(addr);
+  }
+
+  /**
+   * @brief Hand back a connection with no request outstanding
+   */
+  void release(int fd) {
+    pthread_mutex_lock(&lock);
+    if (idle.size() < POOL_MAX_IDLE) {
+      idle.push_back(fd);
+      fd = -1;
+    }
+    pthread_mutex_unlock(&lock);
+    if (fd >= 0) close(fd);
+  }
+
+  /**
+   * @brief Close every idle connection
+   */
+  void clear() {
+    pthread_mutex_lock(&lock);
+    for (int fd : idle) close(fd);
+    idle.clear();
+    pthread_mutex_unlock(&lock);
+  }
+
+ private:
+  pthread_mutex_t lock;
+  std::vector<int> idle;
+  ServerAddress address;
+  bool has_address;
+};
+
+#endif
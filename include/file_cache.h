@@ -0,0 +1,180 @@
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+#include <pthread.h>
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Shards in the cache; each has its own lock and LRU list
+#define FILE_CACHE_SHARDS 16
+// Files above this size are never cached
+#define FILE_CACHE_MAX_OBJECT (1024 * 1024)
+
+/**
+ * @brief Counters reported by FileCache::stats()
+ */
+struct FileCacheStats {
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t entries;
+  uint64_t bytes;
+  uint64_t capacity;
+};
+
+/**
+ * @brief Size-bounded, sharded LRU cache of whole file contents
+ *
+ * Keys are client filenames. Values are immutable buffers handed out as
+ * shared_ptr, so an entry evicted or invalidated while being sent stays
+ * alive until the sender drops it. The caller is responsible for
+ * consistency with the filesystem: insert while holding the file's shared
+ * lock and invalidate while holding it exclusively.
+ */
+class FileCache {
+ public:
+  typedef std::shared_ptr<const std::string> Data;
+
+  FileCache() : capacity(0), hits(0), misses(0) {
+    for (Shard &shard : shards) {
+      pthread_mutex_init(&shard.lock, nullptr);
+      shard.bytes = 0;
+    }
+  }
+
+  ~FileCache() {
+    for (Shard &shard : shards) {
+      pthread_mutex_destroy(&shard.lock);
+    }
+  }
+
+  FileCache(const FileCache &) = delete;
+  FileCache &operator=(const FileCache &) = delete;
+
+  /**
+   * @brief Set the memory cap in bytes (0 disables the cache)
+   * Call before the cache is shared between threads.
+   */
+  void set_capacity(size_t bytes) { capacity = bytes; }
+
+  bool enabled() const { return capacity > 0; }
+
+  /**
+   * @brief Largest file worth caching under the current cap
+   */
+  size_t max_object_size() const {
+    return std::min((size_t)FILE_CACHE_MAX_OBJECT, capacity / FILE_CACHE_SHARDS);
+  }
+
+  /**
+   * @brief Look up a file, refreshing its LRU position
+   * @return nullptr on a miss
+   */
+  Data get(const std::string &key) {
+    if (!enabled()) return nullptr;
+    Shard &shard = shard_for(key);
+    pthread_mutex_lock(&shard.lock);
+    auto it = shard.index.find(key);
+    if (it == shard.index.end()) {
+      pthread_mutex_unlock(&shard.lock);
+      misses.fetch_add(1, std::memory_order_relaxed);
+      return nullptr;
+    }
+    shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+    Data data = it->second->data;
+    pthread_mutex_unlock(&shard.lock);
+    hits.fetch_add(1, std::memory_order_relaxed);
+    return data;
+  }
+
+  /**
+   * @brief Insert or replace a file, evicting least recently used entries
+   */
+  void put(const std::string &key, Data data) {
+    if (!enabled() || !data || data->size() > max_object_size()) return;
+    Shard &shard = shard_for(key);
+    size_t shard_cap = capacity / FILE_CACHE_SHARDS;
+    pthread_mutex_lock(&shard.lock);
+    erase_locked(shard, key);
+    shard.lru.push_front(Entry{key, data});
+    shard.index[key] = shard.lru.begin();
+    shard.bytes += data->size();
+    while (shard.bytes > shard_cap && !shard.lru.empty()) {
+      erase_locked(shard, shard.lru.back().key);
+    }
+    pthread_mutex_unlock(&shard.lock);
+  }
+
+  /**
+   * @brief Drop a file (after it was replaced or deleted)
+   */
+  void invalidate(const std::string &key) {
+    if (!enabled()) return;
+    Shard &shard = shard_for(key);
+    pthread_mutex_lock(&shard.lock);
+    erase_locked(shard, key);
+    pthread_mutex_unlock(&shard.lock);
+  }
+
+  /**
+   * @brief Drop everything (when changes may have been missed)
+   */
+  void clear() {
+    for (Shard &shard : shards) {
+      pthread_mutex_lock(&shard.lock);
+      shard.lru.clear();
+      shard.index.clear();
+      shard.bytes = 0;
+      pthread_mutex_unlock(&shard.lock);
+    }
+  }
+
+  FileCacheStats stats() {
+    FileCacheStats st = {hits.load(), misses.load(), 0, 0, capacity};
+    for (Shard &shard : shards) {
+      pthread_mutex_lock(&shard.lock);
+      st.entries += shard.index.size();
+      st.bytes += shard.bytes;
+      pthread_mutex_unlock(&shard.lock);
+    }
+    return st;
+  }
+
+ private:
+  struct Entry {
+    std::string key;
+    Data data;
+  };
+
+  struct Shard {
+    pthread_mutex_t lock;
+    std::list<Entry> lru;  // most recently used first
+    std::unordered_map<std::string, std::list<Entry>::iterator> index;
+    size_t bytes;
+  };
+
+  Shard &shard_for(const std::string &key) {
+    return shards[std::hash<std::string>{}(key) % FILE_CACHE_SHARDS];
+  }
+
+  void erase_locked(Shard &shard, const std::string &key) {
+    auto it = shard.index.find(key);
+    if (it == shard.index.end()) return;
+    shard.bytes -= it->second->data->size();
+    shard.lru.erase(it->second);
+    shard.index.erase(it);
+  }
+
+  size_t capacity;
+  Shard shards[FILE_CACHE_SHARDS];
+  std::atomic<uint64_t> hits;
+  std::atomic<uint64_t> misses;
+};
+
+#endif
@@ -0,0 +1,86 @@
+#ifndef FILE_INDEX_H
+#define FILE_INDEX_H
+
+#include <pthread.h>
+#include <cstddef>
+#include <iterator>
+#include <set>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/**
+ * @brief Sorted in-memory set of stored filenames
+ *
+ * Answers LIST without touching the directory: a prefix query is a
+ * lower_bound() plus a walk over the matching names, so it costs about
+ * the size of the result. Pages are addressed by the last name already
+ * seen rather than an offset, which keeps them stable while files come
+ * and go between requests.
+ */
+class FileIndex {
+ public:
+  FileIndex() { pthread_rwlock_init(&lock, nullptr); }
+  ~FileIndex() { pthread_rwlock_destroy(&lock); }
+
+  FileIndex(const FileIndex &) = delete;
+  FileIndex &operator=(const FileIndex &) = delete;
+
+  void add(const std::string &name) {
+    pthread_rwlock_wrlock(&lock);
+    names.insert(name);
+    pthread_rwlock_unlock(&lock);
+  }
+
+  void remove(const std::string &name) {
+    pthread_rwlock_wrlock(&lock);
+    names.erase(name);
+    pthread_rwlock_unlock(&lock);
+  }
+
+  /**
+   * @brief Replace the whole index (after a directory rescan)
+   */
+  void reset(std::vector<std::string> &&scanned) {
+    std::set<std::string> fresh(std::make_move_iterator(scanned.begin()),
+                                std::make_move_iterator(scanned.end()));
+    pthread_rwlock_wrlock(&lock);
+    names.swap(fresh);
+    pthread_rwlock_unlock(&lock);
+  }
+
+  size_t size() {
+    pthread_rwlock_rdlock(&lock);
+    size_t n = names.size();
+    pthread_rwlock_unlock(&lock);
+    return n;
+  }
+
+  /**
+   * @brief Collect names starting with prefix, in order
+   * @param after only names sorting after this one (empty: from the start)
+   * @param limit maximum number of names, 0 for all of them
+   * @return true if more matching names follow the returned page
+   */
+  bool list(std::string_view prefix, std::string_view after, size_t limit,
+            std::vector<std::string> &out) {
+    pthread_rwlock_rdlock(&lock);
+    auto it = !after.empty() && after >= prefix ? names.upper_bound(std::string(after))
+                                                  : names.lower_bound(std::string(prefix));
+    for (; it != names.end() && it->compare(0, prefix.size(), prefix) == 0; ++it) {
+      if (limit && out.size() == limit) {
+        pthread_rwlock_unlock(&lock);
+        return true;
+      }
+      out.push_back(*it);
+    }
+    pthread_rwlock_unlock(&lock);
+    return false;
+  }
+
+ private:
+  pthread_rwlock_t lock;
+  std::set<std::string> names;
+};
+
+#endif
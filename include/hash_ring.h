@@ -0,0 +1,71 @@
+#ifndef HASH_RING_H
+#define HASH_RING_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "xxhash64.h"
+
+// Points each node gets on the ring: more even out how many names each
+// node owns, at the cost of a longer table to search
+#define RING_POINTS_PER_NODE 64
+
+/**
+ * @brief Consistent hashing of names onto cluster nodes
+ *
+ * Every node is hashed onto a 64-bit ring at RING_POINTS_PER_NODE points.
+ * A name belongs to the nodes of the first points at or after its own
+ * hash, walking clockwise and skipping nodes already chosen, so its
+ * replicas always land on distinct nodes. Everyone who builds the ring
+ * from the same node list agrees on every owner, and a node joining or
+ * leaving only moves the names next to its own points.
+ */
+class HashRing {
+ public:
+  /**
+   * @brief Rebuild the ring over nodes ("host:port" each)
+   */
+  void reset(const std::vector<std::string> &members) {
+    nodes = members;
+    points.clear();
+    points.reserve(nodes.size() * RING_POINTS_PER_NODE);
+    for (size_t i = 0; i < nodes.size(); ++i) {
+      for (int p = 0; p < RING_POINTS_PER_NODE; ++p) {
+        std::string point = nodes[i] + "#" + std::to_string(p);
+        points.emplace_back(xxh64(point.data(), point.size()), (uint32_t)i);
+      }
+    }
+    std::sort(points.begin(), points.end());
+  }
+
+  size_t size() const { return nodes.size(); }
+  const std::string &node(size_t index) const { return nodes[index]; }
+  const std::vector<std::string> &members() const { return nodes; }
+
+  /**
+   * @brief The (indexes of the) replicas nodes that own name, primary first
+   * Fewer when the ring has fewer nodes than that.
+   */
+  std::vector<size_t> owners(const std::string &name, size_t replicas) const {
+    std::vector<size_t> out;
+    replicas = std::min(replicas, nodes.size());
+    if (replicas == 0) return out;
+    uint64_t hash = xxh64(name.data(), name.size());
+    auto it = std::lower_bound(points.begin(), points.end(), std::make_pair(hash, (uint32_t)0));
+    for (size_t walked = 0; walked < points.size() && out.size() < replicas; ++walked, ++it) {
+      if (it == points.end()) it = points.begin();
+      if (std::find(out.begin(), out.end(), it->second) == out.end()) out.push_back(it->second);
+    }
+    return out;
+  }
+
+ private:
+  std::vector<std::string> nodes;
+  std::vector<std::pair<uint64_t, uint32_t>> points;   // (position, node), sorted
+};
+
+#endif
@@ -0,0 +1,98 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// Histogram buckets, HdrHistogram style: values below 2^HISTOGRAM_SUB_BITS
+// get a bucket each, bigger ones are split by power of two and then into
+// 2^HISTOGRAM_SUB_BITS linear steps, so a bucket is never wider than 1/16
+// of the values it holds. Values from 2^HISTOGRAM_MAX_BITS up share the
+// last bucket.
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_MAX_BITS 40
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
+
+/**
+ * @brief Latency histogram that any number of threads record into at once
+ *
+ * record() is three relaxed atomic adds and no lock. Readers add up a
+ * snapshot that may be a request or two out of step with the counters
+ * beside it, which percentiles don't mind.
+ */
+class LatencyHistogram {
+ public:
+  LatencyHistogram() : total(0), sum(0) {
+    for (auto &bucket : buckets) bucket.store(0, std::memory_order_relaxed);
+  }
+
+  LatencyHistogram(const LatencyHistogram &) = delete;
+  LatencyHistogram &operator=(const LatencyHistogram &) = delete;
+
+  void record(uint64_t value) {
+    buckets[index(value)].fetch_add(1, std::memory_order_relaxed);
+    total.fetch_add(1, std::memory_order_relaxed);
+    sum.fetch_add(value, std::memory_order_relaxed);
+  }
+
+  uint64_t count() const { return total.load(std::memory_order_relaxed); }
+  uint64_t total_value() const { return sum.load(std::memory_order_relaxed); }
+
+  /**
+   * @brief The value at quantile q (0..1): the top of the bucket holding
+   * it, so never under the true value by more than the bucket width
+   * @return 0 while empty
+   */
+  uint64_t percentile(double q) const {
+    uint64_t counts[HISTOGRAM_BUCKETS], seen = 0;
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+      counts[i] = buckets[i].load(std::memory_order_relaxed);
+      seen += counts[i];
+    }
+    if (seen == 0) return 0;
+    uint64_t rank = (uint64_t)(q * seen);
+    if (rank >= seen) rank = seen - 1;
+    uint64_t below = 0;
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+      below += counts[i];
+      if (below > rank) return upper_bound(i);
+    }
+    return upper_bound(HISTOGRAM_BUCKETS - 1);
+  }
+
+  static size_t index(uint64_t value) {
+    const uint64_t sub = 1ULL << HISTOGRAM_SUB_BITS;
+    if (value < sub) return (size_t)value;
+    if (value >> HISTOGRAM_MAX_BITS) return HISTOGRAM_BUCKETS - 1;
+    int shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BITS;
+    return (size_t)(((shift + 1) << HISTOGRAM_SUB_BITS) + ((value >> shift) - sub));
+  }
+
+  static uint64_t upper_bound(size_t index) {
+    const uint64_t sub = 1ULL << HISTOGRAM_SUB_BITS;
+    if (index < sub) return index;
+    int shift = (int)(index >> HISTOGRAM_SUB_BITS) - 1;
+    uint64_t step = index & (sub - 1);
+    return ((sub + step + 1) << shift) - 1;
+  }
+
+ private:
+  std::atomic<uint64_t> buckets[HISTOGRAM_BUCKETS];
+  std::atomic<uint64_t> total;
+  std::atomic<uint64_t> sum;
+};
+
+/**
+ * @brief Everything counted for one kind of request
+ * Aligned so two operations' counters never share a cache line.
+ */
+struct alignas(64) OpMetrics {
+  std::atomic<uint64_t> requests{0};
+  std::atomic<uint64_t> errors{0};      // answered with ERROR
+  std::atomic<uint64_t> bytes_in{0};    // payload received
+  std::atomic<uint64_t> bytes_out{0};   // payload sent
+  LatencyHistogram latency_ns;
+};
+
+#endif
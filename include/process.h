@@ -3,20 +3,65 @@
 
 #include <unistd.h>
 
+#include "arena.h"
+
+// Token slots every Process starts with before its argv has to grow
+#define PROCESS_INLINE_TOKENS 8
+// Most redirections one command can carry
+#define PROCESS_MAX_REDIRECTS 8
+
+enum RedirectKind {
+  REDIRECT_IN,      // n< file
+  REDIRECT_OUT,     // n> file
+  REDIRECT_APPEND,  // n>> file
+  REDIRECT_DUP,     // n>&m
+  REDIRECT_HERE     // <<< text
+};
+
+/**
+ * @brief One redirection, applied in the order written (as in sh, so
+ * "> f 2>&1" and "2>&1 > f" differ)
+ */
+struct Redirect {
+  int fd;              // the command's descriptor being replaced
+  RedirectKind kind;
+  const char *target;  // file name, or the here-string text
+  int source;          // DUP: descriptor copied; otherwise what the shell opened, -1 until then
+};
+
 class Process {
  public:
-  Process(bool _pipe_in_flag, bool _pipe_out_flag);
+  /**
+   * @param _arena where a grown argv goes; without one it is heap
+   * allocated and freed with the Process
+   */
+  Process(bool _pipe_in_flag, bool _pipe_out_flag, Arena *_arena = nullptr);
   ~Process();
 
+  Process(const Process &) = delete;
+  Process &operator=(const Process &) = delete;
+
   void add_token(char *tok);
+  bool add_redirect(int fd, RedirectKind kind, const char *target, int source = -1);
+  void close_redirects();
   int get_size() const;
   char* get_token(int i) const;
 
-  char *cmdTokens[25];
+  char **cmdTokens;  // tok_index tokens, always followed by a nullptr (execvp-ready)
   bool pipe_in;
   bool pipe_out;
+  bool background;  // ended with '&'
   int pipe_fd[2];
+  int in_fd;    // builtin in a pipeline: the stage's own ends, -1 for
+  int out_fd;   // the shell's stdin/stdout
+  Redirect redirects[PROCESS_MAX_REDIRECTS];
+  int redirect_count;
   int tok_index;
+
+ private:
+  Arena *arena;
+  int tok_capacity;
+  char *inline_tokens[PROCESS_INLINE_TOKENS];
 };
 
 #endif
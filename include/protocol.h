@@ -4,25 +4,139 @@
 #include <string>
 #include <vector>
 #include <cstring>
+#include <cstdio>
+#include <cctype>
 #include <sstream>
+#include <algorithm>
+#include <cerrno>
+#include <memory>
+#include <cstdint>
+#include <string_view>
 
 #define MAX_FILENAME_LEN 256
 #define BUFFER_SIZE 8192
 
+// LIST[|<prefix>[|<limit>[|<after>]]]: names starting with <prefix>, at
+// most <limit> of them (0: all), sorted and beginning after the name
+// <after>. A page that stopped early is answered with OK|File list|more.
 #define CMD_LIST "LIST"
+#define LIST_MORE "more"
 #define CMD_UPLOAD "UPLOAD"
 #define CMD_DOWNLOAD "DOWNLOAD"
 #define CMD_DELETE "DELETE"
+#define CMD_HELLO "HELLO"
+// Server counters, answered with OK|<key=value ...>
+#define CMD_STATS "STATS"
+
+// Batch commands: MUPLOAD|<count> and MDELETE|<count> are followed by
+// <count> entries; MDOWNLOAD|<pattern> is answered with an entry per
+// matching file. Each batch gets a single status response at the end.
+#define CMD_MUPLOAD "MUPLOAD"
+#define CMD_MDOWNLOAD "MDOWNLOAD"
+#define CMD_MDELETE "MDELETE"
+// Batch entry: ENTRY|<name>|<size> then <size> payload bytes
+#define CMD_ENTRY "ENTRY"
+#define MAX_BATCH_ENTRIES 100000
+
+// Ranges and resumable uploads:
+// DOWNLOAD|<name>|<offset>[|<length>] answers DATA|<n> with the n bytes
+// from <offset> (length 0 or absent: to the end).
+// UPLOAD|<name>|<len>|<offset>|<token> writes the <len> bytes following
+// into the partial upload <token> at <offset>, which must be exactly the
+// bytes it holds (0 starts over), then stores the completed file. If the connection drops
+// the partial upload is kept; RESUME|<token> answers OK|<bytes held>.
+#define CMD_RESUME "RESUME"
+#define MAX_RESUME_TOKEN_LEN 64
+// SIZE|<name> answers OK|<bytes>|<version>, so a client can split a
+// download; <version> changes whenever the file is replaced, so a resumed
+// download can check it is appending to the same file
+#define CMD_SIZE "SIZE"
+
+// Parallel uploads: PART|<token>|<len>|<offset> and <len> bytes, written
+// at <offset> of the partial upload <token>, from any number of
+// connections at once; COMMIT|<name>|<size>|<token> then stores it once
+// PARTs have covered all of [0, size)
+#define CMD_PART "PART"
+#define CMD_COMMIT "COMMIT"
+
+// CLAIM|<name>|<size>|<key>: store <name> as a copy of content the server
+// already holds, named by content_key() (a SHA-256, so a key can't be
+// forged for other content); ERROR means upload it instead
+#define CMD_CLAIM "CLAIM"
+
+// CLUSTER answers OK|<replicas>|<host:port>|... with every node of the
+// cluster the server belongs to (ERROR when it runs alone). Clients place
+// each name on <replicas> of them by consistent hashing (hash_ring.h) and
+// copy a file to owners that lack it when they read it; the servers
+// themselves neither replicate nor rebalance.
+#define CMD_CLUSTER "CLUSTER"
+
+// Optional features a client can ask for with HELLO|<feature>|...
+#define FEATURE_PIPELINE "pipeline"
+#define FEATURE_BINARY "binary"
+#define FEATURE_BATCH "batch"
+#define FEATURE_DEDUP "dedup"  // server runs a content-addressed store
+#define FEATURE_RESUME "resume"  // ranges, RESUME and SIZE
+#define FEATURE_PARALLEL "parallel"  // PART and COMMIT
+#define FEATURE_DEFLATE "deflate"  // file payloads as compressed chunks (compress.h)
+
+// Pipelined requests and their status lines start with "#<id>|"
+#define REQUEST_TAG_PREFIX '#'
 
 #define RESP_OK "OK"
 #define RESP_ERROR "ERROR"
 #define RESP_DATA "DATA"
+// ERROR|busy|<ms>: the server is saturated and closed the connection
+// without running the request; reconnect after <ms> milliseconds
+#define RESP_BUSY "busy"
+
+/*
+ * Binary framing (after HELLO|binary is accepted). Every request and
+ * response is a fixed 16 byte header, all fields big-endian:
+ *
+ *   u8 opcode | u8 flags | u16 name_len | u32 id | u64 payload_len
+ *
+ * followed by name_len bytes of name (the filename in requests, the status
+ * message in responses) and then payload_len bytes of payload. Responses
+ * echo the request id, so binary connections are always pipelined.
+ * MUPLOAD/MDELETE frames carry the entry count in payload_len; batch
+ * entries are OP_ENTRY frames in both directions.
+ */
+#define FRAME_HEADER_SIZE 16
+
+enum : uint8_t {
+    OP_LIST = 1,
+    OP_UPLOAD = 2,
+    OP_DOWNLOAD = 3,
+    OP_DELETE = 4,
+    OP_MUPLOAD = 5,
+    OP_MDOWNLOAD = 6,   // name is a glob pattern
+    OP_MDELETE = 7,
+    OP_ENTRY = 8,
+    OP_STATS = 9,
+    OP_CLAIM = 10,      // name is "<name>\0<key>", payload_len the size
+    OP_RESUME = 11,     // name is the token
+    OP_SIZE = 12,
+    OP_PART = 13,       // name is the token, arg the offset
+    OP_COMMIT = 14,     // payload_len is the size (nothing follows), arg the token
+    OP_CLUSTER = 15,
+
+    OP_OK = 0x80,
+    OP_ERROR = 0x81,
+    OP_DATA = 0x82,   // payload_len bytes of file data follow
+};
 
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <endian.h>
 #include <unistd.h>
 
+// Window mapped at a time when sendfile() is unavailable
+#define MMAP_WINDOW_SIZE (8 * 1024 * 1024)
+
 
 
 /**
@@ -39,37 +153,231 @@ inline std::vector<std::string> split_string(const std::string& str, char delim)
 }
 
 /**
- * @brief Read a line from socket (blocking)
+ * @brief Tag to prepend to a pipelined request or its status line
+ */
+inline std::string request_tag(uint64_t id) {
+    return std::string(1, REQUEST_TAG_PREFIX) + std::to_string(id) + "|";
+}
+
+/**
+ * @brief Split "#<id>|rest" into id and rest
+ * @return false if the line is not a well-formed tagged line
+ */
+inline bool parse_request_tag(const std::string& line, uint64_t& id, std::string& rest) {
+    if (line.size() < 3 || line[0] != REQUEST_TAG_PREFIX) return false;
+    size_t bar = line.find('|');
+    if (bar == std::string::npos || bar == 1) return false;
+    id = 0;
+    for (size_t i = 1; i < bar; ++i) {
+        if (line[i] < '0' || line[i] > '9') return false;
+        id = id * 10 + (line[i] - '0');
+    }
+    rest = line.substr(bar + 1);
+    return true;
+}
+
+/**
+ * @brief Buffered reader for one connected socket
+ *
+ * Pulls data off the socket in BUFFER_SIZE chunks and hands it out as
+ * lines or raw bytes. Header lines and payload share the same buffer, so
+ * bytes that arrive in the same recv() as a header are passed through to
+ * the payload read instead of being lost. Use one reader per connection
+ * and never mix it with direct recv() calls on the same fd. The buffer is
+ * allocated on first use and can be dropped while the connection idles.
+ */
+class SocketReader {
+  public:
+    explicit SocketReader(int _fd = -1) : fd(_fd), head(0), tail(0) {}
+
+    /**
+     * @brief Attach to a (new) socket and drop anything still buffered
+     */
+    void reset(int _fd) {
+        fd = _fd;
+        head = tail = 0;
+    }
+
+    size_t buffered() const { return tail - head; }
+
+    /**
+     * @brief True when a complete line is already buffered
+     */
+    bool has_line() const {
+        return buffered() > 0 && memchr(buf.get() + head, '\n', buffered()) != nullptr;
+    }
+
+    /**
+     * @brief True when a complete frame header and its name are buffered
+     * Oversized names also count, so the caller gets to reject them.
+     */
+    bool has_frame() const {
+        if (buffered() < FRAME_HEADER_SIZE) return false;
+        uint16_t name_len;
+        memcpy(&name_len, buf.get() + head + 2, sizeof(name_len));
+        name_len = be16toh(name_len);
+        return name_len > MAX_FILENAME_LEN || buffered() >= (size_t)FRAME_HEADER_SIZE + name_len;
+    }
+
+    /**
+     * @brief Make n contiguous bytes available without consuming them
+     * @return Pointer into the buffer (valid until the next read), or
+     * nullptr on error/disconnect or if n exceeds BUFFER_SIZE
+     */
+    const char* peek(size_t n) {
+        if (n > BUFFER_SIZE) return nullptr;
+        while (buffered() < n) {
+            if (fill_available() <= 0) return nullptr;
+        }
+        return buf.get() + head;
+    }
+
+    /**
+     * @brief Drop n bytes returned by peek()
+     */
+    void consume(size_t n) {
+        head += std::min(n, buffered());
+    }
+
+    /**
+     * @brief Read one '\n' terminated line, '\r' is stripped
+     * @return false on error/disconnect
+     */
+    bool next_line(std::string& line) {
+        line.clear();
+        while (true) {
+            if (buffered() > 0) {
+                char* start = buf.get() + head;
+                char* nl = static_cast<char*>(memchr(start, '\n', tail - head));
+                size_t len = nl ? (size_t)(nl - start) : tail - head;
+                for (size_t i = 0; i < len; ++i) {
+                    if (start[i] != '\r') line += start[i];
+                }
+                head += len;
+                if (nl) {
+                    ++head;
+                    return true;
+                }
+            }
+            if (fill_available() <= 0) return false;
+        }
+    }
+
+    /**
+     * @brief Read up to len bytes: buffered bytes first, else one recv()
+     * @return Bytes copied, 0 on disconnect, -1 on error
+     */
+    ssize_t read_some(char* dst, size_t len) {
+        if (buffered() > 0) {
+            size_t n = std::min(len, buffered());
+            memcpy(dst, buf.get() + head, n);
+            head += n;
+            return n;
+        }
+        ssize_t n;
+        do {
+            n = recv(fd, dst, len, 0);
+        } while (n < 0 && errno == EINTR);
+        return n;
+    }
+
+    /**
+     * @brief Read exactly len bytes
+     */
+    bool read_exact(char* dst, size_t len) {
+        size_t total = 0;
+        while (total < len) {
+            ssize_t n = read_some(dst + total, len - total);
+            if (n <= 0) return false;
+            total += n;
+        }
+        return true;
+    }
+
+    /**
+     * @brief One recv() into the free space behind the buffered bytes
+     * Safe on non-blocking sockets; fails with EMSGSIZE when a single line
+     * does not fit in BUFFER_SIZE.
+     * @return Bytes read, 0 on disconnect, -1 on error (errno is set)
+     */
+    ssize_t fill_available() {
+        if (!buf) buf.reset(new char[BUFFER_SIZE]);
+        if (head > 0) {
+            memmove(buf.get(), buf.get() + head, tail - head);
+            tail -= head;
+            head = 0;
+        }
+        if (tail == BUFFER_SIZE) {
+            errno = EMSGSIZE;
+            return -1;
+        }
+        ssize_t n;
+        do {
+            n = recv(fd, buf.get() + tail, BUFFER_SIZE - tail, 0);
+        } while (n < 0 && errno == EINTR);
+        if (n > 0) tail += n;
+        return n;
+    }
+
+    /**
+     * @brief Free the buffer while nothing is pending (idle connections)
+     */
+    void release_if_empty() {
+        if (head == tail) {
+            buf.reset();
+            head = tail = 0;
+        }
+    }
+
+    int fd;
+
+  private:
+    std::unique_ptr<char[]> buf;
+    size_t head;
+    size_t tail;
+};
+
+/**
+ * @brief Read a line through a connection's reader (blocking)
  * @return Empty string on error/disconnect
  */
-inline std::string read_line(int sockfd) {
+inline std::string read_line(SocketReader& reader) {
     std::string line;
-    char c;
-    while (true) {
-        ssize_t n = recv(sockfd, &c, 1, 0);
-        if (n <= 0) return "";
-        if (c == '\n') break;
-        if (c != '\r') line += c;
-    }
+    if (!reader.next_line(line)) return "";
     return line;
 }
 
 /**
  * @brief Send a line to socket
+ * Pass MSG_MORE when a payload follows so both leave in one segment.
  */
-inline bool send_line(int sockfd, const std::string& line) {
+inline bool send_line(int sockfd, const std::string& line, int flags = 0) {
     std::string msg = line + "\n";
-    ssize_t sent = send(sockfd, msg.c_str(), msg.length(), 0);
+    ssize_t sent = send(sockfd, msg.c_str(), msg.length(), flags);
     return sent == (ssize_t)msg.length();
 }
 
+/**
+ * @brief Write a whole buffer to a file descriptor (files, pipes)
+ */
+inline bool write_all(int fd, const char* data, size_t len) {
+    size_t total = 0;
+    while (total < len) {
+        ssize_t n = write(fd, data + total, len - total);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        total += n;
+    }
+    return true;
+}
+
 /**
  * @brief Send exact number of bytes
  */
-inline bool send_all(int sockfd, const char* data, size_t len) {
+inline bool send_all(int sockfd, const char* data, size_t len, int flags = 0) {
     size_t total = 0;
     while (total < len) {
-        ssize_t sent = send(sockfd, data + total, len - total, 0);
+        ssize_t sent = send(sockfd, data + total, len - total, flags);
         if (sent <= 0) return false;
         total += sent;
     }
@@ -77,15 +385,523 @@ inline bool send_all(int sockfd, const char* data, size_t len) {
 }
 
 /**
- * @brief Receive exact number of bytes
+ * @brief Send count bytes of a file starting at offset, without copying
+ * through userspace. Uses sendfile(); if the kernel refuses it for this fd
+ * pair, falls back to send() from a sliding mmap window.
  */
-inline bool recv_all(int sockfd, char* buffer, size_t len) {
+inline bool send_file(int sockfd, int filefd, off_t offset, size_t count) {
     size_t total = 0;
-    while (total < len) {
-        ssize_t received = recv(sockfd, buffer + total, len - total, 0);
-        if (received <= 0) return false;
-        total += received;
+    while (total < count) {
+        ssize_t sent = sendfile(sockfd, filefd, &offset, count - total);
+        if (sent < 0 && errno == EINTR) continue;
+        if (sent < 0 && total == 0 && (errno == EINVAL || errno == ENOSYS)) break;
+        if (sent <= 0) return false;
+        total += sent;
+    }
+    if (total == count) return true;
+
+    long page = sysconf(_SC_PAGESIZE);
+    while (total < count) {
+        off_t base = offset - (offset % page);
+        size_t skew = offset - base;
+        size_t len = std::min((size_t)MMAP_WINDOW_SIZE, count - total + skew);
+        void* map = mmap(nullptr, len, PROT_READ, MAP_SHARED, filefd, base);
+        if (map == MAP_FAILED) return false;
+        madvise(map, len, MADV_SEQUENTIAL);
+        bool ok = send_all(sockfd, (const char*)map + skew, len - skew);
+        munmap(map, len);
+        if (!ok) return false;
+        total += len - skew;
+        offset += len - skew;
+    }
+    return true;
+}
+
+/**
+ * @brief Receive exact number of bytes
+ */
+inline bool recv_all(SocketReader& reader, char* buffer, size_t len) {
+    return reader.read_exact(buffer, len);
+}
+
+/**
+ * @brief One request, text or binary
+ * name is a view: into the caller's string when encoding, into the line
+ * or the reader's buffer when decoding.
+ */
+struct Request {
+    uint8_t opcode;
+    uint64_t id;
+    bool tagged;        // text mode: carries "#<id>|"; binary: always
+    std::string_view name;  // LIST: the prefix
+    uint64_t payload_len;   // entry count for MUPLOAD/MDELETE, LIST page size, CLAIM size
+    // LIST: resume after this name; CLAIM: key; DOWNLOAD: "<offset>|<length>";
+    // UPLOAD: "<offset>|<token>" (empty: the plain forms); PART: offset;
+    // COMMIT: token
+    std::string_view arg = std::string_view();
+};
+
+/**
+ * @brief Whether an opcode carries Request::arg (after a NUL in binary names)
+ */
+inline bool request_has_arg(uint8_t opcode) {
+    return opcode == OP_LIST || opcode == OP_CLAIM || opcode == OP_DOWNLOAD || opcode == OP_UPLOAD
+           || opcode == OP_PART || opcode == OP_COMMIT;
+}
+
+/**
+ * @brief Name for a blob: SHA-256 of the content in hex, then its size
+ */
+inline std::string content_key(const std::string& digest, uint64_t size) {
+    return digest + "-" + std::to_string(size);
+}
+
+/**
+ * @brief Parse an unsigned decimal file size
+ */
+inline bool parse_size(std::string_view field, uint64_t& value) {
+    if (field.empty() || field.size() > 20) return false;
+    value = 0;
+    for (char c : field) {
+        if (c < '0' || c > '9') return false;
+        uint64_t next = value * 10 + (c - '0');
+        if (next / 10 != value) return false;
+        value = next;
+    }
+    return true;
+}
+
+/**
+ * @brief Split a "<offset>[|<rest>]" request argument
+ */
+inline bool parse_offset_arg(std::string_view arg, uint64_t& offset, std::string_view& rest) {
+    size_t bar = arg.find('|');
+    rest = bar == std::string_view::npos ? std::string_view() : arg.substr(bar + 1);
+    return parse_size(arg.substr(0, bar), offset);
+}
+
+/**
+ * @brief Resume tokens name a file on the server: keep them to [A-Za-z0-9_-]
+ */
+inline bool valid_resume_token(std::string_view token) {
+    if (token.empty() || token.size() > MAX_RESUME_TOKEN_LEN) return false;
+    for (char c : token) {
+        if (!isalnum((unsigned char)c) && c != '_' && c != '-') return false;
+    }
+    return true;
+}
+
+/**
+ * @brief One status response, text or binary
+ */
+struct Response {
+    uint8_t opcode;     // OP_OK, OP_ERROR or OP_DATA; 0 if nothing arrived
+    uint64_t id;
+    bool tagged;
+    std::string message;
+    uint64_t payload_len;
+
+    /**
+     * @brief The response as the classic text status line
+     */
+    std::string status_line() const {
+        if (opcode == OP_DATA) {
+            return std::string(RESP_OK) + "|" + RESP_DATA + "|" + std::to_string(payload_len);
+        }
+        return std::string(opcode == OP_OK ? RESP_OK : RESP_ERROR) + "|" + message;
+    }
+};
+
+inline void encode_frame_header(char* out, uint8_t opcode, uint16_t name_len,
+                                uint32_t id, uint64_t payload_len) {
+    out[0] = opcode;
+    out[1] = 0;
+    name_len = htobe16(name_len);
+    id = htobe32(id);
+    payload_len = htobe64(payload_len);
+    memcpy(out + 2, &name_len, 2);
+    memcpy(out + 4, &id, 4);
+    memcpy(out + 8, &payload_len, 8);
+}
+
+inline void decode_frame_header(const char* in, uint8_t& opcode, uint16_t& name_len,
+                                uint32_t& id, uint64_t& payload_len) {
+    opcode = in[0];
+    memcpy(&name_len, in + 2, 2);
+    memcpy(&id, in + 4, 4);
+    memcpy(&payload_len, in + 8, 8);
+    name_len = be16toh(name_len);
+    id = be32toh(id);
+    payload_len = be64toh(payload_len);
+}
+
+/**
+ * @brief Parse a "[#id|]CMD[|name[|size]]" line in place
+ * @return nullptr on success, else the error message to send back
+ */
+inline const char* parse_text_request(const std::string& line, bool allow_tags, Request& req) {
+    std::string_view rest(line);
+    req = Request{0, 0, false, std::string_view(), 0};
+
+    if (allow_tags && !rest.empty() && rest[0] == REQUEST_TAG_PREFIX) {
+        size_t bar = rest.find('|');
+        if (bar == std::string_view::npos || bar == 1) return "Invalid request tag";
+        for (size_t i = 1; i < bar; ++i) {
+            if (rest[i] < '0' || rest[i] > '9') return "Invalid request tag";
+            req.id = req.id * 10 + (rest[i] - '0');
+        }
+        req.tagged = true;
+        rest.remove_prefix(bar + 1);
+    }
+
+    size_t bar = rest.find('|');
+    std::string_view cmd = rest.substr(0, bar);
+    std::string_view args = bar == std::string_view::npos ? std::string_view() : rest.substr(bar + 1);
+    size_t bar2 = args.find('|');
+    std::string_view size_field = bar2 == std::string_view::npos ? std::string_view() : args.substr(bar2 + 1);
+    req.name = args.substr(0, bar2);
+
+    if (cmd == CMD_LIST) {
+        // The cursor is everything after the limit, so it may contain '|'
+        size_t bar3 = size_field.find('|');
+        std::string_view limit = size_field.substr(0, bar3);
+        if (limit.size() > 9) return "Invalid LIST limit";
+        for (char c : limit) {
+            if (c < '0' || c > '9') return "Invalid LIST limit";
+            req.payload_len = req.payload_len * 10 + (c - '0');
+        }
+        if (bar3 != std::string_view::npos) req.arg = size_field.substr(bar3 + 1);
+        req.opcode = OP_LIST;
+    } else if (cmd == CMD_STATS) {
+        req.opcode = OP_STATS;
+    } else if (cmd == CMD_CLUSTER) {
+        req.opcode = OP_CLUSTER;
+    } else if (cmd == CMD_UPLOAD) {
+        if (bar == std::string_view::npos || bar2 == std::string_view::npos) return "Invalid UPLOAD command";
+        size_t bar3 = size_field.find('|');
+        if (!parse_size(size_field.substr(0, bar3), req.payload_len)) return "Invalid UPLOAD size";
+        if (bar3 != std::string_view::npos) req.arg = size_field.substr(bar3 + 1);
+        req.opcode = OP_UPLOAD;
+    } else if (cmd == CMD_PART || cmd == CMD_COMMIT) {
+        size_t bar3 = size_field.find('|');
+        if (bar2 == std::string_view::npos || bar3 == std::string_view::npos) return "Invalid parallel upload command";
+        if (!parse_size(size_field.substr(0, bar3), req.payload_len)) return "Invalid parallel upload size";
+        req.arg = size_field.substr(bar3 + 1);
+        req.opcode = cmd == CMD_PART ? OP_PART : OP_COMMIT;
+    } else if (cmd == CMD_CLAIM) {
+        size_t bar3 = size_field.find('|');
+        if (bar2 == std::string_view::npos || bar3 == std::string_view::npos) return "Invalid CLAIM command";
+        if (!parse_size(size_field.substr(0, bar3), req.payload_len)) return "Invalid CLAIM size";
+        req.arg = size_field.substr(bar3 + 1);
+        req.opcode = OP_CLAIM;
+    } else if (cmd == CMD_DOWNLOAD) {
+        if (bar == std::string_view::npos) return "Invalid DOWNLOAD command";
+        req.arg = size_field;
+        req.opcode = OP_DOWNLOAD;
+    } else if (cmd == CMD_DELETE) {
+        if (bar == std::string_view::npos) return "Invalid DELETE command";
+        req.opcode = OP_DELETE;
+    } else if (cmd == CMD_SIZE) {
+        if (bar == std::string_view::npos) return "Invalid SIZE command";
+        req.name = args;
+        req.opcode = OP_SIZE;
+    } else if (cmd == CMD_RESUME) {
+        if (bar == std::string_view::npos) return "Invalid RESUME command";
+        req.name = args;
+        req.opcode = OP_RESUME;
+    } else if (cmd == CMD_MUPLOAD || cmd == CMD_MDELETE) {
+        if (bar == std::string_view::npos || args.empty() || args.size() > 9) return "Invalid batch count";
+        for (char c : args) {
+            if (c < '0' || c > '9') return "Invalid batch count";
+            req.payload_len = req.payload_len * 10 + (c - '0');
+        }
+        req.name = std::string_view();
+        req.opcode = cmd == CMD_MUPLOAD ? OP_MUPLOAD : OP_MDELETE;
+    } else if (cmd == CMD_MDOWNLOAD) {
+        if (bar == std::string_view::npos) return "Invalid MDOWNLOAD command";
+        req.name = args;  // the pattern may itself contain '|'
+        req.opcode = OP_MDOWNLOAD;
+    } else {
+        return "Unknown command";
+    }
+    return nullptr;
+}
+
+/**
+ * @brief Read the next binary request; req.name views the reader's buffer
+ * and stays valid until the reader next fills it
+ * @return false on disconnect or an oversized name
+ */
+inline bool next_frame_request(SocketReader& reader, Request& req) {
+    const char* hdr = reader.peek(FRAME_HEADER_SIZE);
+    if (!hdr) return false;
+    uint16_t name_len;
+    uint32_t id;
+    decode_frame_header(hdr, req.opcode, name_len, id, req.payload_len);
+    if (name_len > (request_has_arg(req.opcode) ? 2 * MAX_FILENAME_LEN + 1 : MAX_FILENAME_LEN)) return false;
+    const char* frame = reader.peek(FRAME_HEADER_SIZE + name_len);
+    if (!frame) return false;
+    req.id = id;
+    req.tagged = true;
+    req.name = std::string_view(frame + FRAME_HEADER_SIZE, name_len);
+    req.arg = std::string_view();
+    if (request_has_arg(req.opcode)) {
+        size_t nul = req.name.find('\0');
+        if (nul != std::string_view::npos) {
+            req.arg = req.name.substr(nul + 1);
+            req.name = req.name.substr(0, nul);
+        }
+    }
+    reader.consume(FRAME_HEADER_SIZE + name_len);
+    return true;
+}
+
+/**
+ * @brief Append a request to an output buffer
+ */
+inline void encode_request(std::string& out, bool binary, const Request& req) {
+    if (binary) {
+        char hdr[FRAME_HEADER_SIZE];
+        std::string name(req.name);
+        if (request_has_arg(req.opcode) && !req.arg.empty()) {
+            name += '\0';
+            name.append(req.arg);
+        }
+        encode_frame_header(hdr, req.opcode, name.size(), (uint32_t)req.id, req.payload_len);
+        out.append(hdr, sizeof(hdr));
+        out.append(name);
+        return;
+    }
+    if (req.tagged) out += request_tag(req.id);
+    switch (req.opcode) {
+        case OP_LIST:
+            out += CMD_LIST;
+            if (!req.name.empty() || req.payload_len || !req.arg.empty()) {
+                out += "|";
+                out.append(req.name);
+                out += "|" + std::to_string(req.payload_len) + "|";
+                out.append(req.arg);
+            }
+            out += "\n";
+            return;
+        case OP_STATS:     out += CMD_STATS; break;
+        case OP_CLUSTER:   out += CMD_CLUSTER; break;
+        case OP_UPLOAD:    out += std::string(CMD_UPLOAD) + "|"; break;
+        case OP_CLAIM:
+            out += std::string(CMD_CLAIM) + "|";
+            out.append(req.name);
+            out += "|" + std::to_string(req.payload_len) + "|";
+            out.append(req.arg);
+            out += "\n";
+            return;
+        case OP_DOWNLOAD:  out += std::string(CMD_DOWNLOAD) + "|"; break;
+        case OP_DELETE:    out += std::string(CMD_DELETE) + "|"; break;
+        case OP_RESUME:    out += std::string(CMD_RESUME) + "|"; break;
+        case OP_SIZE:      out += std::string(CMD_SIZE) + "|"; break;
+        case OP_PART:      out += std::string(CMD_PART) + "|"; break;
+        case OP_COMMIT:    out += std::string(CMD_COMMIT) + "|"; break;
+        case OP_MDOWNLOAD: out += std::string(CMD_MDOWNLOAD) + "|"; break;
+        case OP_MUPLOAD:
+        case OP_MDELETE:
+            out += std::string(req.opcode == OP_MUPLOAD ? CMD_MUPLOAD : CMD_MDELETE)
+                 + "|" + std::to_string(req.payload_len) + "\n";
+            return;
+    }
+    if (req.opcode != OP_STATS && req.opcode != OP_CLUSTER) out.append(req.name);
+    if (req.opcode == OP_UPLOAD || req.opcode == OP_PART || req.opcode == OP_COMMIT) {
+        out += "|" + std::to_string(req.payload_len);
+    }
+    if (!req.arg.empty()) {
+        out += "|";
+        out.append(req.arg);
+    }
+    out += "\n";
+}
+
+/**
+ * @brief Append a response to an output buffer
+ */
+inline void encode_response(std::string& out, bool binary, const Response& resp) {
+    if (binary) {
+        size_t name_len = std::min(resp.message.size(), (size_t)UINT16_MAX);
+        char hdr[FRAME_HEADER_SIZE];
+        encode_frame_header(hdr, resp.opcode, name_len, (uint32_t)resp.id, resp.payload_len);
+        out.append(hdr, sizeof(hdr));
+        out.append(resp.message, 0, name_len);
+        return;
+    }
+    if (resp.tagged) out += request_tag(resp.id);
+    out += resp.status_line();
+    out += "\n";
+}
+
+inline bool parse_response_line(const std::string& line, bool allow_tags, Response& resp);
+
+/**
+ * @brief Read one response (client side)
+ * @param allow_tags Accept a "#<id>|" prefix on text status lines
+ * @return false on disconnect/protocol error
+ */
+inline bool read_response(SocketReader& reader, bool binary, bool allow_tags, Response& resp) {
+    resp = Response{0, 0, false, "", 0};
+    if (binary) {
+        const char* hdr = reader.peek(FRAME_HEADER_SIZE);
+        if (!hdr) return false;
+        uint8_t opcode;
+        uint16_t name_len;
+        uint32_t id;
+        decode_frame_header(hdr, opcode, name_len, id, resp.payload_len);
+        reader.consume(FRAME_HEADER_SIZE);
+        resp.message.resize(name_len);
+        if (!reader.read_exact(&resp.message[0], name_len)) return false;
+        resp.opcode = opcode;
+        resp.id = id;
+        resp.tagged = true;
+        return true;
+    }
+
+    std::string line;
+    if (!reader.next_line(line) || line.empty()) return false;
+    return parse_response_line(line, allow_tags, resp);
+}
+
+/**
+ * @brief Parse a text status line ("[#id|]OK|...", "[#id|]ERROR|...")
+ */
+inline bool parse_response_line(const std::string& line, bool allow_tags, Response& resp) {
+    resp = Response{0, 0, false, "", 0};
+    std::string rest = line;
+    if (allow_tags && line[0] == REQUEST_TAG_PREFIX) {
+        if (!parse_request_tag(line, resp.id, rest)) return false;
+        resp.tagged = true;
+    }
+    std::vector<std::string> parts = split_string(rest, '|');
+    if (parts.empty()) return false;
+    if (parts[0] == RESP_OK && parts.size() >= 3 && parts[1] == RESP_DATA) {
+        resp.opcode = OP_DATA;
+        resp.payload_len = strtoull(parts[2].c_str(), nullptr, 10);
+        return true;
+    }
+    resp.opcode = parts[0] == RESP_OK ? OP_OK : OP_ERROR;
+    size_t bar = rest.find('|');
+    resp.message = bar == std::string::npos ? "" : rest.substr(bar + 1);
+    return true;
+}
+
+/**
+ * @brief Retry delay of a "busy" rejection
+ * @return milliseconds, -1 if resp is something else
+ */
+inline int busy_retry_after(const Response& resp) {
+    std::string prefix = std::string(RESP_BUSY) + "|";
+    if (resp.opcode != OP_ERROR || resp.message.compare(0, prefix.size(), prefix) != 0) return -1;
+    return std::max(0, atoi(resp.message.c_str() + prefix.size()));
+}
+
+/**
+ * @brief Append one LIST entry: a line in text mode, u16 length + bytes in
+ * binary mode (the text listing ends with an empty line)
+ */
+inline void encode_list_entry(std::string& out, bool binary, std::string_view name) {
+    if (binary) {
+        uint16_t len = htobe16((uint16_t)name.size());
+        out.append((const char*)&len, sizeof(len));
+        out.append(name);
+    } else {
+        out.append(name);
+        out += "\n";
+    }
+}
+
+/**
+ * @brief Whether a LIST response is a page with more names after it
+ */
+inline bool list_has_more(const Response& resp) {
+    std::string mark = std::string("|") + LIST_MORE;
+    return resp.message.size() >= mark.size()
+           && resp.message.compare(resp.message.size() - mark.size(), mark.size(), mark) == 0;
+}
+
+/**
+ * @brief Read the entries that follow a successful LIST response
+ */
+inline bool read_file_list(SocketReader& reader, bool binary, const Response& resp,
+                           std::vector<std::string>& names) {
+    if (!binary) {
+        // The classic listing is terminated by an empty line
+        std::string entry;
+        while (reader.next_line(entry)) {
+            if (entry.empty()) return true;
+            names.push_back(entry);
+        }
+        return false;
+    }
+    uint64_t remaining = resp.payload_len;
+    while (remaining >= 2) {
+        uint16_t len;
+        if (!reader.read_exact((char*)&len, sizeof(len))) return false;
+        len = be16toh(len);
+        if (len + 2u > remaining) return false;
+        std::string name(len, '\0');
+        if (!reader.read_exact(&name[0], len)) return false;
+        names.push_back(name);
+        remaining -= 2 + len;
+    }
+    return remaining == 0;
+}
+
+/**
+ * @brief Append a batch entry header; the entry's payload goes next
+ */
+inline void encode_batch_entry(std::string& out, bool binary, std::string_view name, uint64_t size) {
+    if (binary) {
+        char hdr[FRAME_HEADER_SIZE];
+        encode_frame_header(hdr, OP_ENTRY, name.size(), 0, size);
+        out.append(hdr, sizeof(hdr));
+        out.append(name);
+        return;
+    }
+    out += std::string(CMD_ENTRY) + "|";
+    out.append(name);
+    out += "|" + std::to_string(size) + "\n";
+}
+
+/**
+ * @brief Read the next item of a batch stream: either an entry header
+ * (is_entry, name, size; payload follows) or the final status response
+ * @return false on disconnect/protocol error
+ */
+inline bool read_batch_item(SocketReader& reader, bool binary, bool allow_tags, bool& is_entry,
+                            std::string& name, uint64_t& size, Response& final) {
+    is_entry = false;
+    if (binary) {
+        const char* hdr = reader.peek(FRAME_HEADER_SIZE);
+        if (!hdr) return false;
+        if ((uint8_t)hdr[0] != OP_ENTRY) return read_response(reader, true, allow_tags, final);
+        uint8_t opcode;
+        uint16_t name_len;
+        uint32_t id;
+        decode_frame_header(hdr, opcode, name_len, id, size);
+        reader.consume(FRAME_HEADER_SIZE);
+        name.resize(name_len);
+        is_entry = true;
+        return reader.read_exact(&name[0], name_len);
+    }
+
+    std::string line;
+    if (!reader.next_line(line) || line.empty()) return false;
+    size_t prefix = strlen(CMD_ENTRY) + 1;
+    if (line.compare(0, prefix, std::string(CMD_ENTRY) + "|") != 0) {
+        return parse_response_line(line, allow_tags, final);
     }
+    // The size is after the last '|', so names may contain '|'
+    size_t bar = line.rfind('|');
+    if (bar < prefix) return false;
+    name = line.substr(prefix, bar - prefix);
+    char* end = nullptr;
+    size = strtoull(line.c_str() + bar + 1, &end, 10);
+    if (bar + 1 == line.size() || *end != '\0') return false;
+    is_entry = true;
     return true;
 }
 
@@ -0,0 +1,143 @@
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+/**
+ * @brief Streaming SHA-256 (FIPS 180-4)
+ *
+ * Names stored content in the blob store, where two different files must
+ * never end up with the same key: unlike XXH64, nobody can construct a
+ * collision. Feed data in any number of update() calls; hex() does not
+ * disturb the state.
+ */
+class Sha256 {
+ public:
+  Sha256() : total_len(0), mem_size(0) {
+    static const uint32_t init[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                     0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    memcpy(h, init, sizeof(h));
+  }
+
+  void update(const void *data, size_t len) {
+    const unsigned char *p = (const unsigned char *)data;
+    total_len += len;
+    if (mem_size) {
+      size_t fill = std::min(len, (size_t)64 - mem_size);
+      memcpy(mem + mem_size, p, fill);
+      mem_size += fill;
+      p += fill;
+      len -= fill;
+      if (mem_size < 64) return;
+      block(h, mem);
+      mem_size = 0;
+    }
+    for (; len >= 64; p += 64, len -= 64) {
+      block(h, p);
+    }
+    memcpy(mem, p, len);
+    mem_size = len;
+  }
+
+  /**
+   * @brief The digest so far, as 64 lowercase hex digits
+   */
+  std::string hex() const {
+    uint32_t state[8];
+    memcpy(state, h, sizeof(state));
+    unsigned char tail[128] = {0};
+    memcpy(tail, mem, mem_size);
+    tail[mem_size] = 0x80;
+    size_t tail_len = mem_size < 56 ? 64 : 128;
+    uint64_t bits = total_len * 8;
+    for (int i = 0; i < 8; ++i) tail[tail_len - 1 - i] = (unsigned char)(bits >> (8 * i));
+    for (size_t off = 0; off < tail_len; off += 64) block(state, tail + off);
+
+    static const char digits[] = "0123456789abcdef";
+    std::string out(64, '0');
+    for (int i = 0; i < 32; ++i) {
+      unsigned char byte = (unsigned char)(state[i / 4] >> (24 - 8 * (i % 4)));
+      out[2 * i] = digits[byte >> 4];
+      out[2 * i + 1] = digits[byte & 15];
+    }
+    return out;
+  }
+
+ private:
+  static uint32_t rotr(uint32_t x, int r) { return (x >> r) | (x << (32 - r)); }
+
+  static void block(uint32_t state[8], const unsigned char *p) {
+    static const uint32_t K[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+    uint32_t w[64];
+    for (int i = 0; i < 16; ++i) {
+      w[i] = (uint32_t)p[4 * i] << 24 | (uint32_t)p[4 * i + 1] << 16 | (uint32_t)p[4 * i + 2] << 8
+             | (uint32_t)p[4 * i + 3];
+    }
+    for (int i = 16; i < 64; ++i) {
+      uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+      uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+      w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], k = state[7];
+    for (int i = 0; i < 64; ++i) {
+      uint32_t t1 = k + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + K[i] + w[i];
+      uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+      k = g;
+      g = f;
+      f = e;
+      e = d + t1;
+      d = c;
+      c = b;
+      b = a;
+      a = t1 + t2;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += k;
+  }
+
+  uint32_t h[8];
+  uint64_t total_len;
+  unsigned char mem[64];
+  size_t mem_size;
+};
+
+/**
+ * @brief SHA-256 (hex) of the first size bytes of an open file
+ */
+inline bool sha256_fd(int fd, uint64_t size, std::string &digest) {
+  char chunk[64 * 1024];
+  Sha256 state;
+  for (uint64_t done = 0; done < size; ) {
+    size_t want = size - done < sizeof(chunk) ? (size_t)(size - done) : sizeof(chunk);
+    ssize_t n = pread(fd, chunk, want, done);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    state.update(chunk, n);
+    done += n;
+  }
+  digest = state.hex();
+  return true;
+}
+
+#endif
@@ -2,44 +2,166 @@
 #define SIMPLE_SHELL_H
 
 #include <vector>
+#include <string>
 #include <iostream>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <unordered_map>
 #include <sys/types.h>
+#include <sys/stat.h>
 
 #include "process.h"
+#include "protocol.h"
+#include "connection_pool.h"
+#include "hash_ring.h"
+#include "xxhash64.h"
 
-#define MAX_LINE 81
 #define PATH_MAX 1024
 
+struct TransferJob;
+
 class Shell {
  public:
   Shell();
   ~Shell();
 
   public:
-  std::vector<Process*> process_list;
+  std::vector<Process*> process_list;   // the current line, allocated in line_arena
+  Arena line_arena;
 
   int server_fd;
+  std::string server_host;
+  int server_port;
+  SocketReader server_reader;
+  DnsCache dns_cache;
+  ConnectionPool stream_pool;   // plain connections for -j transfer streams
+  bool server_pipelined;
+  bool server_binary;
+  bool server_batch;
+  bool server_dedup;
+  bool server_resume;
+  bool server_parallel;
+  bool server_deflate;
+  int compress_level;   // ccon -z: 0 leaves payloads uncompressed
+  uint64_t next_request_id;
+
+  // Cluster mode (ccon to a node that answers CLUSTER): each name lives on
+  // the cluster_replicas nodes the ring picks for it, each node reached
+  // over a session of its own, opened on first use
+  HashRing cluster;
+  int cluster_replicas;
+  std::vector<std::unique_ptr<Shell>> cluster_sessions;   // by ring index
+
+  // Background jobs (cput/cget ... &, command pipelines ... &) and the
+  // idle, already negotiated sessions finished transfers leave behind
+  std::vector<std::unique_ptr<TransferJob>> jobs;
+  std::vector<std::unique_ptr<Shell>> idle_sessions;
+  int next_job_id;
+  std::atomic<int> last_status;  // exit status of the last command, like $? in sh
+
+  // Commands already found on $PATH (name -> path), valid for hashed_path
+  std::unordered_map<std::string, std::string> command_hash;
+  std::string hashed_path;
   
   void run(); 
+  int run_script(const char *data, size_t len, bool stop_on_error);
+  bool execute_line(char *line);
+  void finish_jobs();
   bool isQuit(Process *process) const;
   bool isBuiltin(Process *process) const;
-  void handleBuiltin(Process *process);
+  void handleBuiltin(Process *process, bool check_connection = true);
   void handleCput(Process *process);
+  void putStream(int in_fd, const std::string &remotefile);
+  void putDirectory(const std::string &localdir, const std::string &prefix);
+  bool claimUpload(int file_fd, size_t size, const std::string &remotefile);
+  void putResumable(int file_fd, const struct stat &st, const std::string &localfile,
+                    const std::string &remotefile);
+  void putParallel(int file_fd, const struct stat &st, const std::string &localfile,
+                   const std::string &remotefile, int streams);
+  bool getParallel(const std::string &remotefile, const std::string &localfile, int streams);
+  void getStream(const std::string &remotefile, const std::string &range, int out_fd);
   void handleCcon(Process *process);
+  int query_cluster(const std::string &host, int port, std::vector<std::string> &nodes, int &replicas);
+  void set_cluster(const std::vector<std::string> &nodes, int replicas);
+  Shell *node_session(size_t index);
+  bool has_file(const std::string &remotefile);
+  void handleClusterCommand(Process *process);
+  void clusterPut(Process *process);
+  void clusterGet(Process *process);
+  void repairReplicas(const std::string &remotefile, const std::string &localfile,
+                      const std::vector<size_t> &lacking);
+  void clusterRemove(Process *process);
+  bool clusterNames(const std::string &prefix, std::vector<std::string> &names);
+  bool connect_server(const std::string &host, int port);
+  bool reconnect();
+  bool ensure_connection();
   void handleCrm(Process *process);
   void handleCget(Process *process);
+  bool remote_version(const std::string &remotefile, std::string &version);
+  void getMatching(const std::string &pattern, const std::string &localdir);
   void handleCls(Process *process);
+  bool listFiles(const std::string &prefix, std::vector<std::string> *names);
+  int negotiate_features();
+  bool send_request(const Request &req, int flags = 0);
+  bool read_reply(Response &resp);
+  void print_response(const Response &resp);
+  std::vector<Response> transact(std::vector<Request> requests);
+  void startTransferJob(Process *process);
+  std::unique_ptr<Shell> take_session();
+  void startJobStage(TransferJob &job, Process *proc);
+  void startPipelineJob(std::vector<pid_t> &pids, const std::string &command,
+                        std::unique_ptr<TransferJob> job);
+  void reapJobs();
+  void handleJobs(Process *process);
+  void handleWait(Process *process);
+  void handleFg(Process *process);
+  void handleParallel(Process *process);
    
   bool isCd(Process *process) const;
 
   void display_prompt() const;
+  void release_processes();
   void cleanup(char *input_line);
   char *read_input();
   void sanitize(char *cmd);
   void parse_input(char *input_line);
   void handle_cd(Process *proc);
   bool run_commands();
+  void wait_children(std::vector<pid_t> &pids);
+  void finish_pipeline(std::vector<std::thread> &stages, std::vector<pid_t> &pids);
+  std::string resolve_command(const std::string &name);
+  bool open_redirects(Process *proc);
+  pid_t spawn_process(Process *proc, int stdin_fd);
+  void handleHash(Process *process);
   void close_pipe(int fd) const;
 };
 
+/**
+ * @brief A cput/cget or a command pipeline running in the background
+ * A transfer runs on its own thread over its own server session; the
+ * foreground only reads the counters, which the job's transfer progress
+ * keeps current. A pipeline is its children, reaped as they exit, and
+ * its builtin stages, each on a thread and a session of its own.
+ */
+struct TransferJob {
+  int id;
+  std::vector<pid_t> pids;   // pipeline: children not yet reaped
+  int status = 0;            // pipeline: exit status of its last stage
+  std::vector<std::thread> stages;                    // pipeline: builtin stages
+  std::vector<std::unique_ptr<Shell>> stage_sessions;
+  std::atomic<int> stages_running{0};
+  std::atomic<int> stage_status{-1};   // set when the last stage is a builtin
+  std::vector<std::string> args;
+  std::string command;
+  std::unique_ptr<Shell> session;
+  std::thread thread;
+  std::atomic<size_t> done{0};
+  std::atomic<size_t> total{0};
+  std::atomic<bool> finished{false};
+  std::chrono::steady_clock::time_point start;
+  std::chrono::steady_clock::time_point end;    // set before finished
+};
+
 #endif
@@ -0,0 +1,168 @@
+#ifndef URING_H
+#define URING_H
+
+// Built in when the kernel headers have io_uring; -DNO_IO_URING leaves it
+// out, and callers fall back to plain syscalls either way
+#if !defined(NO_IO_URING) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING 1
+#endif
+#endif
+
+#ifdef HAVE_IO_URING
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+// Registered buffers per ring, and the size of each; at most this many
+// operations are in flight, so the submission queue never fills
+#define URING_BUFFERS 4
+#define URING_BUFFER_SIZE (256 * 1024)
+#define URING_ENTRIES 8
+
+/**
+ * @brief Minimal io_uring over the raw syscalls (no liburing needed)
+ *
+ * One ring per thread, with URING_BUFFERS buffers registered up front so
+ * fixed writes skip the per-call page pinning. Only what the server uses
+ * is here: queue a fixed-buffer write, wait for a completion.
+ */
+class Uring {
+ public:
+  Uring() : ring_fd(-1), sq_ptr(MAP_FAILED), cq_ptr(MAP_FAILED), sqes(MAP_FAILED),
+            sq_size(0), cq_size(0), sqes_size(0), buffers(nullptr) {}
+
+  ~Uring() {
+    if (sqes != MAP_FAILED) munmap(sqes, sqes_size);
+    if (cq_ptr != MAP_FAILED && cq_ptr != sq_ptr) munmap(cq_ptr, cq_size);
+    if (sq_ptr != MAP_FAILED) munmap(sq_ptr, sq_size);
+    if (ring_fd >= 0) close(ring_fd);
+    free(buffers);
+  }
+
+  Uring(const Uring &) = delete;
+  Uring &operator=(const Uring &) = delete;
+
+  /**
+   * @brief Set up the ring and register the buffers
+   * @return false if the kernel refuses (old kernel, seccomp, memlock)
+   */
+  bool init() {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    ring_fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if (ring_fd < 0) return false;
+
+    sq_size = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single && cq_size > sq_size) sq_size = cq_size;
+    sq_ptr = mmap(nullptr, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                  ring_fd, IORING_OFF_SQ_RING);
+    if (sq_ptr == MAP_FAILED) return false;
+    cq_ptr = single ? sq_ptr
+                    : mmap(nullptr, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                           ring_fd, IORING_OFF_CQ_RING);
+    if (cq_ptr == MAP_FAILED) return false;
+    sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    sqes = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                ring_fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) return false;
+
+    char *sq = (char *)sq_ptr, *cq = (char *)cq_ptr;
+    sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    sq_mask = *(unsigned *)(sq + p.sq_off.ring_mask);
+    sq_array = (unsigned *)(sq + p.sq_off.array);
+    cq_head = (unsigned *)(cq + p.cq_off.head);
+    cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    if (posix_memalign((void **)&buffers, 4096, (size_t)URING_BUFFERS * URING_BUFFER_SIZE) != 0) {
+      buffers = nullptr;
+      return false;
+    }
+    struct iovec iov[URING_BUFFERS];
+    for (int i = 0; i < URING_BUFFERS; ++i) {
+      iov[i].iov_base = buffer(i);
+      iov[i].iov_len = URING_BUFFER_SIZE;
+    }
+    return syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_BUFFERS, iov, URING_BUFFERS) == 0;
+  }
+
+  char *buffer(int index) { return buffers + (size_t)index * URING_BUFFER_SIZE; }
+
+  /**
+   * @brief Queue a write of len bytes from registered buffer index
+   * The completion carries index as its tag.
+   */
+  bool write_fixed(int fd, int index, size_t len, uint64_t offset) {
+    unsigned tail = *sq_tail;
+    unsigned slot = tail & sq_mask;
+    struct io_uring_sqe *sqe = &((struct io_uring_sqe *)sqes)[slot];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_WRITE_FIXED;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)buffer(index);
+    sqe->len = (uint32_t)len;
+    sqe->off = offset;
+    sqe->buf_index = (uint16_t)index;
+    sqe->user_data = (uint64_t)index;
+    sq_array[slot] = slot;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    long n;
+    do {
+      n = syscall(__NR_io_uring_enter, ring_fd, 1, 0, 0, nullptr, 0);
+    } while (n < 0 && errno == EINTR);
+    return n == 1;
+  }
+
+  /**
+   * @brief Wait for the next completion
+   * @param index tag of the finished operation
+   * @param result its result: bytes written or -errno
+   */
+  bool wait(int &index, int &result) {
+    while (true) {
+      unsigned head = *cq_head;
+      if (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe *cqe = &cqes[head & cq_mask];
+        index = (int)cqe->user_data;
+        result = cqe->res;
+        __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+        return true;
+      }
+      long n = syscall(__NR_io_uring_enter, ring_fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+      if (n < 0 && errno != EINTR) return false;
+    }
+  }
+
+ private:
+  int ring_fd;
+  void *sq_ptr;
+  void *cq_ptr;
+  void *sqes;
+  size_t sq_size;
+  size_t cq_size;
+  size_t sqes_size;
+  unsigned *sq_tail;
+  unsigned sq_mask;
+  unsigned *sq_array;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe *cqes;
+  char *buffers;
+};
+
+#endif  // HAVE_IO_URING
+
+#endif
@@ -0,0 +1,155 @@
+#ifndef XXHASH64_H
+#define XXHASH64_H
+
+#include <endian.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+/**
+ * @brief Streaming XXH64 (Yann Collet's xxHash, 64-bit variant)
+ *
+ * Fast non-cryptographic hash used to address stored content. Feed data
+ * in any number of update() calls; digest() does not disturb the state.
+ */
+class Xxh64 {
+ public:
+  explicit Xxh64(uint64_t seed = 0) : total_len(0), mem_size(0) {
+    v[0] = seed + P1 + P2;
+    v[1] = seed + P2;
+    v[2] = seed;
+    v[3] = seed - P1;
+    this->seed = seed;
+  }
+
+  void update(const void *data, size_t len) {
+    const unsigned char *p = (const unsigned char *)data;
+    total_len += len;
+
+    if (mem_size + len < 32) {
+      memcpy(mem + mem_size, p, len);
+      mem_size += len;
+      return;
+    }
+    if (mem_size) {
+      size_t fill = 32 - mem_size;
+      memcpy(mem + mem_size, p, fill);
+      stripe(mem);
+      p += fill;
+      len -= fill;
+      mem_size = 0;
+    }
+    for (; len >= 32; p += 32, len -= 32) {
+      stripe(p);
+    }
+    memcpy(mem, p, len);
+    mem_size = len;
+  }
+
+  uint64_t digest() const {
+    uint64_t h;
+    if (total_len >= 32) {
+      h = rotl(v[0], 1) + rotl(v[1], 7) + rotl(v[2], 12) + rotl(v[3], 18);
+      for (int i = 0; i < 4; ++i) {
+        h ^= round(0, v[i]);
+        h = h * P1 + P4;
+      }
+    } else {
+      h = seed + P5;
+    }
+    h += total_len;
+
+    const unsigned char *p = mem;
+    size_t len = mem_size;
+    for (; len >= 8; p += 8, len -= 8) {
+      h ^= round(0, read64(p));
+      h = rotl(h, 27) * P1 + P4;
+    }
+    if (len >= 4) {
+      h ^= (uint64_t)read32(p) * P1;
+      h = rotl(h, 23) * P2 + P3;
+      p += 4;
+      len -= 4;
+    }
+    for (; len > 0; ++p, --len) {
+      h ^= *p * P5;
+      h = rotl(h, 11) * P1;
+    }
+
+    h ^= h >> 33;
+    h *= P2;
+    h ^= h >> 29;
+    h *= P3;
+    h ^= h >> 32;
+    return h;
+  }
+
+ private:
+  static constexpr uint64_t P1 = 11400714785074694791ULL;
+  static constexpr uint64_t P2 = 14029467366897019727ULL;
+  static constexpr uint64_t P3 = 1609587929392839161ULL;
+  static constexpr uint64_t P4 = 9650029242287828579ULL;
+  static constexpr uint64_t P5 = 2870177450012600261ULL;
+
+  static uint64_t rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+  static uint64_t read64(const unsigned char *p) {
+    uint64_t x;
+    memcpy(&x, p, 8);
+    return le64toh(x);
+  }
+
+  static uint32_t read32(const unsigned char *p) {
+    uint32_t x;
+    memcpy(&x, p, 4);
+    return le32toh(x);
+  }
+
+  static uint64_t round(uint64_t acc, uint64_t input) {
+    acc += input * P2;
+    return rotl(acc, 31) * P1;
+  }
+
+  void stripe(const unsigned char *p) {
+    for (int i = 0; i < 4; ++i) {
+      v[i] = round(v[i], read64(p + 8 * i));
+    }
+  }
+
+  uint64_t seed;
+  uint64_t v[4];
+  uint64_t total_len;
+  unsigned char mem[32];
+  size_t mem_size;
+};
+
+/**
+ * @brief One-shot XXH64 of a buffer
+ */
+inline uint64_t xxh64(const void *data, size_t len, uint64_t seed = 0) {
+  Xxh64 state(seed);
+  state.update(data, len);
+  return state.digest();
+}
+
+/**
+ * @brief XXH64 of the first size bytes of an open file
+ */
+inline bool xxh64_fd(int fd, uint64_t size, uint64_t &digest) {
+  char chunk[64 * 1024];
+  Xxh64 state;
+  for (uint64_t done = 0; done < size; ) {
+    size_t want = size - done < sizeof(chunk) ? (size_t)(size - done) : sizeof(chunk);
+    ssize_t n = pread(fd, chunk, want, done);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    state.update(chunk, n);
+    done += n;
+  }
+  digest = state.digest();
+  return true;
+}
+
+#endif
@@ -1,362 +1,2643 @@
 #include "protocol.h"
+#include "file_cache.h"
+#include "file_index.h"
+#include "xxhash64.h"
+#include "sha256.h"
+#include "compress.h"
+#include "uring.h"
+#include "metrics.h"
+#include "async_log.h"
 #include <iostream>
+#include <sstream>
 #include <fstream>
 #include <vector>
 #include <pthread.h>       
 #include <sys/socket.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
 #include <unistd.h>
 #include <dirent.h>
+#include <fnmatch.h>
+#include <cctype>
 #include <sys/stat.h>
 #include <cstring>
-#include <unordered_map>
 #include <string>
+#include <functional>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <unordered_map>
+#include <map>
+#include <cerrno>
+#include <csignal>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/inotify.h>
+#include <sys/file.h>
+
+
+// Storage root (-f). Everything else the server keeps lives in
+// dot-directories under it, so every rename into place stays on one
+// filesystem; a second disk gets a node of its own (-C).
+#define DEFAULT_FILES_DIR "./server_files"
+std::string files_dir;
+
+// Stored files are spread over STORAGE_FANOUT subdirectories "00".."ff"
+// picked by a hash of the name (blobs and compressed copies likewise), so
+// no directory holds more than its share of the store. Files found
+// directly under the root, as the old flat layout kept them, are moved
+// into place at startup by way of MIGRATE_DIR.
+#define STORAGE_FANOUT 256
+#define MIGRATE_DIR ".migrate"
+int files_dir_fd = -1;                      // the root
+int file_shard_fds[STORAGE_FANOUT];         // its fan-out directories
+int blob_shard_fds[STORAGE_FANOUT];         // the blob store's, with -d
+
+// In-progress uploads; a subdirectory so rename() stays on one filesystem
+std::string tmp_dir;
+
+// Interrupted resumable uploads, named by their token; kept across
+// restarts, but dropped once untouched for PARTIAL_MAX_AGE_SEC
+std::string partial_dir;
+#define PARTIAL_MAX_AGE_SEC (24 * 60 * 60)
+
+// Byte ranges PART requests have stored in each parallel upload, merged
+// (token -> start -> end); COMMIT checks them before storing the file
+pthread_mutex_t part_mutex = PTHREAD_MUTEX_INITIALIZER;
+std::unordered_map<std::string, std::map<uint64_t, uint64_t>> part_ranges;
+
+// Content-addressed store (-d): each stored name is a hard link to a blob
+// here named by its content_key(), so identical uploads share one copy
+// and a blob's link count is its reference count
+std::string blob_dir;
+bool dedup_enabled = false;
+
+// Guards blob creation/removal and blob_keys (inode -> key of each blob)
+pthread_mutex_t blob_mutex = PTHREAD_MUTEX_INITIALIZER;
+std::unordered_map<ino_t, std::string> blob_keys;
+std::atomic<uint64_t> claim_seq(0);
+
+// Bytes moved per recv()/write() while streaming an upload (-c)
+size_t upload_chunk_size = BUFFER_SIZE;
+
+// Upload writes go through a per-worker io_uring (-u) when available
+std::atomic<bool> uring_enabled(false);
+
+// When an upload counts as stored (-s). SYNC_NONE leaves it to the page
+// cache. SYNC_DATA fdatasync()s each file before the rename that makes it
+// visible and the directory after it. SYNC_GROUP gives the same guarantee
+// through syncfs() rounds shared by every upload waiting at the time, so
+// concurrent uploads pay for one flush between them instead of one each.
+enum SyncMode { SYNC_NONE, SYNC_DATA, SYNC_GROUP };
+SyncMode sync_mode = SYNC_NONE;
+
+// Group commit state: a round covers every ticket handed out before it
+// started; rounds that fail bump sync_errors
+pthread_mutex_t sync_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t sync_cond = PTHREAD_COND_INITIALIZER;
+uint64_t sync_requested = 0;
+uint64_t sync_completed = 0;
+uint64_t sync_rounds = 0;
+uint64_t sync_errors = 0;
+bool sync_running = false;
+
+// Uploads at least this big reserve their space up front
+#define PREALLOCATE_MIN_SIZE (1024 * 1024)
+
+// Uploads at least this big skip the page cache with O_DIRECT (-D, 0 off),
+// written from an aligned buffer in DIRECT_IO_BUFFER_SIZE blocks
+size_t direct_min_size = 0;
+#define DIRECT_IO_ALIGN 4096
+#define DIRECT_IO_BUFFER_SIZE (1024 * 1024)
+
+// zlib level for payloads sent to clients that negotiated deflate (-z)
+#define DEFAULT_COMPRESS_LEVEL 1
+int compress_level = DEFAULT_COMPRESS_LEVEL;
+
+// Compressed copies of downloaded files (-Z), so a file is deflated once
+// instead of on every download. Each copy starts with the identity of the
+// stored file it was made from and is ignored once that no longer matches.
+std::string zcache_dir;
+#define ZCACHE_MIN_SIZE (64 * 1024)
+bool zcache_enabled = false;
+
+// Contents of hot small files (-m sets the cap, 0 disables)
+#define DEFAULT_CACHE_BYTES (64 * 1024 * 1024)
+FileCache file_cache;
+
+// Every stored filename, kept current by upload/delete and the inotify watcher
+FileIndex file_index;
+
+// Cluster membership (-C) and how many nodes clients copy each file to
+// (-n), told to clients by CLUSTER; they route every name to its nodes
+// themselves. Nodes never talk to each other: a node that missed a write
+// only gets the file back when a client reads it (read repair), and
+// nothing moves files when the membership changes
+#define CLUSTER_DEFAULT_REPLICAS 2
+std::vector<std::string> cluster_nodes;
+int cluster_replicas = CLUSTER_DEFAULT_REPLICAS;
+
+// Hash-striped reader/writer locks for file operations. Names map onto a
+// fixed set of stripes, so there is no global lock and nothing to create or
+// destroy per file; unrelated names rarely share a stripe.
+#define FILE_LOCK_STRIPES 256
+
+struct alignas(64) FileLockStripe {
+    pthread_rwlock_t lock;
+};
+FileLockStripe file_locks[FILE_LOCK_STRIPES];
+
+// Waits for a contended file lock stripe, and the total time spent in them
+std::atomic<uint64_t> lock_waits(0);
+std::atomic<uint64_t> lock_wait_ns(0);
+
+/**
+ * @brief Initialise every lock stripe (call once at startup)
+ */
+void init_file_locks() {
+    for (FileLockStripe& stripe : file_locks) {
+        pthread_rwlock_init(&stripe.lock, nullptr);
+    }
+}
+
+/**
+ * @brief Destroy every lock stripe
+ */
+void destroy_file_locks() {
+    for (FileLockStripe& stripe : file_locks) {
+        pthread_rwlock_destroy(&stripe.lock);
+    }
+}
+
+/**
+ * @brief Get the lock guarding a file
+ * Take it shared to read a file, exclusive to replace or remove it.
+ */
+pthread_rwlock_t* get_file_lock(const std::string& filename) {
+    size_t h = std::hash<std::string>{}(filename);
+    return &file_locks[h % FILE_LOCK_STRIPES].lock;
+}
+
+/**
+ * @brief Take a file lock stripe, shared or exclusive
+ * Uncontended locks are taken with a try and cost nothing more; a wait
+ * is timed into lock_waits/lock_wait_ns.
+ */
+void lock_file(pthread_rwlock_t* lock, bool exclusive) {
+    if ((exclusive ? pthread_rwlock_trywrlock(lock) : pthread_rwlock_tryrdlock(lock)) == 0) return;
+    auto start = std::chrono::steady_clock::now();
+    if (exclusive) {
+        pthread_rwlock_wrlock(lock);
+    } else {
+        pthread_rwlock_rdlock(lock);
+    }
+    lock_waits.fetch_add(1, std::memory_order_relaxed);
+    lock_wait_ns.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                               std::chrono::steady_clock::now() - start).count(),
+                           std::memory_order_relaxed);
+}
+
+/**
+ * @brief Point the server at a storage root (-f)
+ */
+void set_storage_root(const std::string& root) {
+    files_dir = root;
+    while (files_dir.size() > 1 && files_dir.back() == '/') files_dir.pop_back();
+    tmp_dir = files_dir + "/.tmp";
+    partial_dir = files_dir + "/.partial";
+    blob_dir = files_dir + "/.blobs";
+    zcache_dir = files_dir + "/.zcache";
+}
+
+/**
+ * @brief Fan-out directory a stored name belongs in
+ */
+size_t storage_shard(const std::string& filename) {
+    return xxh64(filename.data(), filename.size()) % STORAGE_FANOUT;
+}
+
+/**
+ * @brief Name of fan-out directory shard: two hex digits
+ */
+std::string shard_dir_name(size_t shard) {
+    char name[3];
+    snprintf(name, sizeof(name), "%02x", (unsigned)shard);
+    return name;
+}
+
+bool make_dir(const std::string& path) {
+    return mkdir(path.c_str(), 0755) == 0 || errno == EEXIST;
+}
+
+/**
+ * @brief Create dir and its fan-out directories
+ */
+bool make_shard_dirs(const std::string& dir) {
+    if (!make_dir(dir)) return false;
+    for (size_t shard = 0; shard < STORAGE_FANOUT; ++shard) {
+        if (!make_dir(dir + "/" + shard_dir_name(shard))) return false;
+    }
+    return true;
+}
+
+std::string decode_storage_name(const char* name);
+
+/**
+ * @brief Move files kept directly under the root into their fan-out
+ * directories
+ * They are moved aside first, as a stored name may look just like a
+ * fan-out directory; a migration cut short resumes on the next start.
+ */
+bool migrate_flat_layout() {
+    std::string aside = files_dir + "/" + MIGRATE_DIR;
+    DIR* dir = opendir(files_dir.c_str());
+    if (!dir) return false;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != nullptr) {
+        if (entry->d_type != DT_REG) continue;
+        if (!make_dir(aside)
+            || rename((files_dir + "/" + entry->d_name).c_str(), (aside + "/" + entry->d_name).c_str()) != 0) {
+            closedir(dir);
+            return false;
+        }
+    }
+    closedir(dir);
+
+    dir = opendir(aside.c_str());
+    if (!dir) return true;
+    if (!make_shard_dirs(files_dir)) {
+        closedir(dir);
+        return false;
+    }
+    size_t moved = 0;
+    while ((entry = readdir(dir)) != nullptr) {
+        if (entry->d_type != DT_REG) continue;
+        std::string target = files_dir + "/" + shard_dir_name(storage_shard(decode_storage_name(entry->d_name)))
+                             + "/" + entry->d_name;
+        if (rename((aside + "/" + entry->d_name).c_str(), target.c_str()) == 0) ++moved;
+    }
+    closedir(dir);
+    rmdir(aside.c_str());
+    if (moved) std::cout << "Moved " << moved << " files into fan-out directories\n";
+    return true;
+}
+
+/**
+ * @brief Ensure server files directory exists
+ */
+bool ensure_directory() {
+    if (!make_dir(files_dir) || !migrate_flat_layout() || !make_shard_dirs(files_dir)
+        || !make_dir(tmp_dir) || !make_dir(partial_dir)
+        || (dedup_enabled && !make_shard_dirs(blob_dir))
+        || (zcache_enabled && !make_shard_dirs(zcache_dir))) {
+        perror("Cannot create storage directory");
+        return false;
+    }
+
+    // Leftovers from uploads interrupted by a crash
+    DIR* dir = opendir(tmp_dir.c_str());
+    if (!dir) return true;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != nullptr) {
+        if (entry->d_type == DT_REG) {
+            unlink((tmp_dir + "/" + entry->d_name).c_str());
+        }
+    }
+    closedir(dir);
+
+    // ... and resumable uploads nobody came back for
+    dir = opendir(partial_dir.c_str());
+    if (!dir) return true;
+    time_t now = time(nullptr);
+    while ((entry = readdir(dir)) != nullptr) {
+        std::string path = partial_dir + "/" + entry->d_name;
+        struct stat st;
+        if (entry->d_type == DT_REG && stat(path.c_str(), &st) == 0
+            && now - st.st_mtime > PARTIAL_MAX_AGE_SEC) {
+            unlink(path.c_str());
+        }
+    }
+    closedir(dir);
+    return true;
+}
+
+/**
+ * @brief Open the root and the fan-out directories, kept for the
+ * server's lifetime (unlinkat, fsync, the watcher)
+ */
+bool open_storage_dirs() {
+    files_dir_fd = open(files_dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (files_dir_fd < 0) return false;
+    for (size_t shard = 0; shard < STORAGE_FANOUT; ++shard) {
+        std::string name = shard_dir_name(shard);
+        file_shard_fds[shard] = openat(files_dir_fd, name.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (file_shard_fds[shard] < 0) return false;
+        blob_shard_fds[shard] = -1;
+        if (dedup_enabled) {
+            blob_shard_fds[shard] = open((blob_dir + "/" + name).c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (blob_shard_fds[shard] < 0) return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Map a client filename onto one on-disk name
+ * Filenames are opaque keys: '/', '%' and a leading '.' are
+ * percent-encoded, so no name can escape the storage directory or collide
+ * with .tmp, and "dir/a.txt" style names from batch uploads still work.
+ */
+std::string encode_storage_name(const std::string& filename) {
+    static const char hex[] = "0123456789ABCDEF";
+    std::string out;
+    out.reserve(filename.size());
+    for (size_t i = 0; i < filename.size(); ++i) {
+        unsigned char c = filename[i];
+        if (c == '/' || c == '%' || (c == '.' && i == 0)) {
+            out += '%';
+            out += hex[c >> 4];
+            out += hex[c & 0xF];
+        } else {
+            out += c;
+        }
+    }
+    return out;
+}
+
+/**
+ * @brief Inverse of encode_storage_name()
+ */
+std::string decode_storage_name(const char* name) {
+    std::string out;
+    for (const char* p = name; *p; ++p) {
+        if (*p == '%' && isxdigit((unsigned char)p[1]) && isxdigit((unsigned char)p[2])) {
+            char hex[3] = {p[1], p[2], '\0'};
+            out += (char)strtol(hex, nullptr, 16);
+            p += 2;
+        } else {
+            out += *p;
+        }
+    }
+    return out;
+}
+
+/**
+ * @brief Get full path for a file in server storage
+ */
+std::string get_file_path(const std::string& filename) {
+    return files_dir + "/" + shard_dir_name(storage_shard(filename)) + "/" + encode_storage_name(filename);
+}
+
+/**
+ * @brief The fan-out directory holding a stored file, as an open fd
+ */
+int file_dir_fd(const std::string& filename) {
+    return file_shard_fds[storage_shard(filename)];
+}
+
+/**
+ * @brief Where the compressed copy of a stored file lives (-Z)
+ */
+std::string get_zcache_path(const std::string& filename) {
+    return zcache_dir + "/" + shard_dir_name(storage_shard(filename)) + "/" + encode_storage_name(filename);
+}
+
+/**
+ * @brief Drop a file's compressed copy; call with its exclusive lock held
+ */
+void drop_zcache(const std::string& filename) {
+    if (zcache_enabled) unlink(get_zcache_path(filename).c_str());
+}
+
+/**
+ * @brief Rebuild the file index from the fan-out directories
+ * A file put in the wrong one from outside is moved to where lookups
+ * will find it.
+ */
+void load_file_index() {
+    std::vector<std::string> names;
+    for (size_t shard = 0; shard < STORAGE_FANOUT; ++shard) {
+        DIR* dir = opendir((files_dir + "/" + shard_dir_name(shard)).c_str());
+        if (!dir) continue;
+        struct dirent* entry;
+        while ((entry = readdir(dir)) != nullptr) {
+            if (entry->d_type != DT_REG) continue;
+            std::string name = decode_storage_name(entry->d_name);
+            size_t home = storage_shard(name);
+            if (home != shard
+                && renameat(file_shard_fds[shard], entry->d_name, file_shard_fds[home], entry->d_name) != 0) {
+                continue;
+            }
+            names.push_back(std::move(name));
+        }
+        closedir(dir);
+    }
+    file_index.reset(std::move(names));
+}
+
+/**
+ * @brief Apply one change seen by inotify to the index and cache
+ * Takes the file's exclusive lock, so it serialises with the server's own
+ * uploads/deletes, and decides from the directory's current state rather
+ * than the event: a stale event for a file since replaced is harmless.
+ * Files that don't belong in the fan-out directory shard are left for
+ * load_file_index() to move at the next start.
+ */
+void refresh_indexed_file(size_t shard, const char* storage_name) {
+    std::string filename = decode_storage_name(storage_name);
+    if (storage_shard(filename) != shard) return;
+    pthread_rwlock_t *file_lock = get_file_lock(filename);
+    lock_file(file_lock, true);
+    file_cache.invalidate(filename);
+    drop_zcache(filename);
+    struct stat st;
+    if (fstatat(file_shard_fds[shard], storage_name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISREG(st.st_mode)) {
+        file_index.add(filename);
+    } else {
+        file_index.remove(filename);
+    }
+    pthread_rwlock_unlock(file_lock);
+}
+
+// inotify watch descriptor -> the fan-out directory it watches
+std::unordered_map<int, size_t> watched_shards;
+
+/**
+ * @brief Watcher thread: follow changes made to the storage directory
+ * behind the server's back (copied in, removed, edited in place)
+ */
+void* watch_main(void* arg) {
+    int inotify_fd = *(int*)arg;
+    alignas(struct inotify_event) char buf[64 * 1024];
+    while (true) {
+        ssize_t n = read(inotify_fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        for (char* p = buf; p < buf + n; ) {
+            struct inotify_event* ev = (struct inotify_event*)p;
+            p += sizeof(struct inotify_event) + ev->len;
+            if (ev->mask & IN_Q_OVERFLOW) {
+                // Events were lost; start over from the directory itself
+                load_file_index();
+                file_cache.clear();
+            } else if (ev->len > 0 && !(ev->mask & IN_ISDIR)) {
+                auto it = watched_shards.find(ev->wd);
+                if (it != watched_shards.end()) refresh_indexed_file(it->second, ev->name);
+            }
+        }
+    }
+    close(inotify_fd);
+    return NULL;
+}
+
+/**
+ * @brief Start watching the fan-out directories
+ * Without inotify the index still tracks everything done through the
+ * server; only outside changes go unnoticed until restart.
+ */
+void start_file_watcher() {
+    static int inotify_fd = inotify_init1(IN_CLOEXEC);
+    if (inotify_fd < 0) {
+        perror("inotify");
+        return;
+    }
+    for (size_t shard = 0; shard < STORAGE_FANOUT; ++shard) {
+        int wd = inotify_add_watch(inotify_fd, (files_dir + "/" + shard_dir_name(shard)).c_str(),
+                                   IN_CREATE | IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM
+                                   | IN_DELETE | IN_ONLYDIR);
+        if (wd < 0) {
+            perror("inotify");
+            return;
+        }
+        watched_shards[wd] = shard;
+    }
+    pthread_t thread_id;
+    if (pthread_create(&thread_id, NULL, watch_main, &inotify_fd) != 0) {
+        perror("Thread creation failed");
+        return;
+    }
+    pthread_detach(thread_id);
+}
+
+/**
+ * @brief Fan-out directory of a blob: the key's leading hex digits, which
+ * are already a hash of the content
+ */
+size_t blob_shard(const std::string& key) {
+    return strtoul(key.substr(0, 2).c_str(), nullptr, 16) % STORAGE_FANOUT;
+}
+
+/**
+ * @brief Path of a blob in the content-addressed store
+ */
+std::string get_blob_path(const std::string& key) {
+    return blob_dir + "/" + shard_dir_name(blob_shard(key)) + "/" + key;
+}
+
+/**
+ * @brief Index the blob store, dropping blobs no name links to any more
+ */
+void load_blob_store() {
+    for (size_t shard = 0; shard < STORAGE_FANOUT; ++shard) {
+        DIR* dir = opendir((blob_dir + "/" + shard_dir_name(shard)).c_str());
+        if (!dir) continue;
+        struct dirent* entry;
+        while ((entry = readdir(dir)) != nullptr) {
+            if (entry->d_type != DT_REG) continue;
+            std::string path = get_blob_path(entry->d_name);
+            struct stat st;
+            if (stat(path.c_str(), &st) != 0) continue;
+            if (st.st_nlink <= 1) {
+                unlink(path.c_str());
+            } else {
+                blob_keys[st.st_ino] = entry->d_name;
+            }
+        }
+        closedir(dir);
+    }
+}
+
+/**
+ * @brief Whether two files hold the same bytes
+ */
+bool same_content(const std::string& a, const std::string& b) {
+    int fd_a = open(a.c_str(), O_RDONLY | O_CLOEXEC);
+    int fd_b = open(b.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st_a, st_b;
+    bool same = fd_a >= 0 && fd_b >= 0 && fstat(fd_a, &st_a) == 0 && fstat(fd_b, &st_b) == 0
+                && st_a.st_size == st_b.st_size;
+    std::vector<char> buf_a(64 * 1024), buf_b(64 * 1024);
+    for (off_t done = 0; same && done < st_a.st_size; ) {
+        size_t want = std::min(buf_a.size(), (size_t)(st_a.st_size - done));
+        ssize_t n = pread(fd_a, buf_a.data(), want, done);
+        if (n < 0 && errno == EINTR) continue;
+        same = n > 0 && pread(fd_b, buf_b.data(), n, done) == n
+               && memcmp(buf_a.data(), buf_b.data(), n) == 0;
+        done += n;
+    }
+    if (fd_a >= 0) close(fd_a);
+    if (fd_b >= 0) close(fd_b);
+    return same;
+}
+
+/**
+ * @brief Make a staged upload a link to the blob holding its content
+ * A new blob takes over the staged inode; content already stored leaves
+ * tmppath pointing at the existing blob and the upload's copy is dropped,
+ * but only once the bytes are seen to match. An upload that doesn't (a
+ * corrupt blob, say) is stored as a file of its own.
+ */
+bool intern_blob(const std::string& tmppath, const std::string& key) {
+    std::string blob = get_blob_path(key);
+    pthread_mutex_lock(&blob_mutex);
+    bool ok = link(tmppath.c_str(), blob.c_str()) == 0;
+    if (ok) {
+        struct stat st;
+        if (stat(blob.c_str(), &st) == 0) blob_keys[st.st_ino] = key;
+    } else if (errno == EEXIST) {
+        if (same_content(tmppath, blob)) {
+            ok = unlink(tmppath.c_str()) == 0 && link(blob.c_str(), tmppath.c_str()) == 0;
+        } else {
+            ok = true;
+        }
+    }
+    pthread_mutex_unlock(&blob_mutex);
+    return ok;
+}
+
+/**
+ * @brief Stage a new link to an existing blob
+ * The blob is hashed again first, so a claim never names damaged bytes.
+ * @return false if the store has no such content
+ */
+bool stage_blob_link(const std::string& key, std::string& tmppath) {
+    tmppath = tmp_dir + "/claim." + std::to_string(claim_seq++);
+    pthread_mutex_lock(&blob_mutex);
+    bool ok = link(get_blob_path(key).c_str(), tmppath.c_str()) == 0;
+    pthread_mutex_unlock(&blob_mutex);
+    if (!ok) return false;
+
+    int fd = open(tmppath.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    std::string digest;
+    ok = fd >= 0 && fstat(fd, &st) == 0 && sha256_fd(fd, st.st_size, digest)
+         && content_key(digest, st.st_size) == key;
+    if (fd >= 0) close(fd);
+    if (!ok) unlink(tmppath.c_str());
+    return ok;
+}
+
+/**
+ * @brief Called after a stored name stopped linking to inode ino
+ * Removes the blob once that was its last name.
+ */
+void release_blob(ino_t ino) {
+    if (!dedup_enabled) return;
+    pthread_mutex_lock(&blob_mutex);
+    auto it = blob_keys.find(ino);
+    if (it != blob_keys.end()) {
+        std::string blob = get_blob_path(it->second);
+        struct stat st;
+        if (stat(blob.c_str(), &st) != 0 || st.st_ino != ino) {
+            blob_keys.erase(it);
+        } else if (st.st_nlink <= 1) {
+            unlink(blob.c_str());
+            blob_keys.erase(it);
+        }
+    }
+    pthread_mutex_unlock(&blob_mutex);
+}
+
+/**
+ * @brief Inode a stored file currently links to, 0 if none
+ */
+ino_t stored_inode(const char* path) {
+    struct stat st;
+    return lstat(path, &st) == 0 ? st.st_ino : 0;
+}
+
+// Per-request messages ("Uploaded: ...") go through server_log: formatted
+// only when their level is on (-l), written by a thread of its own, and
+// dropped (counted) past LOG_RATE_PER_SEC
+AsyncLog server_log;
+#define LOG(level, msg) \
+    do { \
+        if (server_log.enabled(level)) { \
+            std::ostringstream log_line; \
+            log_line << msg; \
+            server_log.write(level, log_line.str()); \
+        } \
+    } while (0)
+
+// Request metrics, by opcode (STATS and the -M Prometheus port). Handlers
+// tally into request_tally, which serve_request() adds to the opcode's
+// counters once the request is answered.
+#define OP_METRICS_SLOTS (OP_CLUSTER + 1)
+OpMetrics op_metrics[OP_METRICS_SLOTS];
+const char* op_metric_names[OP_METRICS_SLOTS] = {
+    "", "list", "upload", "download", "delete", "mupload", "mdownload", "mdelete",
+    "entry", "stats", "claim", "resume", "size", "part", "commit", "cluster",
+};
+
+struct RequestTally {
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    bool failed;        // answered with ERROR
+};
+thread_local RequestTally request_tally;
+
+std::atomic<int64_t> active_connections(0);
+std::atomic<uint64_t> accepted_connections(0);
+
+// Scrapes of the -M port that stall are dropped after this long
+#define METRICS_IO_TIMEOUT_SEC 2
+
+/**
+ * @brief Where a handler sends its response
+ * Knows the connection's framing (text lines or binary frames) and the
+ * request id to echo, so handlers only say what to answer.
+ */
+struct Reply {
+    int fd;
+    bool binary;
+    bool tagged;
+    uint64_t id;
+    bool packed;    // file payloads both ways are compressed chunks
+
+    bool send(uint8_t opcode, const std::string& message, uint64_t payload_len = 0, int flags = 0) const {
+        if (opcode == OP_ERROR) request_tally.failed = true;
+        std::string out;
+        encode_response(out, binary, Response{opcode, id, tagged, message, payload_len});
+        return send_all(fd, out.data(), out.size(), flags);
+    }
+
+    bool ok(const std::string& message) const { return send(OP_OK, message); }
+    bool error(const std::string& message) const { return send(OP_ERROR, message); }
+
+    /**
+     * @brief Announce a file payload; the caller sends the bytes next
+     */
+    bool data(uint64_t size) const { return send(OP_DATA, "", size, MSG_MORE); }
+
+    /**
+     * @brief Send a LIST result (or one page of it) in a single write
+     */
+    bool file_list(const std::vector<std::string>& names, bool more) const {
+        std::string entries;
+        for (const std::string& name : names) {
+            encode_list_entry(entries, binary, name);
+        }
+        std::string message = more ? std::string("File list|") + LIST_MORE : "File list";
+        std::string out;
+        if (binary) {
+            encode_response(out, true, Response{OP_OK, id, tagged, message, entries.size()});
+            out += entries;
+        } else {
+            // Classic listing: one line per entry, then an empty line
+            encode_response(out, false, Response{OP_OK, id, tagged, message, 0});
+            out += entries;
+            out += "\n";
+        }
+        request_tally.bytes_out += entries.size();
+        return send_all(fd, out.data(), out.size());
+    }
+};
+
+/**
+ * @brief Handle LIST command
+ * Answered from the index: sorted, optionally filtered by prefix and cut
+ * into pages that resume after a given name.
+ */
+void handle_list(const Reply& reply, const Request& req) {
+    std::vector<std::string> names;
+    bool more = file_index.list(req.name, req.arg, req.payload_len, names);
+    reply.file_list(names, more);
+}
+
+/**
+ * @brief Reserve space for len bytes at offset before they arrive
+ * Big uploads get contiguous extents, and a full disk fails before the
+ * payload is read rather than halfway through it. The file size is left
+ * alone, so a partial upload still reports what it really holds.
+ * @return false only when the space isn't there (unsupported is fine)
+ */
+bool preallocate(int fd, off_t offset, size_t len) {
+    if (len < PREALLOCATE_MIN_SIZE) return true;
+    int rc;
+    do {
+        rc = fallocate(fd, FALLOC_FL_KEEP_SIZE, offset, len);
+    } while (rc < 0 && errno == EINTR);
+    return rc == 0 || (errno != ENOSPC && errno != EDQUOT);
+}
+
+/**
+ * @brief Wait for a syncfs() round that started after this call
+ * The first waiter runs the round for everyone queued behind it; whoever
+ * arrives meanwhile is picked up by the next one.
+ * @return false if a round failed while we waited
+ */
+bool group_sync() {
+    pthread_mutex_lock(&sync_mutex);
+    uint64_t ticket = ++sync_requested;
+    uint64_t errors = sync_errors;
+    while (sync_completed < ticket) {
+        if (sync_running) {
+            pthread_cond_wait(&sync_cond, &sync_mutex);
+            continue;
+        }
+        sync_running = true;
+        uint64_t covered = sync_requested;
+        pthread_mutex_unlock(&sync_mutex);
+        bool ok = syncfs(files_dir_fd) == 0;
+        pthread_mutex_lock(&sync_mutex);
+        if (!ok) ++sync_errors;
+        ++sync_rounds;
+        sync_completed = covered;
+        sync_running = false;
+        pthread_cond_broadcast(&sync_cond);
+    }
+    bool ok = sync_errors == errors;
+    pthread_mutex_unlock(&sync_mutex);
+    return ok;
+}
+
+/**
+ * @brief Make staged payloads durable before they are renamed into place
+ */
+bool sync_payloads(const std::vector<std::string>& paths) {
+    if (sync_mode == SYNC_NONE || paths.empty()) return true;
+    if (sync_mode == SYNC_GROUP) return group_sync();
+    for (const std::string& path : paths) {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        bool ok = fd >= 0 && fdatasync(fd) == 0;
+        if (fd >= 0) close(fd);
+        if (!ok) return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Make renames (and blob links) into the store durable
+ * @param dir_fds the fan-out directories they were made in
+ */
+bool sync_names(std::vector<int> dir_fds) {
+    switch (sync_mode) {
+        case SYNC_NONE:
+            return true;
+        case SYNC_GROUP:
+            return group_sync();
+        case SYNC_DATA:
+            break;
+    }
+    std::sort(dir_fds.begin(), dir_fds.end());
+    dir_fds.erase(std::unique(dir_fds.begin(), dir_fds.end()), dir_fds.end());
+    for (int fd : dir_fds) {
+        if (fd >= 0 && fsync(fd) != 0) return false;
+    }
+    return true;
+}
+
+// Result of streaming one payload into a temp file
+enum UploadStatus {
+    UPLOAD_STAGED,      // payload is in the StagedUpload
+    UPLOAD_WRITE_FAILED,// payload drained, but could not be stored
+    UPLOAD_RECV_FAILED, // connection died mid-payload
+};
+
+#ifdef HAVE_IO_URING
+/**
+ * @brief This worker's ring, set up on first use
+ * @return nullptr if io_uring is unavailable (then it is switched off)
+ */
+Uring* worker_ring() {
+    static thread_local std::unique_ptr<Uring> ring;
+    if (!ring && uring_enabled) {
+        ring.reset(new Uring);
+        if (!ring->init()) {
+            ring.reset();
+            if (uring_enabled.exchange(false)) std::cerr << "io_uring unavailable, using write()\n";
+        }
+    }
+    return ring.get();
+}
+
+/**
+ * @brief receive_into() through the worker's ring
+ * Payload is received straight into a registered buffer and its write is
+ * queued, so up to URING_BUFFERS writes run while the next buffer fills.
+ * Writes land at explicit offsets from fd's current position, which is
+ * left where write() would have left it.
+ */
+bool receive_into_ring(Uring& ring, SocketReader& reader, int fd, off_t offset, size_t size,
+                       bool& write_ok, Sha256* hash) {
+    int free_list[URING_BUFFERS];
+    size_t lengths[URING_BUFFERS];
+    off_t offsets[URING_BUFFERS];
+    int free_count = URING_BUFFERS, in_flight = 0;
+    for (int i = 0; i < URING_BUFFERS; ++i) free_list[i] = i;
+
+    auto reap = [&]() {
+        int index, result;
+        if (!ring.wait(index, result)) {
+            write_ok = false;
+            return false;
+        }
+        --in_flight;
+        free_list[free_count++] = index;
+        if (result < 0) {
+            write_ok = false;
+        } else if ((size_t)result < lengths[index]) {
+            // Short write (disk full and the like): finish it the plain way
+            size_t rest = lengths[index] - result;
+            if (pwrite(fd, ring.buffer(index) + result, rest, offsets[index] + result) != (ssize_t)rest) {
+                write_ok = false;
+            }
+        }
+        return true;
+    };
+
+    bool alive = true;
+    size_t remaining = size;
+    while (remaining > 0) {
+        if (free_count == 0 && !reap()) break;
+        int index = free_list[--free_count];
+        char* buf = ring.buffer(index);
+        size_t want = std::min(remaining, (size_t)URING_BUFFER_SIZE), got = 0;
+        while (got < want) {
+            ssize_t n = reader.read_some(buf + got, want - got);
+            if (n <= 0) break;
+            got += n;
+        }
+        if (got > 0) {
+            if (hash) hash->update(buf, got);
+            lengths[index] = got;
+            offsets[index] = offset;
+            if (write_ok && ring.write_fixed(fd, index, got, offset)) {
+                ++in_flight;
+            } else {
+                write_ok = false;
+                free_list[free_count++] = index;
+            }
+            offset += got;
+            remaining -= got;
+        } else {
+            free_list[free_count++] = index;
+        }
+        if (got < want) {
+            alive = false;
+            break;
+        }
+    }
+    while (in_flight > 0 && reap()) {}
+    if (in_flight > 0) write_ok = false;
+    lseek(fd, offset, SEEK_SET);
+    return alive;
+}
+#endif
+
+/**
+ * @brief Copy size payload bytes from the connection into fd
+ * Moves upload_chunk_size pieces (or one compressed chunk at a time when
+ * packed), so memory stays flat whatever the announced size. After a
+ * local write error (or with write_ok false from the start) the rest is
+ * still drained so the stream stays in sync.
+ * @return false if the connection failed mid-payload; corrupt compressed
+ * data also shuts the connection down, since it can't be resynced
+ */
+bool receive_into(SocketReader& reader, int fd, size_t size, bool& write_ok, Sha256* hash,
+                  bool packed) {
+    size_t remaining = size;
+    if (packed) {
+        ChunkDecoder decoder;
+        while (remaining > 0) {
+            if (!decoder.next(reader, remaining)) {
+                if (decoder.is_corrupt()) shutdown(reader.fd, SHUT_RDWR);
+                return false;
+            }
+            if (write_ok) write_ok = write_all(fd, decoder.data(), decoder.size());
+            if (hash) hash->update(decoder.data(), decoder.size());
+            remaining -= decoder.size();
+        }
+        request_tally.bytes_in += size;
+        return true;
+    }
+
+#ifdef HAVE_IO_URING
+    if (uring_enabled && write_ok && size > 0) {
+        off_t offset = lseek(fd, 0, SEEK_CUR);
+        Uring* ring = offset >= 0 ? worker_ring() : nullptr;
+        if (ring) {
+            if (!receive_into_ring(*ring, reader, fd, offset, size, write_ok, hash)) return false;
+            request_tally.bytes_in += size;
+            return true;
+        }
+    }
+#endif
+
+    std::vector<char> chunk(std::min(upload_chunk_size, std::max(size, (size_t)1)));
+    while (remaining > 0) {
+        ssize_t n = reader.read_some(chunk.data(), std::min(remaining, chunk.size()));
+        if (n <= 0) return false;
+        if (write_ok) write_ok = write_all(fd, chunk.data(), n);
+        if (hash) hash->update(chunk.data(), n);
+        remaining -= n;
+    }
+    request_tally.bytes_in += size;
+    return true;
+}
+
+/**
+ * @brief receive_into() with O_DIRECT writes, bypassing the page cache
+ * Payload is gathered into an aligned buffer and written in whole
+ * blocks; the unaligned tail goes out after O_DIRECT is switched off.
+ * fd must be at offset 0 with O_DIRECT set.
+ */
+bool receive_direct(SocketReader& reader, int fd, size_t size, bool& write_ok, Sha256* hash) {
+    void* mem = nullptr;
+    if (posix_memalign(&mem, DIRECT_IO_ALIGN, DIRECT_IO_BUFFER_SIZE) != 0) {
+        mem = nullptr;
+        write_ok = false;
+    }
+    std::unique_ptr<char, decltype(&free)> buf((char*)mem, &free);
+    std::vector<char> drain(buf ? 0 : upload_chunk_size);
+    char* dst = buf ? buf.get() : drain.data();
+    size_t capacity = buf ? DIRECT_IO_BUFFER_SIZE : drain.size();
+
+    size_t remaining = size, fill = 0;
+    while (remaining > 0) {
+        ssize_t n = reader.read_some(dst + fill, std::min(remaining, capacity - fill));
+        if (n <= 0) return false;
+        if (hash) hash->update(dst + fill, n);
+        fill += n;
+        remaining -= n;
+        if (fill == capacity) {
+            if (write_ok) write_ok = write_all(fd, dst, fill);
+            fill = 0;
+        }
+    }
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags & ~O_DIRECT) < 0) write_ok = false;
+    if (write_ok && fill > 0) write_ok = write_all(fd, dst, fill);
+    request_tally.bytes_in += size;
+    return true;
+}
+
+/**
+ * @brief A received payload waiting to be moved into place
+ */
+struct StagedUpload {
+    std::string tmppath;
+    std::string key;    // content_key() when the blob store is enabled
+};
+/**
+ * @brief The directories storing filename as staged touches
+ */
+void touched_dirs(const std::string& filename, const StagedUpload& staged, std::vector<int>& dir_fds) {
+    dir_fds.push_back(file_dir_fd(filename));
+    if (!staged.key.empty()) dir_fds.push_back(blob_shard_fds[blob_shard(staged.key)]);
+}
+
+/**
+ * @brief Stream filesize payload bytes into a new temp file
+ * With the blob store enabled the content is hashed on the way through.
+ */
+UploadStatus receive_upload(SocketReader& reader, size_t filesize, StagedUpload& staged, bool packed) {
+    std::string tmpl = tmp_dir + "/upload.XXXXXX";
+    int tmp_fd = mkstemp(&tmpl[0]);
+    bool write_ok = tmp_fd >= 0 && fchmod(tmp_fd, 0644) == 0 && preallocate(tmp_fd, 0, filesize);
+    Sha256 hash;
+
+    // Filesystems without O_DIRECT (tmpfs) refuse the flag: stay buffered
+    bool direct = false;
+    if (write_ok && !packed && direct_min_size > 0 && filesize >= direct_min_size) {
+        int flags = fcntl(tmp_fd, F_GETFL);
+        direct = flags >= 0 && fcntl(tmp_fd, F_SETFL, flags | O_DIRECT) == 0;
+    }
+    bool received = direct
+        ? receive_direct(reader, tmp_fd, filesize, write_ok, dedup_enabled ? &hash : nullptr)
+        : receive_into(reader, tmp_fd, filesize, write_ok, dedup_enabled ? &hash : nullptr, packed);
+    if (!received) {
+        if (tmp_fd >= 0) {
+            close(tmp_fd);
+            unlink(tmpl.c_str());
+        }
+        return UPLOAD_RECV_FAILED;
+    }
+
+    if (tmp_fd >= 0 && close(tmp_fd) != 0) write_ok = false;
+    if (!write_ok) {
+        if (tmp_fd >= 0) unlink(tmpl.c_str());
+        return UPLOAD_WRITE_FAILED;
+    }
+    staged.tmppath = tmpl;
+    staged.key = dedup_enabled ? content_key(hash.hex(), filesize) : "";
+    return UPLOAD_STAGED;
+}
+
+/**
+ * @brief Atomically move a staged file over its target
+ * The file lock is only held (exclusively) for the rename.
+ */
+bool install_file(const std::string& tmppath, const std::string& filename) {
+    std::string filepath = get_file_path(filename);
+    pthread_rwlock_t *file_lock = get_file_lock(filename);
+    lock_file(file_lock, true);
+    ino_t replaced = dedup_enabled ? stored_inode(filepath.c_str()) : 0;
+    bool ok = rename(tmppath.c_str(), filepath.c_str()) == 0;
+    if (ok) {
+        file_cache.invalidate(filename);
+        drop_zcache(filename);
+        file_index.add(filename);
+        if (replaced) release_blob(replaced);
+    }
+    pthread_rwlock_unlock(file_lock);
+    if (!ok) unlink(tmppath.c_str());
+    return ok;
+}
+
+/**
+ * @brief Store a received upload under its name
+ * With the blob store enabled it first becomes (or joins) its blob.
+ */
+bool commit_upload(const StagedUpload& staged, const std::string& filename) {
+    if (!staged.key.empty() && !intern_blob(staged.tmppath, staged.key)) {
+        unlink(staged.tmppath.c_str());
+        return false;
+    }
+    return install_file(staged.tmppath, filename);
+}
+
+/**
+ * @brief commit_upload() with the durability -s asks for: the payload is
+ * flushed before the rename publishes it, and the rename before we answer
+ */
+bool store_upload(const StagedUpload& staged, const std::string& filename) {
+    if (!sync_payloads({staged.tmppath})) {
+        unlink(staged.tmppath.c_str());
+        return false;
+    }
+    std::vector<int> dir_fds;
+    touched_dirs(filename, staged, dir_fds);
+    return commit_upload(staged, filename) && sync_names(dir_fds);
+}
+
+/**
+ * @brief Handle a resumable UPLOAD: append to a partial upload, then store it
+ * Offset 0 starts the token over. The partial file is flock()ed for the
+ * duration, so two connections can't feed the same token; the payload is
+ * drained even when refused.
+ */
+void handle_resumed_upload(const Reply& reply, SocketReader& reader, const std::string& filename,
+                           size_t len, std::string_view arg) {
+    uint64_t offset;
+    std::string_view token;
+    const char* err = nullptr;
+    int part_fd = -1;
+    std::string partpath;
+    if (!parse_offset_arg(arg, offset, token) || !valid_resume_token(token)) {
+        err = "Invalid resume token";
+    } else {
+        partpath = partial_dir + "/" + std::string(token);
+        part_fd = open(partpath.c_str(), O_RDWR | O_CLOEXEC | (offset == 0 ? O_CREAT : 0), 0644);
+        struct stat st;
+        if (part_fd < 0) {
+            err = offset == 0 ? "Failed to create file" : "Resume offset mismatch";
+        } else if (flock(part_fd, LOCK_EX | LOCK_NB) != 0) {
+            err = "Upload already in progress";
+        } else if (offset == 0 ? ftruncate(part_fd, 0) != 0
+                               : fstat(part_fd, &st) != 0 || (uint64_t)st.st_size != offset) {
+            err = "Resume offset mismatch";
+        } else if (lseek(part_fd, offset, SEEK_SET) < 0) {
+            err = "Failed to create file";
+        }
+    }
+    if (err && part_fd >= 0) {
+        close(part_fd);
+        part_fd = -1;
+    }
+
+    bool write_ok = part_fd >= 0 && preallocate(part_fd, offset, len);
+    if (!receive_into(reader, part_fd, len, write_ok, nullptr, reply.packed)) {
+        // Whatever arrived stays for the next attempt to build on
+        if (part_fd >= 0) close(part_fd);
+        return;
+    }
+    if (err) {
+        reply.error(err);
+        return;
+    }
+
+    StagedUpload staged{partpath, ""};
+    std::string digest;
+    if (write_ok && dedup_enabled) {
+        write_ok = sha256_fd(part_fd, offset + len, digest);
+        staged.key = content_key(digest, offset + len);
+    }
+    if (!write_ok) {
+        unlink(partpath.c_str());
+        close(part_fd);
+        reply.error("Failed to create file");
+        return;
+    }
+    // Still holding the flock, so nobody appends between here and the rename
+    bool ok = store_upload(staged, filename);
+    close(part_fd);
+    if (!ok) {
+        reply.error("Failed to create file");
+        return;
+    }
+
+    reply.ok("File uploaded successfully");
+    LOG(LOG_INFO, "Uploaded: " << filename << " (" << offset + len << " bytes, resumed at " << offset << ")");
+}
+
+/**
+ * @brief Note that [start, end) of a parallel upload has been written
+ */
+void record_part(const std::string& token, uint64_t start, uint64_t end) {
+    if (start == end) return;
+    pthread_mutex_lock(&part_mutex);
+    std::map<uint64_t, uint64_t>& ranges = part_ranges[token];
+    auto it = ranges.upper_bound(start);
+    if (it != ranges.begin() && std::prev(it)->second >= start) {
+        --it;
+        start = it->first;
+        end = std::max(end, it->second);
+    }
+    while (it != ranges.end() && it->first <= end) {
+        end = std::max(end, it->second);
+        it = ranges.erase(it);
+    }
+    ranges[start] = end;
+    pthread_mutex_unlock(&part_mutex);
+}
+
+/**
+ * @brief Whether the parts written so far cover [0, size)
+ */
+bool parts_cover(const std::string& token, uint64_t size) {
+    pthread_mutex_lock(&part_mutex);
+    auto it = part_ranges.find(token);
+    bool covered = size == 0 || (it != part_ranges.end() && !it->second.empty()
+                                 && it->second.begin()->first == 0
+                                 && it->second.begin()->second >= size);
+    pthread_mutex_unlock(&part_mutex);
+    return covered;
+}
+
+void forget_parts(const std::string& token) {
+    pthread_mutex_lock(&part_mutex);
+    part_ranges.erase(token);
+    pthread_mutex_unlock(&part_mutex);
+}
+
+/**
+ * @brief Handle PART command: write one range of a parallel upload
+ * Parts of the same token may arrive on many connections at once; each
+ * holds a shared flock(), so a sequential UPLOAD or COMMIT (exclusive)
+ * can't run into them.
+ */
+void handle_part(const Reply& reply, SocketReader& reader, const std::string& token,
+                 size_t len, std::string_view offset_field) {
+    uint64_t offset;
+    const char* err = nullptr;
+    int part_fd = -1;
+    if (!parse_size(offset_field, offset) || !valid_resume_token(token)) {
+        err = "Invalid resume token";
+    } else {
+        std::string partpath = partial_dir + "/" + token;
+        part_fd = open(partpath.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+        if (part_fd < 0) {
+            err = "Failed to create file";
+        } else if (flock(part_fd, LOCK_SH | LOCK_NB) != 0) {
+            err = "Upload already in progress";
+        } else if (lseek(part_fd, offset, SEEK_SET) < 0) {
+            err = "Invalid range";
+        }
+    }
+    if (err && part_fd >= 0) {
+        close(part_fd);
+        part_fd = -1;
+    }
+
+    bool write_ok = part_fd >= 0 && preallocate(part_fd, offset, len);
+    bool received = receive_into(reader, part_fd, len, write_ok, nullptr, reply.packed);
+    if (part_fd >= 0) close(part_fd);
+    if (!received) return;
+    if (err || !write_ok) {
+        reply.error(err ? err : "Failed to create file");
+        return;
+    }
+    record_part(token, offset, offset + len);
+    reply.ok(std::to_string(len));
+}
+
+/**
+ * @brief Handle COMMIT command: store a parallel upload once it is complete
+ */
+void handle_commit(const Reply& reply, const std::string& filename, uint64_t size,
+                   const std::string& token) {
+    if (!valid_resume_token(token)) {
+        reply.error("Invalid resume token");
+        return;
+    }
+    std::string partpath = partial_dir + "/" + token;
+    int part_fd = open(partpath.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (part_fd < 0) {
+        reply.error("Failed to create file");
+        return;
+    }
+    if (flock(part_fd, LOCK_EX | LOCK_NB) != 0) {
+        close(part_fd);
+        reply.error("Upload already in progress");
+        return;
+    }
+    if (!parts_cover(token, size)) {
+        close(part_fd);
+        reply.error("Incomplete upload");
+        return;
+    }
+
+    // Holding the exclusive lock: no PART can still be writing
+    StagedUpload staged{partpath, ""};
+    std::string digest;
+    bool ok = ftruncate(part_fd, size) == 0;
+    if (ok && dedup_enabled) {
+        ok = sha256_fd(part_fd, size, digest);
+        staged.key = content_key(digest, size);
+    }
+    ok = ok && store_upload(staged, filename);
+    close(part_fd);
+    forget_parts(token);
+    if (!ok) {
+        reply.error("Failed to create file");
+        return;
+    }
+
+    reply.ok("File uploaded successfully");
+    LOG(LOG_INFO, "Uploaded: " << filename << " (" << size << " bytes, parallel)");
+}
+
+/**
+ * @brief Handle SIZE command: OK|<bytes>|<version>
+ */
+void handle_size(const Reply& reply, const std::string& filename) {
+    pthread_rwlock_t *file_lock = get_file_lock(filename);
+    lock_file(file_lock, false);
+    struct stat st;
+    bool found = stat(get_file_path(filename).c_str(), &st) == 0 && S_ISREG(st.st_mode);
+    pthread_rwlock_unlock(file_lock);
+    if (!found) {
+        reply.error("File not found");
+        return;
+    }
+    // The inode and mtime change whenever an upload replaces the file, so
+    // a client resuming a download can tell its prefix is still current
+    reply.ok(std::to_string(st.st_size) + "|" + std::to_string(st.st_ino) + "."
+             + std::to_string(st.st_mtim.tv_sec) + "." + std::to_string(st.st_mtim.tv_nsec));
+}
+
+/**
+ * @brief Handle RESUME command: how much of a partial upload the server has
+ */
+void handle_resume(const Reply& reply, const std::string& token) {
+    if (!valid_resume_token(token)) {
+        reply.error("Invalid resume token");
+        return;
+    }
+    struct stat st;
+    std::string partpath = partial_dir + "/" + token;
+    reply.ok(std::to_string(stat(partpath.c_str(), &st) == 0 ? (uint64_t)st.st_size : 0));
+}
+
+/**
+ * @brief Handle UPLOAD command
+ * Streams into a temp file which is rename()d over the target, so readers
+ * never see a half-written file.
+ */
+void handle_upload(const Reply& reply, SocketReader& reader, const std::string& filename, size_t filesize) {
+    StagedUpload staged;
+    switch (receive_upload(reader, filesize, staged, reply.packed)) {
+        case UPLOAD_RECV_FAILED:
+            reply.error("Failed to receive file data");
+            return;
+        case UPLOAD_WRITE_FAILED:
+            reply.error("Failed to create file");
+            return;
+        case UPLOAD_STAGED:
+            break;
+    }
+
+    if (!store_upload(staged, filename)) {
+        reply.error("Failed to create file");
+        return;
+    }
+    
+    reply.ok("File uploaded successfully");
+    LOG(LOG_INFO, "Uploaded: " << filename << " (" << filesize << " bytes)");
+}
+
+/**
+ * @brief Handle CLAIM command: store a name for content we already hold
+ * Lets a client skip sending bytes the blob store has; any failure is an
+ * ERROR telling it to upload normally.
+ */
+void handle_claim(const Reply& reply, const std::string& filename, uint64_t size, const std::string& key) {
+    if (!dedup_enabled) {
+        reply.error("Deduplication disabled");
+        return;
+    }
+    // Keys are generated names; anything else can't be in the store
+    std::string suffix = "-" + std::to_string(size);
+    if (key.size() != 64 + suffix.size() || key.compare(64, suffix.size(), suffix) != 0
+        || key.find_first_not_of("0123456789abcdef") != 64) {
+        reply.error("Invalid content key");
+        return;
+    }
+
+    std::string tmppath;
+    if (!stage_blob_link(key, tmppath)) {
+        reply.error("Unknown content");
+        return;
+    }
+    if (!install_file(tmppath, filename) || !sync_names({file_dir_fd(filename)})) {
+        reply.error("Failed to create file");
+        return;
+    }
+
+    reply.ok("File uploaded successfully (deduplicated)");
+    LOG(LOG_INFO, "Claimed: " << filename << " (" << size << " bytes)");
+}
+
+/**
+ * @brief What to send for a download: cached bytes or an open descriptor
+ */
+struct FileSnapshot {
+    int fd;
+    FileCache::Data data;
+    size_t size;
+
+    FileSnapshot() : fd(-1), size(0) {}
+    ~FileSnapshot() {
+        if (fd >= 0) close(fd);
+    }
+
+    bool send_to(int sockfd, size_t offset, size_t count) const {
+        return data ? send_all(sockfd, data->data() + offset, count)
+                    : send_file(sockfd, fd, offset, count);
+    }
+};
+
+/**
+ * @brief Read a small file fully into memory
+ */
+FileCache::Data read_small_file(int fd, size_t size) {
+    std::shared_ptr<std::string> buf = std::make_shared<std::string>(size, '\0');
+    size_t total = 0;
+    while (total < size) {
+        ssize_t n = pread(fd, &(*buf)[total], size - total, total);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return nullptr;
+        total += n;
+    }
+    return buf;
+}
+
+/**
+ * @brief Take a consistent snapshot of a stored file
+ * Small files come from (or are added to) the content cache; the shared
+ * lock is held across the lookup and the fill so a concurrent upload or
+ * delete, which invalidates under the exclusive lock, can't be missed.
+ * Uploads replace files by rename(), so an open fd is itself a stable
+ * snapshot and larger files are sent from it once the lock is dropped.
+ * @return errno-style failure: 0, ENOENT or EIO
+ */
+int open_snapshot(const std::string& filename, FileSnapshot& snap) {
+    pthread_rwlock_t *file_lock = get_file_lock(filename);
+    lock_file(file_lock, false);
+
+    snap.data = file_cache.get(filename);
+    if (snap.data) {
+        pthread_rwlock_unlock(file_lock);
+        snap.size = snap.data->size();
+        return 0;
+    }
+
+    snap.fd = open(get_file_path(filename).c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (snap.fd < 0 || fstat(snap.fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        pthread_rwlock_unlock(file_lock);
+        return snap.fd < 0 ? ENOENT : EIO;
+    }
+    snap.size = st.st_size;
+
+    if (file_cache.enabled() && snap.size <= file_cache.max_object_size()) {
+        FileCache::Data data = read_small_file(snap.fd, snap.size);
+        if (data) {
+            file_cache.put(filename, data);
+            snap.data = data;
+        }
+    }
+    pthread_rwlock_unlock(file_lock);
+    return 0;
+}
+
+/**
+ * @brief Identity of a stored file, recorded at the start of its -Z copy
+ */
+struct ZcacheHeader {
+    char magic[8];
+    uint64_t ino;
+    uint64_t size;
+    uint64_t mtime_ns;
+};
+
+ZcacheHeader zcache_header(const struct stat& st) {
+    ZcacheHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, "DKZCACHE", sizeof(hdr.magic));
+    hdr.ino = st.st_ino;
+    hdr.size = st.st_size;
+    hdr.mtime_ns = (uint64_t)st.st_mtim.tv_sec * 1000000000ull + st.st_mtim.tv_nsec;
+    return hdr;
+}
+
+/**
+ * @brief Send a whole file compressed from its -Z copy
+ * On a miss the file is compressed for this client and the chunks are also
+ * written to a new copy, put in place once complete.
+ */
+bool send_zcached(int sockfd, const std::string& filename, const FileSnapshot& snap,
+                  ChunkEncoder& encoder) {
+    struct stat st;
+    if (fstat(snap.fd, &st) != 0) return false;
+    ZcacheHeader want = zcache_header(st);
+    std::string path = get_zcache_path(filename);
+
+    int zfd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (zfd >= 0) {
+        ZcacheHeader have;
+        struct stat zst;
+        if (pread(zfd, &have, sizeof(have), 0) == (ssize_t)sizeof(have)
+            && memcmp(&have, &want, sizeof(want)) == 0 && fstat(zfd, &zst) == 0) {
+            bool ok = send_file(sockfd, zfd, sizeof(have), zst.st_size - sizeof(have));
+            close(zfd);
+            return ok;
+        }
+        close(zfd);
+    }
+
+    std::string tmpl = tmp_dir + "/zcache.XXXXXX";
+    int tmp_fd = mkstemp(&tmpl[0]);
+    bool keep = tmp_fd >= 0 && write_all(tmp_fd, (const char*)&want, sizeof(want));
+    bool ok = true;
+    std::vector<char> raw(COMPRESS_CHUNK_SIZE);
+    std::string out;
+    for (size_t done = 0; done < snap.size; ) {
+        ssize_t n = pread(snap.fd, raw.data(), std::min(raw.size(), snap.size - done), done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0 || (size_t)n > snap.size - done) {
+            ok = false;
+            break;
+        }
+        out.clear();
+        encoder.encode(raw.data(), n, out);
+        if (keep) keep = write_all(tmp_fd, out.data(), out.size());
+        if (!send_all(sockfd, out.data(), out.size())) {
+            ok = false;
+            break;
+        }
+        done += n;
+    }
+    if (tmp_fd >= 0) {
+        if (close(tmp_fd) != 0) keep = false;
+        if (!ok || !keep || rename(tmpl.c_str(), path.c_str()) != 0) unlink(tmpl.c_str());
+    }
+    return ok;
+}
+
+/**
+ * @brief Send [offset, offset + count) of a snapshot as a payload
+ * Compressed connections get chunks: made from memory for cached files,
+ * from the -Z copy for whole large files, else compressed on the fly.
+ */
+bool send_snapshot(const Reply& reply, const std::string& filename, const FileSnapshot& snap,
+                   size_t offset, size_t count) {
+    // Raw bytes, whether or not they leave compressed
+    request_tally.bytes_out += count;
+    if (!reply.packed) return snap.send_to(reply.fd, offset, count);
+    ChunkEncoder encoder(compress_level);
+    if (snap.data) return send_packed(reply.fd, snap.data->data() + offset, count, encoder);
+    if (zcache_enabled && offset == 0 && count == snap.size && count >= ZCACHE_MIN_SIZE) {
+        return send_zcached(reply.fd, filename, snap, encoder);
+    }
+    return send_packed_file(reply.fd, snap.fd, offset, count, encoder);
+}
+
+/**
+ * @brief Handle DOWNLOAD command
+ * Hot small files are served from memory, everything else with
+ * send_file() (sendfile, mmap fallback) from a single open descriptor.
+ * Any number of clients can stream the same file at once. A range
+ * ("<offset>|<length>") sends only part of the file.
+ */
+void handle_download(const Reply& reply, const std::string& filename, std::string_view range) {
+    uint64_t offset = 0, length = 0;
+    std::string_view length_field;
+    if (!range.empty() && (!parse_offset_arg(range, offset, length_field)
+                           || (!length_field.empty() && !parse_size(length_field, length)))) {
+        reply.error("Invalid range");
+        return;
+    }
+
+    FileSnapshot snap;
+    int err = open_snapshot(filename, snap);
+    if (err == ENOENT) {
+        reply.error("File not found");
+        return;
+    }
+    if (err) {
+        reply.error("Failed to read file");
+        return;
+    }
+    
+    if (offset > snap.size) {
+        reply.error("Invalid range");
+        return;
+    }
+    size_t count = snap.size - offset;
+    if (length && length < count) count = length;
+
+    if (!reply.data(count)) {
+        return;
+    }
+
+    if (!send_snapshot(reply, filename, snap, offset, count)) {
+        LOG(LOG_WARN, "Failed to send file data: " << filename);
+        return;
+    }
+    
+    LOG(LOG_INFO, "Downloaded: " << filename << " (" << count << " bytes)");
+}
+
+/**
+ * @brief Handle DELETE command
+ */
+void handle_delete(const Reply& reply, const std::string& filename) {
+    
+    pthread_rwlock_t *file_lock = get_file_lock(filename);
+    lock_file(file_lock, true);
+    
+    std::string filepath = get_file_path(filename);
+    
+    // Whatever the outcome the cached copy may be stale now
+    file_cache.invalidate(filename);
+    drop_zcache(filename);
+    ino_t removed = dedup_enabled ? stored_inode(filepath.c_str()) : 0;
+    if (unlink(filepath.c_str()) != 0) {
+        int err = errno;
+        if (err == ENOENT) file_index.remove(filename);
+        pthread_rwlock_unlock(file_lock);  
+        if (err == ENOENT) {
+            reply.error("File not found");
+        } else {
+            reply.error("Failed to delete file");
+        }
+        return;
+    }
+    file_index.remove(filename);
+    if (removed) release_blob(removed);
+    pthread_rwlock_unlock(file_lock);
+
+    reply.ok("File deleted successfully");
+    LOG(LOG_INFO, "Deleted: " << filename);
+}
+
+/**
+ * @brief Summarise a batch outcome as one status response
+ */
+void reply_batch(const Reply& reply, const char* verb, size_t total,
+                 const std::vector<std::string>& failed) {
+    if (failed.empty()) {
+        reply.ok(std::string(verb) + " " + std::to_string(total) + " files");
+        return;
+    }
+    std::string msg = "Failed on " + std::to_string(failed.size()) + " of " + std::to_string(total) + ":";
+    for (const std::string& name : failed) {
+        if (msg.size() > MAX_FILENAME_LEN) {
+            msg += " ...";
+            break;
+        }
+        msg += " " + name;
+    }
+    reply.error(msg);
+}
+
+/**
+ * @brief Handle MUPLOAD: count entries, each an entry header plus payload
+ * Every payload is staged first and the whole batch is committed with a
+ * burst of renames at the end, so nothing becomes visible unless the
+ * client sent the complete batch.
+ */
+void handle_mupload(const Reply& reply, SocketReader& reader, uint64_t count) {
+    if (count > MAX_BATCH_ENTRIES) {
+        // Can't resync past entries we refuse to read
+        reply.error("Batch too large");
+        shutdown(reply.fd, SHUT_RDWR);
+        return;
+    }
 
+    std::vector<std::pair<std::string, StagedUpload>> staged;
+    std::vector<std::string> failed;
+    auto discard = [&]() {
+        for (auto& item : staged) unlink(item.second.tmppath.c_str());
+    };
 
-#define SERVER_FILES_DIR "./server_files"
+    for (uint64_t i = 0; i < count; ++i) {
+        bool is_entry;
+        std::string name;
+        uint64_t size;
+        Response unused;
+        if (!read_batch_item(reader, reply.binary, false, is_entry, name, size, unused) || !is_entry) {
+            discard();
+            reply.error("Failed to receive batch");
+            shutdown(reply.fd, SHUT_RDWR);
+            return;
+        }
+        StagedUpload upload;
+        UploadStatus status;
+        if (name.empty() || name.size() > MAX_FILENAME_LEN) {
+            // Nowhere to store it, but its payload still has to be read past
+            bool write_ok = false;
+            status = receive_into(reader, -1, size, write_ok, nullptr, reply.packed)
+                     ? UPLOAD_WRITE_FAILED : UPLOAD_RECV_FAILED;
+        } else {
+            status = receive_upload(reader, size, upload, reply.packed);
+        }
+        if (status == UPLOAD_RECV_FAILED) {
+            discard();
+            reply.error("Failed to receive file data");
+            return;
+        }
+        if (status == UPLOAD_STAGED) {
+            staged.emplace_back(name, upload);
+        } else {
+            failed.push_back(name);
+        }
+    }
 
-// Global pthread mutex for file operations
-pthread_mutex_t file_locks_mutex = PTHREAD_MUTEX_INITIALIZER;
-std::unordered_map<std::string, pthread_mutex_t> file_locks;
+    // One flush for the whole batch on each side of the renames
+    std::vector<std::string> paths;
+    for (auto& item : staged) paths.push_back(item.second.tmppath);
+    if (!sync_payloads(paths)) {
+        discard();
+        for (auto& item : staged) failed.push_back(item.first);
+        staged.clear();
+    }
+    std::vector<std::string> stored;
+    std::vector<int> dir_fds;
+    for (auto& item : staged) {
+        touched_dirs(item.first, item.second, dir_fds);
+        (commit_upload(item.second, item.first) ? stored : failed).push_back(item.first);
+    }
+    if (!stored.empty() && !sync_names(dir_fds)) {
+        failed.insert(failed.end(), stored.begin(), stored.end());
+    }
+    reply_batch(reply, "Uploaded", count, failed);
+    LOG(LOG_INFO, "Uploaded batch: " << count - failed.size() << "/" << count << " files");
+}
 
 /**
- * @brief Safely gets and a specific file mutex
+ * @brief Handle MDELETE: count entries naming the files to remove
+ * All names are read first; the unlinks then run back to back against the
+ * fan-out directories' fds.
  */
-pthread_mutex_t* get_file_mutex(const std::string& filename) {
-    pthread_mutex_lock(&file_locks_mutex);
+void handle_mdelete(const Reply& reply, SocketReader& reader, uint64_t count) {
+    if (count > MAX_BATCH_ENTRIES) {
+        reply.error("Batch too large");
+        shutdown(reply.fd, SHUT_RDWR);
+        return;
+    }
 
-    auto [it, inserted] = file_locks.emplace(filename, pthread_mutex_t{});
-    if (inserted) {
-        pthread_mutex_init(&it->second, nullptr);
+    std::vector<std::string> names;
+    for (uint64_t i = 0; i < count; ++i) {
+        bool is_entry;
+        std::string name;
+        uint64_t size;
+        Response unused;
+        if (!read_batch_item(reader, reply.binary, false, is_entry, name, size, unused)
+            || !is_entry || size != 0) {
+            reply.error("Failed to receive batch");
+            shutdown(reply.fd, SHUT_RDWR);
+            return;
+        }
+        names.push_back(name);
     }
 
-    pthread_mutex_t* m = &it->second;
+    std::vector<std::string> failed;
+    for (const std::string& name : names) {
+        if (name.empty() || name.size() > MAX_FILENAME_LEN) {
+            failed.push_back(name);
+            continue;
+        }
+        int dir_fd = file_dir_fd(name);
+        pthread_rwlock_t *file_lock = get_file_lock(name);
+        lock_file(file_lock, true);
+        file_cache.invalidate(name);
+        drop_zcache(name);
+        std::string storage_name = encode_storage_name(name);
+        struct stat st;
+        ino_t removed = dedup_enabled
+                        && fstatat(dir_fd, storage_name.c_str(), &st, AT_SYMLINK_NOFOLLOW) == 0 ? st.st_ino : 0;
+        bool ok = unlinkat(dir_fd, storage_name.c_str(), 0) == 0;
+        if (ok || errno == ENOENT) file_index.remove(name);
+        if (ok && removed) release_blob(removed);
+        pthread_rwlock_unlock(file_lock);
+        if (!ok) failed.push_back(name);
+    }
 
-    pthread_mutex_unlock(&file_locks_mutex);
-    return m;
+    reply_batch(reply, "Deleted", count, failed);
+    LOG(LOG_INFO, "Deleted batch: " << count - failed.size() << "/" << count << " files");
 }
 
 /**
- * @brief Safely destroy and remove a file-specific mutex
+ * @brief Handle MDOWNLOAD: send every file whose name matches a glob
+ * The index picks the files, then each goes out as an entry header
+ * plus its payload (cache or sendfile), followed by one final status.
  */
-void delete_file_mutex(const std::string& filename) {
-    pthread_mutex_lock(&file_locks_mutex);
+void handle_mdownload(const Reply& reply, const std::string& pattern) {
+    // Only names sharing the pattern's literal head can match
+    std::vector<std::string> candidates;
+    file_index.list(pattern.substr(0, pattern.find_first_of("*?[\\")), "", 0, candidates);
+
+    std::vector<std::string> matches;
+    for (const std::string& name : candidates) {
+        if (fnmatch(pattern.c_str(), name.c_str(), 0) == 0) matches.push_back(name);
+    }
 
-    auto it = file_locks.find(filename);
-    if (it != file_locks.end()) {
-        // Destroy mutex
-        pthread_mutex_destroy(&it->second);
+    std::vector<std::string> failed;
+    for (const std::string& name : matches) {
+        FileSnapshot snap;
+        if (open_snapshot(name, snap) != 0) {
+            failed.push_back(name);  // deleted since it was listed
+            continue;
+        }
 
-        // Remove from map
-        file_locks.erase(it);
+        std::string header;
+        encode_batch_entry(header, reply.binary, name, snap.size);
+        if (!send_all(reply.fd, header.data(), header.size(), MSG_MORE) || !send_snapshot(reply, name, snap, 0, snap.size)) {
+            return;
+        }
     }
 
-    pthread_mutex_unlock(&file_locks_mutex);
+    reply_batch(reply, "Downloaded", matches.size(), failed);
+    LOG(LOG_INFO, "Downloaded batch: " << matches.size() - failed.size() << " files");
 }
 
 /**
- * @brief Ensure server files directory exists
+ * @brief State for one client socket
+ * While idle the fd sits in its reactor's epoll set (EPOLLONESHOT) and only
+ * the reactor touches it; once a full request is buffered it is handed to
+ * exactly one worker, which re-arms it when done.
  */
-void ensure_directory() {
-    struct stat st;
-    if (stat(SERVER_FILES_DIR, &st) != 0) {
-        mkdir(SERVER_FILES_DIR, 0755);
+struct Connection {
+    int fd;
+    int epoll_fd;
+    SocketReader reader;
+    bool pipelined;     // client sent HELLO|pipeline: requests carry "#<id>|"
+    bool binary;        // client sent HELLO|binary: frames instead of lines
+    bool packed;        // client sent HELLO|deflate: payloads are compressed chunks
+};
+
+/**
+ * @brief True once the next request is fully buffered (payload excluded)
+ */
+bool has_request(const Connection* conn) {
+    return conn->binary ? conn->reader.has_frame() : conn->reader.has_line();
+}
+
+/**
+ * @brief One epoll loop with its own listening socket
+ */
+struct Reactor {
+    int epoll_fd;
+    int listen_fd;
+};
+
+// Bounded worker pool that runs requests (socket payload + disk I/O).
+// The queue is a fixed ring; when it is full the reactor turns new
+// requests away with ERROR|busy instead of letting the backlog grow.
+pthread_mutex_t work_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;
+std::vector<Connection*> work_queue;
+size_t work_head = 0;
+size_t work_count = 0;
+std::atomic<uint64_t> busy_rejections(0);
+
+// Queue slots per worker unless -q says otherwise
+#define DEFAULT_QUEUE_PER_WORKER 16
+// What saturated clients are told to wait before reconnecting
+#define BUSY_RETRY_AFTER_MS 200
+
+// Connection state is recycled rather than allocated per accept; at most
+// this many spare objects are kept
+#define SPARE_CONNECTIONS_MAX 1024
+pthread_mutex_t spare_mutex = PTHREAD_MUTEX_INITIALIZER;
+std::vector<Connection*> spare_connections;
+
+// Pending connections the kernel queues per listener (-b)
+int listen_backlog = SOMAXCONN;
+
+// Stop a stalled client from pinning a worker forever
+#define CLIENT_IO_TIMEOUT_SEC 30
+
+/**
+ * @brief Toggle O_NONBLOCK on a socket
+ */
+bool set_nonblocking(int fd, bool enable) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) return false;
+    flags = enable ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+    return fcntl(fd, F_SETFL, flags) == 0;
+}
+
+/**
+ * @brief Connection state for a freshly accepted socket, reusing a spare
+ */
+Connection* open_connection(int fd, int epoll_fd) {
+    Connection* conn = nullptr;
+    pthread_mutex_lock(&spare_mutex);
+    if (!spare_connections.empty()) {
+        conn = spare_connections.back();
+        spare_connections.pop_back();
     }
+    pthread_mutex_unlock(&spare_mutex);
+    if (!conn) return new Connection{fd, epoll_fd, SocketReader(fd), false, false, false};
+    conn->fd = fd;
+    conn->epoll_fd = epoll_fd;
+    conn->reader.reset(fd);
+    conn->pipelined = conn->binary = conn->packed = false;
+    return conn;
 }
 
 /**
- * @brief Get full path for a file in server storage
+ * @brief Close a connection and recycle its state
  */
-std::string get_file_path(const std::string& filename) {
-    return std::string(SERVER_FILES_DIR) + "/" + filename;
+void close_connection(Connection* conn) {
+    close(conn->fd);
+    LOG(LOG_DEBUG, "Client disconnected (fd: " << conn->fd << ")");
+    active_connections.fetch_sub(1, std::memory_order_relaxed);
+    conn->reader.reset(-1);
+    conn->reader.release_if_empty();
+    pthread_mutex_lock(&spare_mutex);
+    if (spare_connections.size() < SPARE_CONNECTIONS_MAX) {
+        spare_connections.push_back(conn);
+        conn = nullptr;
+    }
+    pthread_mutex_unlock(&spare_mutex);
+    delete conn;
 }
 
 /**
- * @brief Handle LIST command
+ * @brief Put an idle connection back under its reactor's control
  */
-void handle_list(int client_fd) {
-    
-    DIR* dir = opendir(SERVER_FILES_DIR);
-    if (!dir) {
-        
-        send_line(client_fd, std::string(RESP_ERROR) + "|Failed to open directory");
-        return;
+void rearm_connection(Connection* conn) {
+    conn->reader.release_if_empty();
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET | EPOLLONESHOT;
+    ev.data.ptr = conn;
+    if (!set_nonblocking(conn->fd, true)
+        || epoll_ctl(conn->epoll_fd, EPOLL_CTL_MOD, conn->fd, &ev) < 0) {
+        close_connection(conn);
     }
-    
-    // Send OK 
-    send_line(client_fd, std::string(RESP_OK) + "|File list");
-    
-    // Send each filename
-    struct dirent* entry;
-    while ((entry = readdir(dir)) != nullptr) {
-        if (entry->d_type == DT_REG) {
-            send_line(client_fd, entry->d_name);
+}
+
+/**
+ * @brief Queue a connection that has a complete request buffered
+ * @return false if the queue is full (the connection is left alone)
+ */
+bool submit_connection(Connection* conn) {
+    pthread_mutex_lock(&work_mutex);
+    if (work_count == work_queue.size()) {
+        pthread_mutex_unlock(&work_mutex);
+        return false;
+    }
+    work_queue[(work_head + work_count++) % work_queue.size()] = conn;
+    pthread_cond_signal(&work_cond);
+    pthread_mutex_unlock(&work_mutex);
+    return true;
+}
+
+/**
+ * @brief Next queued connection, waiting for one
+ */
+Connection* take_connection() {
+    pthread_mutex_lock(&work_mutex);
+    while (work_count == 0) {
+        pthread_cond_wait(&work_cond, &work_mutex);
+    }
+    Connection* conn = work_queue[work_head];
+    work_head = (work_head + 1) % work_queue.size();
+    --work_count;
+    pthread_mutex_unlock(&work_mutex);
+    return conn;
+}
+
+/**
+ * @brief Answer HELLO with the subset of requested features we support
+ * The reply is always a text line; binary framing starts after it.
+ */
+void handle_hello(Connection* conn, const std::string& line) {
+    std::string accepted;
+    std::vector<std::string> parts = split_string(line, '|');
+    for (size_t i = 1; i < parts.size(); ++i) {
+        if (parts[i] == FEATURE_PIPELINE) {
+            conn->pipelined = true;
+        } else if (parts[i] == FEATURE_BINARY) {
+            conn->binary = true;
+        } else if (parts[i] == FEATURE_BATCH) {
+            // Always available; acknowledged so clients can rely on it
+        } else if (parts[i] == FEATURE_RESUME) {
+            // Ranged DOWNLOAD, resumable UPLOAD, RESUME and SIZE
+        } else if (parts[i] == FEATURE_PARALLEL) {
+            // PART and COMMIT
+        } else if (parts[i] == FEATURE_DEFLATE && compress_level >= 0) {
+            conn->packed = true;
+        } else if (parts[i] == FEATURE_DEDUP && dedup_enabled) {
+            // CLAIM will find previously uploaded content
+        } else {
+            continue;
         }
+        accepted += "|" + parts[i];
     }
-    
-    // Send empty line to signal end
-    send_line(client_fd, "");
-    
-    closedir(dir);
-    
+    send_line(conn->fd, std::string(RESP_OK) + "|" + CMD_HELLO + accepted);
 }
 
 /**
- * @brief Handle UPLOAD command
+ * @brief Handle STATS command
+ * One line of key=value pairs: the cache and server counters, then for
+ * each operation seen so far "<op>.requests=...", errors, bytes in and
+ * out and its p50/p99/p999 latency in microseconds.
+ */
+void handle_stats(const Reply& reply) {
+    FileCacheStats st = file_cache.stats();
+    pthread_mutex_lock(&sync_mutex);
+    uint64_t rounds = sync_rounds, requests = sync_requested;
+    pthread_mutex_unlock(&sync_mutex);
+    std::string line = "cache hits=" + std::to_string(st.hits)
+             + " misses=" + std::to_string(st.misses)
+             + " entries=" + std::to_string(st.entries)
+             + " bytes=" + std::to_string(st.bytes)
+             + " capacity=" + std::to_string(st.capacity)
+             + " busy=" + std::to_string(busy_rejections.load())
+             + " sync_rounds=" + std::to_string(rounds)
+             + " sync_requests=" + std::to_string(requests)
+             + " connections=" + std::to_string(active_connections.load())
+             + " accepted=" + std::to_string(accepted_connections.load())
+             + " lock_waits=" + std::to_string(lock_waits.load())
+             + " lock_wait_us=" + std::to_string(lock_wait_ns.load() / 1000)
+             + " log_dropped=" + std::to_string(server_log.dropped());
+    for (int op = 1; op < OP_METRICS_SLOTS; ++op) {
+        const OpMetrics& m = op_metrics[op];
+        if (m.requests.load(std::memory_order_relaxed) == 0) continue;
+        std::string key = std::string(" ") + op_metric_names[op] + ".";
+        line += key + "requests=" + std::to_string(m.requests.load())
+              + key + "errors=" + std::to_string(m.errors.load())
+              + key + "bytes_in=" + std::to_string(m.bytes_in.load())
+              + key + "bytes_out=" + std::to_string(m.bytes_out.load())
+              + key + "p50_us=" + std::to_string(m.latency_ns.percentile(0.50) / 1000)
+              + key + "p99_us=" + std::to_string(m.latency_ns.percentile(0.99) / 1000)
+              + key + "p999_us=" + std::to_string(m.latency_ns.percentile(0.999) / 1000);
+    }
+    reply.ok(line);
+}
+
+/**
+ * @brief Handle CLUSTER command: the nodes clients should spread names over
  */
-void handle_upload(int client_fd, const std::string& filename, size_t filesize) {
-   
-    std::vector<char> buffer(filesize);
-    if (!recv_all(client_fd, buffer.data(), filesize)) {
-        send_line(client_fd, std::string(RESP_ERROR) + "|Failed to receive file data");
+void handle_cluster(const Reply& reply) {
+    if (cluster_nodes.empty()) {
+        reply.error("Not clustered");
         return;
     }
+    std::string line = std::to_string(cluster_replicas);
+    for (const std::string& node : cluster_nodes) line += "|" + node;
+    reply.ok(line);
+}
 
-    
-    pthread_mutex_t *file_mutex = get_file_mutex(filename);
-    pthread_mutex_lock(file_mutex);
+/**
+ * @brief The metrics in Prometheus text exposition format (-M)
+ */
+std::string metrics_text() {
+    FileCacheStats st = file_cache.stats();
+    std::ostringstream out;
+    auto series = [&](const char* name, const char* type, const char* help) {
+        out << "# HELP " << name << " " << help << "\n# TYPE " << name << " " << type << "\n";
+    };
+    auto per_op = [&](const char* name, const char* help,
+                      const std::atomic<uint64_t> OpMetrics::*field) {
+        series(name, "counter", help);
+        for (int op = 1; op < OP_METRICS_SLOTS; ++op) {
+            if (op_metrics[op].requests.load(std::memory_order_relaxed) == 0) continue;
+            out << name << "{op=\"" << op_metric_names[op] << "\"} " << (op_metrics[op].*field).load() << "\n";
+        }
+    };
+    per_op("cloud_requests_total", "Requests answered", &OpMetrics::requests);
+    per_op("cloud_request_errors_total", "Requests answered with ERROR", &OpMetrics::errors);
+    per_op("cloud_received_bytes_total", "Payload bytes received", &OpMetrics::bytes_in);
+    per_op("cloud_sent_bytes_total", "Payload bytes sent", &OpMetrics::bytes_out);
 
-    
-    std::string filepath = get_file_path(filename);
-    std::ofstream file(filepath, std::ios::binary);
-    if (!file.is_open()) {
-        pthread_mutex_unlock(file_mutex);  
-        send_line(client_fd, std::string(RESP_ERROR) + "|Failed to create file");
-        return;
+    series("cloud_request_duration_seconds", "summary", "Time from parsed request to answer");
+    for (int op = 1; op < OP_METRICS_SLOTS; ++op) {
+        const LatencyHistogram& h = op_metrics[op].latency_ns;
+        if (h.count() == 0) continue;
+        std::string label = std::string("op=\"") + op_metric_names[op] + "\"";
+        for (double q : {0.5, 0.9, 0.99, 0.999}) {
+            out << "cloud_request_duration_seconds{" << label << ",quantile=\"" << q << "\"} "
+                << h.percentile(q) / 1e9 << "\n";
+        }
+        out << "cloud_request_duration_seconds_sum{" << label << "} " << h.total_value() / 1e9 << "\n"
+            << "cloud_request_duration_seconds_count{" << label << "} " << h.count() << "\n";
     }
-    
-    file.write(buffer.data(), filesize);
-    file.close();
 
-    pthread_mutex_unlock(file_mutex);
-    
-    send_line(client_fd, std::string(RESP_OK) + "|File uploaded successfully");
-    std::cout << "Uploaded: " << filename << " (" << filesize << " bytes)\n";
+    series("cloud_connections", "gauge", "Open client connections");
+    out << "cloud_connections " << active_connections.load() << "\n";
+    series("cloud_accepted_connections_total", "counter", "Client connections accepted");
+    out << "cloud_accepted_connections_total " << accepted_connections.load() << "\n";
+    series("cloud_busy_rejections_total", "counter", "Connections turned away with ERROR|busy");
+    out << "cloud_busy_rejections_total " << busy_rejections.load() << "\n";
+    series("cloud_lock_waits_total", "counter", "File lock acquisitions that had to wait");
+    out << "cloud_lock_waits_total " << lock_waits.load() << "\n";
+    series("cloud_lock_wait_seconds_total", "counter", "Time spent waiting for file locks");
+    out << "cloud_lock_wait_seconds_total " << lock_wait_ns.load() / 1e9 << "\n";
+    series("cloud_cache_hits_total", "counter", "Downloads served from the small-file cache");
+    out << "cloud_cache_hits_total " << st.hits << "\n";
+    series("cloud_cache_misses_total", "counter", "Small-file cache misses");
+    out << "cloud_cache_misses_total " << st.misses << "\n";
+    series("cloud_cache_bytes", "gauge", "Bytes held by the small-file cache");
+    out << "cloud_cache_bytes " << st.bytes << "\n";
+    series("cloud_log_dropped_total", "counter", "Log messages dropped by the rate limit");
+    out << "cloud_log_dropped_total " << server_log.dropped() << "\n";
+    return out.str();
 }
 
 /**
- * @brief Handle DOWNLOAD command
+ * @brief Serve metrics_text() over HTTP to anything that connects (-M)
+ * Scrapes are rare and tiny, so one blocking thread answers them all,
+ * whatever the path asked for.
  */
-void handle_download(int client_fd, const std::string& filename) {
-    std::string filepath = get_file_path(filename);
-    std::ifstream check(filepath, std::ios::binary);
-    if (!check.is_open()) {
-        send_line(client_fd, std::string(RESP_ERROR) + "|File not found");
-        return;
+void* metrics_main(void* arg) {
+    int listen_fd = (int)(intptr_t)arg;
+    while (true) {
+        int fd = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            perror("Metrics accept failed");
+            return nullptr;
+        }
+        struct timeval tv = {METRICS_IO_TIMEOUT_SEC, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        // Read the request head (and ignore it)
+        std::string head;
+        char buf[1024];
+        while (head.size() < 8192 && head.find("\r\n\r\n") == std::string::npos) {
+            ssize_t n = recv(fd, buf, sizeof(buf), 0);
+            if (n <= 0) break;
+            head.append(buf, n);
+        }
+        std::string body = metrics_text();
+        std::string response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                               "Content-Length: " + std::to_string(body.size()) + "\r\n\r\n" + body;
+        send_all(fd, response.data(), response.size());
+        close(fd);
     }
+}
 
-    pthread_mutex_t *file_mutex = get_file_mutex(filename);
-    pthread_mutex_lock(file_mutex);
-    
-    
-    std::ifstream file(filepath, std::ios::binary | std::ios::ate);
-    if (!file.is_open()) {
-        pthread_mutex_unlock(file_mutex);  
-        send_line(client_fd, std::string(RESP_ERROR) + "|File not found");
-        return;
-    }
-    
-    size_t filesize = file.tellg();
-    file.seekg(0, std::ios::beg);
-    
-    std::vector<char> buffer(filesize);
-    if (!file.read(buffer.data(), filesize)) {
-        file.close();
-        pthread_mutex_unlock(file_mutex);  
-        send_line(client_fd, std::string(RESP_ERROR) + "|Failed to read file");
-        return;
+/**
+ * @brief Listen for metrics scrapes on port (-M)
+ */
+bool start_metrics_server(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int opt = 1;
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(port);
+    if (fd < 0 || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0
+        || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 16) < 0) {
+        perror("Metrics listener failed");
+        if (fd >= 0) close(fd);
+        return false;
     }
-    file.close();
-    
-    pthread_mutex_unlock(file_mutex);
-    
-    std::string response = std::string(RESP_OK) + "|" + std::string(RESP_DATA) + "|" + std::to_string(filesize);
-    if (!send_line(client_fd, response)) {
-        return;
+    pthread_t thread_id;
+    if (pthread_create(&thread_id, NULL, metrics_main, (void*)(intptr_t)fd) != 0) {
+        perror("Thread creation failed");
+        close(fd);
+        return false;
     }
+    pthread_detach(thread_id);
+    return true;
+}
 
-    if (!send_all(client_fd, buffer.data(), filesize)) {
-        std::cerr << "Failed to send file data\n";
-        return;
+/**
+ * @brief Run one parsed request
+ */
+void serve_request(Connection* conn, const Reply& reply, const Request& req) {
+    std::string filename(req.name);
+    auto start = std::chrono::steady_clock::now();
+    request_tally = RequestTally{0, 0, false};
+
+    switch (req.opcode) {
+        case OP_LIST:
+            handle_list(reply, req);
+            break;
+        case OP_UPLOAD:
+            if (req.arg.empty()) {
+                handle_upload(reply, conn->reader, filename, req.payload_len);
+            } else {
+                handle_resumed_upload(reply, conn->reader, filename, req.payload_len, req.arg);
+            }
+            break;
+        case OP_DOWNLOAD:
+            handle_download(reply, filename, req.arg);
+            break;
+        case OP_RESUME:
+            handle_resume(reply, filename);
+            break;
+        case OP_SIZE:
+            handle_size(reply, filename);
+            break;
+        case OP_PART:
+            handle_part(reply, conn->reader, filename, req.payload_len, req.arg);
+            break;
+        case OP_COMMIT:
+            handle_commit(reply, filename, req.payload_len, std::string(req.arg));
+            break;
+        case OP_DELETE:
+            handle_delete(reply, filename);
+            break;
+        case OP_MUPLOAD:
+            handle_mupload(reply, conn->reader, req.payload_len);
+            break;
+        case OP_MDELETE:
+            handle_mdelete(reply, conn->reader, req.payload_len);
+            break;
+        case OP_MDOWNLOAD:
+            handle_mdownload(reply, filename);
+            break;
+        case OP_STATS:
+            handle_stats(reply);
+            break;
+        case OP_CLUSTER:
+            handle_cluster(reply);
+            break;
+        case OP_CLAIM:
+            handle_claim(reply, filename, req.payload_len, std::string(req.arg));
+            break;
+        default:
+            reply.error("Unknown command");
+            break;
     }
-    
-    std::cout << "Downloaded: " << filename << " (" << filesize << " bytes)\n";
+
+    if (req.opcode == 0 || req.opcode >= OP_METRICS_SLOTS) return;
+    OpMetrics& m = op_metrics[req.opcode];
+    m.requests.fetch_add(1, std::memory_order_relaxed);
+    if (request_tally.failed) m.errors.fetch_add(1, std::memory_order_relaxed);
+    if (request_tally.bytes_in) m.bytes_in.fetch_add(request_tally.bytes_in, std::memory_order_relaxed);
+    if (request_tally.bytes_out) m.bytes_out.fetch_add(request_tally.bytes_out, std::memory_order_relaxed);
+    m.latency_ns.record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - start).count());
 }
 
 /**
- * @brief Handle DELETE command
+ * @brief Read and run the next buffered request
+ * @return false once the connection should be closed
  */
-void handle_delete(int client_fd, const std::string& filename) {
-    
-    if (file_locks.find(filename) == file_locks.end()) {
-        send_line(client_fd, std::string(RESP_ERROR) + "|File not found");
-        return;
+bool serve_next(Connection* conn) {
+    Request req;
+    if (conn->binary) {
+        if (!next_frame_request(conn->reader, req)) return false;
+        LOG(LOG_DEBUG, "Received: frame op " << (int)req.opcode << " " << req.name);
+        serve_request(conn, Reply{conn->fd, true, true, req.id, conn->packed}, req);
+        return true;
     }
-    pthread_mutex_t *file_mutex = get_file_mutex(filename);
-    pthread_mutex_lock(file_mutex);
-    
-    std::string filepath = get_file_path(filename);
-    
-    if (unlink(filepath.c_str()) != 0) {
-        pthread_mutex_unlock(file_mutex);  
-        send_line(client_fd, std::string(RESP_ERROR) + "|Failed to delete file");
-        return;
+
+    std::string line;
+    if (!conn->reader.next_line(line)) return false;
+    if (line.empty()) return true;
+
+    LOG(LOG_DEBUG, "Received: " << line);
+
+    if (line.compare(0, strlen(CMD_HELLO), CMD_HELLO) == 0
+        && (line.size() == strlen(CMD_HELLO) || line[strlen(CMD_HELLO)] == '|')) {
+        handle_hello(conn, line);
+        return true;
     }
-    
-    
-    pthread_mutex_unlock(file_mutex);
-    delete_file_mutex(filename);
 
-    send_line(client_fd, std::string(RESP_OK) + "|File deleted successfully");
-    std::cout << "Deleted: " << filename << "\n";
+    const char* err = parse_text_request(line, conn->pipelined, req);
+    Reply reply{conn->fd, false, req.tagged, req.id, conn->packed};
+    if (err) {
+        reply.error(err);
+        return true;
+    }
+    serve_request(conn, reply, req);
+    return true;
 }
 
 /**
- * @brief Handle a single client connection
- * This function runs in its own thread
+ * @brief Worker thread: serve every buffered request, then park the fd
+ * Sockets are switched to blocking for the duration so the handlers can
+ * stream payloads with plain send/recv.
  */
-void* handle_client(void* arg) {
-    int client_fd = *(int*)arg;  
-    free(arg);                    
-    
-    std::cout << "Client connected (fd: " << client_fd << ")\n";
-    
+void* worker_main(void*) {
     while (true) {
-        
-        std::string request = read_line(client_fd);
-        if (request.empty()) {
-            break; // Client disconnected
-        }
-        
-        std::cout << "Received: " << request << "\n";
-        
-        std::vector<std::string> parts = split_string(request, '|');
-        if (parts.empty()) continue;
-        
-        std::string cmd = parts[0];
-        
-        if (cmd == CMD_LIST) {
-            handle_list(client_fd);
-        }
-        else if (cmd == CMD_UPLOAD) {
-            if (parts.size() < 3) {
-                send_line(client_fd, std::string(RESP_ERROR) + "|Invalid UPLOAD command");
-                continue;
-            }
-            std::string filename = parts[1];
-            size_t filesize = std::stoull(parts[2]);
-            handle_upload(client_fd, filename, filesize);
+        Connection* conn = take_connection();
+
+        if (!set_nonblocking(conn->fd, false)) {
+            close_connection(conn);
+            continue;
         }
-        else if (cmd == CMD_DOWNLOAD) {
-            if (parts.size() < 2) {
-                send_line(client_fd, std::string(RESP_ERROR) + "|Invalid DOWNLOAD command");
-                continue;
-            }
-            std::string filename = parts[1];
-            handle_download(client_fd, filename);
+
+        // Requests the client pipelined are already in the buffer
+        bool alive = true;
+        while (alive && has_request(conn)) {
+            alive = serve_next(conn);
         }
-        else if (cmd == CMD_DELETE) {
-            if (parts.size() < 2) {
-                send_line(client_fd, std::string(RESP_ERROR) + "|Invalid DELETE command");
-                continue;
-            }
-            std::string filename = parts[1];
-            handle_delete(client_fd, filename);
+
+        if (alive) {
+            rearm_connection(conn);
+        } else {
+            close_connection(conn);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Accept every pending connection on a reactor's listening socket
+ */
+void accept_clients(Reactor* reactor) {
+    const int opt_on = 1;
+    while (true) {
+        struct sockaddr_in client_addr;
+        socklen_t client_len = sizeof(client_addr);
+
+        int client_fd = accept4(reactor->listen_fd, (struct sockaddr*)&client_addr,
+                                &client_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_fd < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            perror("Accept failed");
+            return;
         }
-        else {
-            send_line(client_fd, std::string(RESP_ERROR) + "|Unknown command");
+
+        struct timeval tv = {CLIENT_IO_TIMEOUT_SEC, 0};
+        setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(client_fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        // Responses are small and latency bound; don't let Nagle hold them
+        setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &opt_on, sizeof(opt_on));
+
+        Connection* conn = open_connection(client_fd, reactor->epoll_fd);
+        active_connections.fetch_add(1, std::memory_order_relaxed);
+        accepted_connections.fetch_add(1, std::memory_order_relaxed);
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET | EPOLLONESHOT;
+        ev.data.ptr = conn;
+        if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, client_fd, &ev) < 0) {
+            perror("epoll_ctl failed");
+            close_connection(conn);
+            continue;
         }
+        LOG(LOG_DEBUG, "Client connected (fd: " << client_fd << ")");
     }
-    
-    close(client_fd);
-    std::cout << "Client disconnected (fd: " << client_fd << ")\n";
-    
-    return NULL;  
 }
 
 /**
- * @brief Main server
+ * @brief Turn a connection away because every worker is backed up
+ * The request is not run; the client is told when to come back and the
+ * connection is closed, so nothing it already sent is left half read.
  */
-int main(int argc, char* argv[]) {
-    int port = (argc > 1) ? atoi(argv[1]) : 8080;
-    
-    // Setup server directory
-    ensure_directory();
-    
-   
-    int server_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_fd < 0) {
+void reject_busy(Connection* conn) {
+    busy_rejections.fetch_add(1, std::memory_order_relaxed);
+    Reply reply{conn->fd, conn->binary, false, 0, false};
+    reply.send(OP_ERROR, std::string(RESP_BUSY) + "|" + std::to_string(BUSY_RETRY_AFTER_MS), 0, MSG_DONTWAIT);
+    close_connection(conn);
+}
+
+/**
+ * @brief Read whatever arrived on an idle connection (non-blocking)
+ * Hands the connection to the worker pool once a full request header is
+ * buffered, re-arms it when more data is needed, closes it on EOF.
+ */
+void on_readable(Connection* conn) {
+    while (!has_request(conn)) {
+        ssize_t n = conn->reader.fill_available();
+        if (n > 0) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            rearm_connection(conn);
+            return;
+        }
+        close_connection(conn); // disconnect, error, or oversized header
+        return;
+    }
+    if (!submit_connection(conn)) reject_busy(conn);
+}
+
+/**
+ * @brief Event loop: accept clients and watch idle connections
+ */
+void* reactor_main(void* arg) {
+    Reactor* reactor = (Reactor*)arg;
+    struct epoll_event events[256];
+
+    while (true) {
+        int n = epoll_wait(reactor->epoll_fd, events, 256, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait failed");
+            break;
+        }
+        for (int i = 0; i < n; ++i) {
+            if (events[i].data.ptr == nullptr) {
+                accept_clients(reactor);
+            } else {
+                on_readable((Connection*)events[i].data.ptr);
+            }
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Create a non-blocking listening socket registered with a new epoll set
+ * @return false on failure (errors are reported)
+ */
+bool setup_reactor(Reactor* reactor, int port, bool reuse_port) {
+    reactor->listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (reactor->listen_fd < 0) {
         perror("Socket creation failed");
-        return 1;
+        return false;
     }
     
-    
     int opt = 1;
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
+    if (setsockopt(reactor->listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0
+        || (reuse_port && setsockopt(reactor->listen_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0)) {
         perror("Setsockopt failed");
-        close(server_fd);
-        return 1;
+        close(reactor->listen_fd);
+        return false;
     }
     
-   
     struct sockaddr_in address;
     memset(&address, 0, sizeof(address));
     address.sin_family = AF_INET;
     address.sin_addr.s_addr = INADDR_ANY;
     address.sin_port = htons(port);
     
-    if (bind(server_fd, (struct sockaddr*)&address, sizeof(address)) < 0) {
+    if (bind(reactor->listen_fd, (struct sockaddr*)&address, sizeof(address)) < 0) {
         perror("Bind failed");
-        close(server_fd);
-        return 1;
+        close(reactor->listen_fd);
+        return false;
     }
     
-   
-    if (listen(server_fd, 10) < 0) {
+    if (listen(reactor->listen_fd, listen_backlog) < 0) {
         perror("Listen failed");
-        close(server_fd);
+        close(reactor->listen_fd);
+        return false;
+    }
+
+    reactor->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (reactor->epoll_fd < 0) {
+        perror("epoll_create1 failed");
+        close(reactor->listen_fd);
+        return false;
+    }
+
+    // Level-triggered; accept_clients() drains the backlog anyway
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = nullptr;
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, reactor->listen_fd, &ev) < 0) {
+        perror("epoll_ctl failed");
+        close(reactor->epoll_fd);
+        close(reactor->listen_fd);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Raise the open file limit so thousands of idle clients fit
+ */
+void raise_fd_limit() {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+}
+
+void usage(const char* prog) {
+    std::cerr << "Usage: " << prog << " [-r reactors] [-w workers] [-q queue] [-b backlog] [-c chunk] [-m cache] [-d] [-z level] [-Z] [-u] [-s sync] [-D size] [-l level] [-M port] [-f dir] [-C nodes] [-n replicas] [port]\n"
+              << "  -r  epoll loops, each with its own SO_REUSEPORT listener (default 1)\n"
+              << "  -w  worker threads serving requests (default 4 per core)\n"
+              << "  -q  requests waiting for a worker before clients get ERROR|busy (default "
+              << DEFAULT_QUEUE_PER_WORKER << " per worker)\n"
+              << "  -b  listen backlog per listener (default " << SOMAXCONN << ")\n"
+              << "  -c  upload chunk size in bytes (default " << BUFFER_SIZE << ")\n"
+              << "  -m  small-file cache size in bytes, 0 disables (default " << DEFAULT_CACHE_BYTES << ")\n"
+              << "  -d  deduplicate: keep one copy of identical content (<dir>/.blobs)\n"
+              << "  -z  zlib level for compressed downloads, -1 refuses compression (default "
+              << DEFAULT_COMPRESS_LEVEL << ")\n"
+              << "  -Z  keep compressed copies of downloaded files (<dir>/.zcache)\n"
+              << "  -u  write uploads through io_uring, several writes in flight (falls back to write())\n"
+              << "  -s  upload durability: none (default), data (fdatasync each upload before\n"
+              << "      answering) or group (one syncfs shared by concurrent uploads)\n"
+              << "  -D  write uploads of at least this many bytes with O_DIRECT, 0 disables (default 0)\n"
+              << "  -l  log level: error, warn, info (default) or debug (every request)\n"
+              << "  -M  serve metrics in Prometheus text format over HTTP on this port\n"
+              << "  -f  storage directory (default " << DEFAULT_FILES_DIR << ")\n"
+              << "  -C  cluster nodes as host:port,host:port,... (this one included), told to\n"
+              << "      clients, which place each file on its nodes by consistent hashing\n"
+              << "  -n  nodes a client uploads each file to (default " << CLUSTER_DEFAULT_REPLICAS
+              << "); servers don't replicate, a\n"
+              << "      copy a node missed is only restored when a client reads the file\n";
+}
+
+/**
+ * @brief Main server
+ */
+int main(int argc, char* argv[]) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int num_reactors = 1;
+    int num_workers = (cores > 0 ? (int)cores : 1) * 4;
+    size_t cache_bytes = DEFAULT_CACHE_BYTES;
+    long queue_limit = 0;
+    int metrics_port = 0;
+    set_storage_root(DEFAULT_FILES_DIR);
+
+    int opt;
+    while ((opt = getopt(argc, argv, "r:w:q:b:c:m:dz:Zus:D:l:M:f:C:n:h")) != -1) {
+        switch (opt) {
+            case 'r': num_reactors = atoi(optarg); break;
+            case 'w': num_workers = atoi(optarg); break;
+            case 'q': queue_limit = atol(optarg); break;
+            case 'b': listen_backlog = atoi(optarg); break;
+            case 'c': upload_chunk_size = strtoul(optarg, nullptr, 10); break;
+            case 'm': cache_bytes = strtoull(optarg, nullptr, 10); break;
+            case 'd': dedup_enabled = true; break;
+            case 'z': compress_level = atoi(optarg); break;
+            case 'Z': zcache_enabled = true; break;
+            case 'u': uring_enabled = true; break;
+            case 's':
+                if (strcmp(optarg, "none") == 0) sync_mode = SYNC_NONE;
+                else if (strcmp(optarg, "data") == 0) sync_mode = SYNC_DATA;
+                else if (strcmp(optarg, "group") == 0) sync_mode = SYNC_GROUP;
+                else {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'D': direct_min_size = strtoull(optarg, nullptr, 10); break;
+            case 'l':
+                if (strcmp(optarg, "error") == 0) server_log.set_level(LOG_ERROR);
+                else if (strcmp(optarg, "warn") == 0) server_log.set_level(LOG_WARN);
+                else if (strcmp(optarg, "info") == 0) server_log.set_level(LOG_INFO);
+                else if (strcmp(optarg, "debug") == 0) server_log.set_level(LOG_DEBUG);
+                else {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'M': metrics_port = atoi(optarg); break;
+            case 'f': set_storage_root(optarg); break;
+            case 'C':
+                for (const std::string& node : split_string(optarg, ',')) {
+                    if (!node.empty()) cluster_nodes.push_back(node);
+                }
+                break;
+            case 'n': cluster_replicas = atoi(optarg); break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (num_reactors < 1 || num_workers < 1 || queue_limit < 0 || listen_backlog < 1
+        || upload_chunk_size == 0 || files_dir.empty() || cluster_replicas < 1
+        || compress_level < -1 || compress_level > 9) {
+        usage(argv[0]);
         return 1;
     }
+    int port = (optind < argc) ? atoi(argv[optind]) : 8080;
+    work_queue.resize(queue_limit > 0 ? (size_t)queue_limit : (size_t)num_workers * DEFAULT_QUEUE_PER_WORKER);
     
-    std::cout << "Cloud storage server listening on port " << port << "\n";
-    std::cout << "Storage directory: " << SERVER_FILES_DIR << "\n";
-    
+    // Setup server directory
+    if (!ensure_directory()) return 1;
+    if (!open_storage_dirs()) {
+        perror("Cannot open storage directory");
+        return 1;
+    }
+    init_file_locks();
+    if (dedup_enabled) load_blob_store();
+    file_cache.set_capacity(cache_bytes);
+    load_file_index();
+    start_file_watcher();
+
+    // A client vanishing mid-send must not take the whole server down
+    signal(SIGPIPE, SIG_IGN);
+    raise_fd_limit();
     
-    while (true) {
-        struct sockaddr_in client_addr;
-        socklen_t client_len = sizeof(client_addr);
-        
-        int client_fd = accept(server_fd, (struct sockaddr*)&client_addr, &client_len);
-        if (client_fd < 0) {
-            perror("Accept failed");
-            continue;
+    std::vector<Reactor> reactors(num_reactors);
+    for (Reactor& reactor : reactors) {
+        if (!setup_reactor(&reactor, port, num_reactors > 1)) {
+            return 1;
         }
-        
-       
-        int* client_fd_ptr = (int*)malloc(sizeof(int));
-        *client_fd_ptr = client_fd;
-        
-      
+    }
+    if (metrics_port > 0 && !start_metrics_server(metrics_port)) return 1;
+
+    for (int i = 0; i < num_workers; ++i) {
         pthread_t thread_id;
-        if (pthread_create(&thread_id, NULL, handle_client, client_fd_ptr) != 0) {
+        if (pthread_create(&thread_id, NULL, worker_main, NULL) != 0) {
             perror("Thread creation failed");
-            free(client_fd_ptr);
-            close(client_fd);
-            continue;
+            return 1;
         }
-        
-        
         pthread_detach(thread_id);
     }
     
-    close(server_fd);
+    std::cout << "Cloud storage server listening on port " << port << "\n";
+    std::cout << "Storage directory: " << files_dir << " (" << STORAGE_FANOUT << " fan-out directories)\n";
+    if (!cluster_nodes.empty()) {
+        std::cout << "Cluster: " << cluster_nodes.size() << " nodes, " << cluster_replicas << " replicas\n";
+    }
+    std::cout << "Reactors: " << num_reactors << ", workers: " << num_workers
+              << ", queue: " << work_queue.size() << "\n";
+    if (metrics_port > 0) std::cout << "Metrics on port " << metrics_port << "\n";
+    // From here on stdout belongs to the log's writer thread
+    std::cout.flush();
+    server_log.start(STDOUT_FILENO);
+#ifndef HAVE_IO_URING
+    if (uring_enabled) std::cerr << "Built without io_uring, using write()\n";
+    uring_enabled = false;
+#endif
+    
+    for (int i = 1; i < num_reactors; ++i) {
+        pthread_t thread_id;
+        if (pthread_create(&thread_id, NULL, reactor_main, &reactors[i]) != 0) {
+            perror("Thread creation failed");
+            return 1;
+        }
+        pthread_detach(thread_id);
+    }
+    reactor_main(&reactors[0]);
     
-    pthread_mutex_lock(&file_locks_mutex);
-    for (auto& pair : file_locks) {
-        pthread_mutex_destroy(&pair.second);
+    for (Reactor& reactor : reactors) {
+        close(reactor.epoll_fd);
+        close(reactor.listen_fd);
     }
-    file_locks.clear();
-    pthread_mutex_unlock(&file_locks_mutex);
-    pthread_mutex_destroy(&file_locks_mutex);
+    
+    destroy_file_locks();
     return 0;
-}
\ No newline at end of file
+}
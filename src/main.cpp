@@ -1,7 +1,93 @@
 #include "shell.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// stdout buffer for scripts, flushed when full instead of per prompt
+#define SCRIPT_OUTPUT_BUFFER (256 * 1024)
+#define SCRIPT_READ_CHUNK (1024 * 1024)
+
+static void usage(const char *prog) {
+    std::cerr << "Usage: " << prog << " [-e] [-c commands | script | -]\n"
+              << "  (none)    interactive shell\n"
+              << "  -c        run commands (lines or ';'-separated) and exit\n"
+              << "  script    run a script file without prompts ('-' reads stdin)\n"
+              << "  -e        stop at the first command that fails\n";
+}
+
+/**
+ * @brief Run a script from an open descriptor
+ * Regular files are mapped; pipes and terminals are read in large chunks.
+ */
+static int run_script_fd(Shell &shell, int fd, bool stop_on_error) {
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            madvise(data, st.st_size, MADV_SEQUENTIAL);
+            int status = shell.run_script((const char *)data, st.st_size, stop_on_error);
+            munmap(data, st.st_size);
+            return status;
+        }
+    }
+    std::vector<char> script;
+    while (true) {
+        size_t used = script.size();
+        script.resize(used + SCRIPT_READ_CHUNK);
+        ssize_t n = read(fd, script.data() + used, SCRIPT_READ_CHUNK);
+        if (n < 0 && errno == EINTR) {
+            script.resize(used);
+            continue;
+        }
+        if (n < 0) {
+            perror("read");
+            return 1;
+        }
+        script.resize(used + n);
+        if (n == 0 && script.size() == used) break;
+    }
+    return shell.run_script(script.data(), script.size(), stop_on_error);
+}
+
+int main(int argc, char *argv[]) {
+    const char *commands = nullptr;
+    bool stop_on_error = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "c:eh")) != -1) {
+        switch (opt) {
+            case 'c': commands = optarg; break;
+            case 'e': stop_on_error = true; break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 2;
+        }
+    }
 
-int main() {
     Shell shell;
-    shell.run();
-    return 0;
-}
\ No newline at end of file
+    if (!commands && optind == argc) {
+        shell.run();
+        return 0;
+    }
+
+    static char output_buffer[SCRIPT_OUTPUT_BUFFER];
+    setvbuf(stdout, output_buffer, _IOFBF, sizeof(output_buffer));
+    if (commands) {
+        return shell.run_script(commands, strlen(commands), stop_on_error);
+    }
+    if (strcmp(argv[optind], "-") == 0) {
+        return run_script_fd(shell, STDIN_FILENO, stop_on_error);
+    }
+    int fd = open(argv[optind], O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        perror(argv[optind]);
+        return 127;
+    }
+    int status = run_script_fd(shell, fd, stop_on_error);
+    close(fd);
+    return status;
+}
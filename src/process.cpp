@@ -1,23 +1,67 @@
 #include "process.h"
+#include <cstdlib>
 #include <cstring>
+#include <new>
 
-Process::Process(bool _pipe_in_flag, bool _pipe_out_flag) {
+Process::Process(bool _pipe_in_flag, bool _pipe_out_flag, Arena *_arena) {
   pipe_in = _pipe_in_flag;
   pipe_out = _pipe_out_flag;
+  background = false;
   tok_index = 0;
   pipe_fd[0] = -1;
   pipe_fd[1] = -1;
+  in_fd = -1;
+  out_fd = -1;
+  redirect_count = 0;
+  arena = _arena;
+  tok_capacity = PROCESS_INLINE_TOKENS;
+  cmdTokens = inline_tokens;
+  cmdTokens[0] = nullptr;
 }
 
 Process::~Process() {
   if (pipe_fd[0] != -1) close(pipe_fd[0]);
   if (pipe_fd[1] != -1) close(pipe_fd[1]);
+  close_redirects();
+  if (cmdTokens != inline_tokens && !arena) free(cmdTokens);
 }
 
 void Process::add_token(char *tok) {
   if (!tok) return;
-  if (tok_index < 25) {
-    cmdTokens[tok_index++] = tok;
+  if (tok_index + 1 == tok_capacity) {
+    // Double the array, keeping room for the terminating nullptr
+    int capacity = tok_capacity * 2;
+    char **grown = arena ? (char **)arena->allocate(capacity * sizeof(char *), alignof(char *))
+                         : (char **)malloc(capacity * sizeof(char *));
+    if (!grown) throw std::bad_alloc();
+    memcpy(grown, cmdTokens, tok_index * sizeof(char *));
+    if (cmdTokens != inline_tokens && !arena) free(cmdTokens);
+    cmdTokens = grown;
+    tok_capacity = capacity;
+  }
+  cmdTokens[tok_index++] = tok;
+  cmdTokens[tok_index] = nullptr;
+}
+
+/**
+ * @return false when the command already has PROCESS_MAX_REDIRECTS
+ */
+bool Process::add_redirect(int fd, RedirectKind kind, const char *target, int source) {
+  if (redirect_count == PROCESS_MAX_REDIRECTS) return false;
+  redirects[redirect_count++] = Redirect{fd, kind, target, source};
+  return true;
+}
+
+/**
+ * @brief Close the descriptors the shell opened for redirections
+ */
+void Process::close_redirects() {
+  for (int i = 0; i < redirect_count; ++i) {
+    Redirect &r = redirects[i];
+    if (r.kind != REDIRECT_DUP && r.source != -1) {
+      close(r.source);
+      r.source = -1;
+    }
   }
 }
 
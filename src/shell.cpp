@@ -3,23 +3,132 @@
 #include <cstdlib>
 #include <cstring>
 #include <sys/wait.h>
+#include <spawn.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <unistd.h>
-
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <poll.h>
+#include <cctype>
+#include <cerrno>
+#include <csignal>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <thread>
 #include <fstream>
 #include <vector>
 #include <string>
 #include "protocol.h"
+#include "compress.h"
+#include "sha256.h"
+
+// Granularity of progress updates for uploads (one sendfile() call each)
+#define TRANSFER_SLICE_SIZE (1024 * 1024)
+// recv()/write() size while downloading
+#define TRANSFER_CHUNK_SIZE (256 * 1024)
+// cget/cput "-": most bytes moved per splice(), and the pipe size asked
+// for when slicing a stream into PARTs
+#define STREAM_SLICE_SIZE (1024 * 1024)
+
+// The background job the current thread is running, if any
+static thread_local TransferJob *current_job = nullptr;
+
+/**
+ * @brief Progress/throughput reporting for cput and cget
+ * Live progress is only drawn on a terminal; the summary is always printed.
+ * Inside a background job both only feed the job's counters instead.
+ */
+struct TransferProgress {
+  TransferProgress(const char *_verb, size_t _total)
+      : verb(_verb), total(_total), last_percent(-1),
+        interactive(isatty(STDOUT_FILENO)),
+        start(std::chrono::steady_clock::now()) {}
+
+  double elapsed() const {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  }
+
+  double rate_mb(size_t bytes) const {
+    double secs = elapsed();
+    return secs > 0 ? bytes / secs / (1024.0 * 1024.0) : 0.0;
+  }
+
+  void update(size_t done) {
+    if (current_job) {
+      current_job->total = total;
+      current_job->done = done;
+      return;
+    }
+    if (!interactive || total == 0) return;
+    int percent = (int)(done * 100 / total);
+    if (percent == last_percent) return;
+    last_percent = percent;
+    std::printf("\r%s: %3d%% %zu/%zu bytes %.1f MB/s", verb, percent, done, total, rate_mb(done));
+    std::fflush(stdout);
+  }
 
-Shell::Shell() : server_fd(-1) {}
+  void finish() const {
+    if (current_job) {
+      current_job->total = total;
+      current_job->done = total;
+      return;
+    }
+    if (interactive && total > 0) std::printf("\n");
+    std::printf("%s: %zu bytes in %.3f s (%.2f MB/s)\n", verb, total, elapsed(), rate_mb(total));
+    std::fflush(stdout);
+  }
+
+  const char *verb;
+  size_t total;
+  int last_percent;
+  bool interactive;
+  std::chrono::steady_clock::time_point start;
+};
+
+// Most tagged requests kept in flight before reading their responses;
+// keeps both socket buffers from filling up and deadlocking
+#define PIPELINE_WINDOW 128
+// Names fetched per LIST request by cls
+#define LIST_PAGE_SIZE 1000
+// Uploads at least this big go through RESUME so a retry can pick up
+// where the last attempt stopped; smaller ones aren't worth the round trip
+#define RESUME_MIN_SIZE (4 * 1024 * 1024)
+// Times a transfer reconnects and resumes after losing the connection
+#define RESUME_ATTEMPTS 3
+// cget/cput -j: files smaller than this aren't worth splitting, and each
+// PART carries at most PART_SLICE_SIZE (what a dropped stream re-sends)
+#define PARALLEL_MIN_SIZE (8 * 1024 * 1024)
+#define PART_SLICE_SIZE (8 * 1024 * 1024)
+#define MAX_STREAMS 64
+// Times a connection turned away with ERROR|busy is retried; each wait
+// is longer than the last, with jitter so a crowd of clients spreads out
+#define BUSY_ATTEMPTS 5
+// parallel: how often children are checked when the kernel has no pidfds
+#define PARALLEL_POLL_MS 10
+
+Shell::Shell() : server_fd(-1), server_port(0), server_pipelined(false), server_binary(false),
+                 server_batch(false), server_dedup(false), server_resume(false),
+                 server_parallel(false), server_deflate(false),
+                 compress_level(0), next_request_id(1), cluster_replicas(1), next_job_id(1),
+                 last_status(0) {}
 
 Shell::~Shell() {
-  for (Process *p : process_list) {
-    delete p;
+  for (auto &job : jobs) {
+    if (job->thread.joinable()) job->thread.join();
+    for (std::thread &stage : job->stages) {
+      if (stage.joinable()) stage.join();
+    }
   }
-  process_list.clear();
+  release_processes();
 
   if (server_fd != -1) {
     close(server_fd);
@@ -48,294 +157,2391 @@ void Shell::close_pipe(int fd) const {
   if (fd != -1) close(fd);
 }
 
-void Shell::cleanup(char *input_line) {
+/**
+ * @brief Destroy the parsed pipeline and hand its memory back to the arena
+ */
+void Shell::release_processes() {
   for (Process *p : process_list) {
-    delete p;
+    p->~Process();
   }
   process_list.clear();
+  line_arena.reset();
+}
+
+void Shell::cleanup(char *input_line) {
+  release_processes();
   free(input_line);
 }
 
 char *Shell::read_input() {
+  // One getline() per line, however long
   char *input = nullptr;
-  char tempbuf[MAX_LINE];
-  size_t inputlen = 0, templen = 0;
+  size_t capacity = 0;
+  if (getline(&input, &capacity, stdin) < 0) {
+    free(input);
+    return nullptr;
+  }
+  return input;
+}
+
+void Shell::sanitize(char *cmd) {
+  size_t len = strlen(cmd);
+  while (len > 0 && (cmd[len - 1] == '\n' || cmd[len - 1] == '\r' ||
+                     cmd[len - 1] == ' '  || cmd[len - 1] == '\t')) {
+    cmd[--len] = '\0';
+  }
+}
+
+bool Shell::isQuit(Process *p) const {
+  return p && p->cmdTokens && p->cmdTokens[0]
+         && std::strcmp(p->cmdTokens[0], "quit") == 0;
+}
+
+bool Shell::isBuiltin(Process *process) const
+{
+  if (!process || !process->cmdTokens || !process->cmdTokens[0]) {
+    return false;
+  }
+  std::string cmd(process->cmdTokens[0]);
+  return (cmd == "cput" || cmd == "cget" || cmd == "crm" || cmd == "cls" || cmd == "ccon" || cmd == "cdisc"
+          || cmd == "jobs" || cmd == "wait" || cmd == "fg" || cmd == "parallel" || cmd == "hash");
+}
+
+
+/**
+ * @brief Whether a builtin talks to the server (cput, cget, crm, cls)
+ */
+static bool needs_server(const Process *process) {
+  const char *cmd = process->cmdTokens[0];
+  return std::strcmp(cmd, "cput") == 0 || std::strcmp(cmd, "cget") == 0
+         || std::strcmp(cmd, "crm") == 0 || std::strcmp(cmd, "cls") == 0;
+}
+
+/**
+ * @param check_connection replace a connection that died while idle
+ * first; pipeline stages have had that done for them
+ */
+void Shell::handleBuiltin(Process *process, bool check_connection) {
+  if (std::strcmp(process->cmdTokens[0], "hash") == 0) {
+    handleHash(process);
+    return;
+  }
+  if (std::strcmp(process->cmdTokens[0], "fg") == 0) {
+    handleFg(process);
+    return;
+  }
+  if (std::strcmp(process->cmdTokens[0], "parallel") == 0) {
+    handleParallel(process);
+    return;
+  }
+
+  char op = process->cmdTokens[0][1];
+  bool server = needs_server(process);
+  if (server && cluster.size() > 0) {
+    handleClusterCommand(process);
+    return;
+  }
+  if (server && check_connection) ensure_connection();
+  last_status = server && server_fd == -1 ? 1 : 0;
+
+  switch (op) {
+    case 'p':  // cput
+      handleCput(process);
+      // Implement file upload logic here
+      break;
+    case 'g':  // cget
+      handleCget(process);
+      break;
+    case 'r':  // crm
+      handleCrm(process);
+      break;
+    case 'l':  // cls
+      handleCls(process);
+      break;
+    case 'c':
+      handleCcon(process);
+      break;
+    case 'o':  // jobs
+      handleJobs(process);
+      break;
+    case 'a':  // wait
+      handleWait(process);
+      break;
+    case 'd':  // cdisc
+      if (server_fd != -1) {
+          close(server_fd);
+          server_fd = -1;
+          server_reader.reset(-1);
+          server_host.clear();
+          stream_pool.clear();
+          idle_sessions.clear();
+          set_cluster({}, 1);
+          std::cout << "Disconnected from server.\n";
+      } else {
+          std::cerr << "Not connected to any server.\n";
+          last_status = 1;
+      }
+      break;
+    default:
+      std::cerr << "Unknown builtin command\n";
+      last_status = 1;
+      break;
+  }
+}
+
+/**
+ * @brief Send size bytes of file_fd from offset to the socket, straight
+ * from the page cache, one progress slice at a time
+ * @param encoder compresses the payload (connections that negotiated
+ * deflate), nullptr sends it raw
+ */
+static bool send_payload(int sock_fd, int file_fd, size_t offset, size_t size, size_t &done,
+                         TransferProgress &progress, ChunkEncoder *encoder) {
+  size_t sent = 0;
+  while (sent < size) {
+    size_t len = std::min((size_t)TRANSFER_SLICE_SIZE, size - sent);
+    bool ok = encoder ? send_packed_file(sock_fd, file_fd, offset + sent, len, *encoder)
+                      : send_file(sock_fd, file_fd, offset + sent, len);
+    if (!ok) return false;
+    sent += len;
+    done += len;
+    progress.update(done);
+  }
+  return true;
+}
+
+/**
+ * @brief Receive size payload bytes into file_fd (-1 discards them)
+ * Each chunk goes to disk as it arrives; the kernel keeps receiving into
+ * the socket buffer while we write.
+ * @param packed the payload is compressed chunks
+ * @return false if the connection failed (or sent corrupt compressed
+ * data, which also shuts it down); local write errors clear write_ok
+ */
+static bool receive_payload(SocketReader &reader, int file_fd, size_t size, size_t &done,
+                            TransferProgress &progress, bool &write_ok, bool packed) {
+  size_t received = 0;
+  write_ok = file_fd >= 0;
+  if (packed) {
+    ChunkDecoder decoder;
+    while (received < size) {
+      if (!decoder.next(reader, size - received)) {
+        if (decoder.is_corrupt()) shutdown(reader.fd, SHUT_RDWR);
+        return false;
+      }
+      ssize_t n = decoder.size();
+      if (write_ok && write(file_fd, decoder.data(), n) != n) write_ok = false;
+      received += n;
+      done += n;
+      progress.update(done);
+    }
+    return true;
+  }
+
+  std::vector<char> chunk(std::min((size_t)TRANSFER_CHUNK_SIZE, std::max(size, (size_t)1)));
+  while (received < size) {
+    ssize_t n = reader.read_some(chunk.data(), std::min(chunk.size(), size - received));
+    if (n <= 0) return false;
+    if (write_ok && write(file_fd, chunk.data(), n) != n) write_ok = false;
+    received += n;
+    done += n;
+    progress.update(done);
+  }
+  return true;
+}
+
+/**
+ * @brief Move up to len bytes from in_fd to out_fd without copying them
+ * through user space: splice() directly when one side is a pipe, through
+ * a pipe of our own otherwise. Where the kernel refuses (a terminal, say)
+ * it is plain read()/write().
+ * @param eof set when in_fd ran out before len bytes
+ * @return bytes moved; fewer than len on EOF or error
+ */
+static size_t splice_bytes(int in_fd, int out_fd, size_t len, bool &eof)
+{
+  eof = false;
+  struct stat in_st, out_st;
+  bool direct = (fstat(in_fd, &in_st) == 0 && S_ISFIFO(in_st.st_mode))
+                || (fstat(out_fd, &out_st) == 0 && S_ISFIFO(out_st.st_mode));
+  int relay[2] = {-1, -1};
+  if (!direct && pipe2(relay, O_CLOEXEC) != 0) relay[0] = relay[1] = -1;
+
+  size_t moved = 0;
+  bool spliced = direct || relay[0] >= 0;
+  while (moved < len && spliced) {
+    size_t want = std::min(len - moved, (size_t)STREAM_SLICE_SIZE);
+    ssize_t n;
+    if (direct) {
+      n = splice(in_fd, nullptr, out_fd, nullptr, want, SPLICE_F_MOVE | SPLICE_F_MORE);
+    } else {
+      n = splice(in_fd, nullptr, relay[1], nullptr, want, SPLICE_F_MOVE | SPLICE_F_MORE);
+      for (ssize_t out = 0; n > 0 && out < n; ) {
+        ssize_t m = splice(relay[0], nullptr, out_fd, nullptr, n - out, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (m < 0 && errno == EINTR) continue;
+        if (m <= 0) {
+          // Bytes stuck in the relay are lost; nothing after them may follow
+          int err = errno;
+          close(relay[0]);
+          close(relay[1]);
+          errno = err;
+          return moved + out;
+        }
+        out += m;
+      }
+    }
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0 && moved == 0 && errno == EINVAL) spliced = false;
+    if (n == 0) eof = true;
+    if (n <= 0) break;
+    moved += n;
+  }
+  if (relay[0] >= 0) {
+    int err = errno;
+    close(relay[0]);
+    close(relay[1]);
+    errno = err;
+  }
+  if (spliced || eof) return moved;
+
+  std::vector<char> chunk(std::min(len, (size_t)TRANSFER_CHUNK_SIZE));
+  while (moved < len) {
+    ssize_t n = read(in_fd, chunk.data(), std::min(chunk.size(), len - moved));
+    if (n < 0 && errno == EINTR) continue;
+    if (n == 0) eof = true;
+    if (n <= 0 || !write_all(out_fd, chunk.data(), n)) break;
+    moved += n;
+  }
+  return moved;
+}
+
+/**
+ * @brief Move what in_fd has ready, up to len bytes, into the pipe out_fd
+ * Only the first bytes are waited for; the rest is topped up without
+ * blocking, so a slow producer is never held to a whole slice. Where
+ * in_fd can't be spliced it is one read()/write().
+ * @param eof set when in_fd reached EOF
+ * @return bytes moved; 0 with eof unset means in_fd failed
+ */
+static size_t splice_ready(int in_fd, int out_fd, size_t len, bool &eof)
+{
+  eof = false;
+  size_t moved = 0;
+  while (moved < len) {
+    unsigned flags = SPLICE_F_MOVE | (moved > 0 ? SPLICE_F_NONBLOCK : 0);
+    ssize_t n = splice(in_fd, nullptr, out_fd, nullptr, len - moved, flags);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0 && moved == 0 && errno == EAGAIN) {
+      // in_fd itself is non-blocking: wait for it here instead
+      struct pollfd pfd = {in_fd, POLLIN, 0};
+      if (poll(&pfd, 1, -1) >= 0 || errno == EINTR) continue;
+    }
+    if (n < 0 && moved == 0 && errno == EINVAL) {
+      std::vector<char> chunk(std::min(len, (size_t)TRANSFER_CHUNK_SIZE));
+      do n = read(in_fd, chunk.data(), chunk.size()); while (n < 0 && errno == EINTR);
+      if (n == 0) eof = true;
+      return n > 0 && write_all(out_fd, chunk.data(), n) ? n : 0;
+    }
+    if (n == 0) eof = true;
+    if (n <= 0) break;
+    moved += n;
+  }
+  return moved;
+}
+
+/**
+ * @brief Collect regular files below dir as (local path, relative path)
+ * Symlinks to files are followed; symlinked directories are skipped, so a
+ * link cycle can't recurse forever or upload a directory twice.
+ */
+static void collect_files(const std::string &dir, const std::string &rel,
+                          std::vector<std::pair<std::string, std::string>> &out) {
+  DIR *d = opendir(dir.c_str());
+  if (!d) {
+    std::cerr << "Error: cannot open directory " << dir << "\n";
+    return;
+  }
+  struct dirent *entry;
+  while ((entry = readdir(d)) != nullptr) {
+    std::string name = entry->d_name;
+    if (name == "." || name == "..") continue;
+    std::string path = dir + "/" + name;
+    struct stat st;
+    if (lstat(path.c_str(), &st) != 0) continue;
+    if (S_ISLNK(st.st_mode) && (stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode))) continue;
+    if (S_ISDIR(st.st_mode)) {
+      collect_files(path, rel + name + "/", out);
+    } else if (S_ISREG(st.st_mode)) {
+      out.emplace_back(path, rel + name);
+    }
+  }
+  closedir(d);
+}
+
+/**
+ * @brief Create the missing parent directories of path
+ */
+static bool make_parent_dirs(const std::string &path) {
+  for (size_t i = path.find('/', 1); i != std::string::npos; i = path.find('/', i + 1)) {
+    std::string dir = path.substr(0, i);
+    if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) return false;
+  }
+  return true;
+}
+
+/**
+ * @brief True if a server supplied name is safe to create below a directory
+ */
+static bool is_safe_relative_path(const std::string &name) {
+  if (name.empty() || name[0] == '/') return false;
+  std::vector<std::string> parts = split_string(name, '/');
+  for (const std::string &part : parts) {
+    if (part == "..") return false;
+  }
+  return true;
+}
 
-  do {
-    char *a = fgets(tempbuf, MAX_LINE, stdin);
-    if (a == nullptr) {
-      return input;
+/**
+ * @brief Compute the content_key() of a local file
+ */
+static bool hash_file(int file_fd, size_t size, std::string &key) {
+  std::string digest;
+  if (!sha256_fd(file_fd, size, digest)) return false;
+  key = content_key(digest, size);
+  return true;
+}
+
+static bool has_glob(const char *pattern) {
+  return std::strpbrk(pattern, "*?[") != nullptr;
+}
+
+/**
+ * @brief Take a leading "-j <streams>" off a cput/cget command line
+ * @param arg set to the index of the first remaining operand
+ * @return the stream count, 1 without -j, 0 if it is invalid
+ */
+static int parse_streams(Process *process, int &arg)
+{
+  arg = 1;
+  if (process->tok_index < 2 || std::strcmp(process->cmdTokens[1], "-j") != 0) return 1;
+  arg = 3;
+  int streams = process->tok_index > 2 ? std::atoi(process->cmdTokens[2]) : 0;
+  return streams >= 1 && streams <= MAX_STREAMS ? streams : 0;
+}
+
+/**
+ * @brief Wait before reconnecting to a server that said it was busy
+ */
+static void busy_backoff(int retry_after_ms, int attempt)
+{
+  thread_local std::minstd_rand jitter(std::random_device{}());
+  int ms = std::max(retry_after_ms, 1) << std::min(attempt, 4);
+  ms += jitter() % (ms / 2 + 1);
+  std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+/**
+ * @brief Fetch [offset, offset + length) of a remote file into file_fd
+ * Streams are plain (text, untagged) connections from the pool. Each
+ * chunk is pwrite()n where it belongs; after a dropped connection the
+ * stream takes another and asks for whatever it still lacks.
+ */
+static bool download_range(ConnectionPool &pool, const std::string &remotefile,
+                           int file_fd, uint64_t offset, uint64_t length, std::atomic<size_t> &done)
+{
+  std::vector<char> chunk(TRANSFER_CHUNK_SIZE);
+  for (int attempt = 0; attempt <= RESUME_ATTEMPTS && length > 0; ++attempt) {
+    int sock = pool.acquire();
+    if (sock < 0) continue;
+    SocketReader reader(sock);
+    std::string out, range = std::to_string(offset) + "|" + std::to_string(length);
+    encode_request(out, false, Request{OP_DOWNLOAD, 0, false, remotefile, 0, range});
+    Response response;
+    if (!send_all(sock, out.data(), out.size()) || !read_response(reader, false, false, response)) {
+      close(sock);
+      continue;
+    }
+    int busy = busy_retry_after(response);
+    if (busy >= 0) {
+      close(sock);
+      busy_backoff(busy, attempt);
+      continue;
+    }
+    if (response.opcode != OP_DATA || response.payload_len != length) {
+      close(sock);
+      return false;  // changed under us; retrying won't help
+    }
+    while (length > 0) {
+      ssize_t n = reader.read_some(chunk.data(), std::min((uint64_t)chunk.size(), length));
+      if (n <= 0) break;
+      if (pwrite(file_fd, chunk.data(), n, offset) != n) {
+        close(sock);
+        return false;
+      }
+      offset += n;
+      length -= n;
+      done += n;
+    }
+    if (length == 0) {
+      pool.release(sock);
+    } else {
+      close(sock);
+    }
+  }
+  return length == 0;
+}
+
+/**
+ * @brief Send [offset, offset + length) of file_fd as PARTs of an upload
+ * All slices go out back to back and the (tiny) acknowledgements are read
+ * afterwards, so the stream never idles waiting on a round trip. After a
+ * dropped connection the unacknowledged slices are sent again.
+ */
+static bool upload_range(ConnectionPool &pool, const std::string &token,
+                         int file_fd, uint64_t offset, uint64_t length, std::atomic<size_t> &done)
+{
+  for (int attempt = 0; attempt <= RESUME_ATTEMPTS && length > 0; ++attempt) {
+    int sock = pool.acquire();
+    if (sock < 0) continue;
+    std::vector<uint64_t> slices;
+    for (uint64_t sent = 0; sent < length; ) {
+      uint64_t len = std::min((uint64_t)PART_SLICE_SIZE, length - sent);
+      std::string out;
+      std::string at = std::to_string(offset + sent);
+      encode_request(out, false, Request{OP_PART, 0, false, token, len, at});
+      if (!send_all(sock, out.data(), out.size(), MSG_MORE)
+          || !send_file(sock, file_fd, offset + sent, len)) {
+        break;
+      }
+      slices.push_back(len);
+      sent += len;
+    }
+
+    SocketReader reader(sock);
+    size_t acked = 0;
+    for (uint64_t len : slices) {
+      Response response;
+      if (!read_response(reader, false, false, response)) break;
+      int busy = busy_retry_after(response);
+      if (busy >= 0) {
+        busy_backoff(busy, attempt);
+        break;
+      }
+      if (response.opcode != OP_OK) {
+        close(sock);
+        return false;
+      }
+      offset += len;
+      length -= len;
+      done += len;
+      ++acked;
+    }
+    if (length == 0 && acked == slices.size()) {
+      pool.release(sock);
+    } else {
+      close(sock);
+    }
+  }
+  return length == 0;
+}
+
+/**
+ * @brief Run fn(offset, length) for streams contiguous ranges of size
+ * bytes on their own threads, showing progress until all finish
+ * @return true if every range succeeded
+ */
+template <typename Fn>
+static bool run_streams(const char *verb, uint64_t size, int streams, std::atomic<size_t> &done, Fn fn)
+{
+  uint64_t step = (size + streams - 1) / streams;
+  std::atomic<int> running(0), failed(0);
+  std::vector<std::thread> threads;
+  for (uint64_t offset = 0; offset < size; offset += step) {
+    uint64_t length = std::min(step, size - offset);
+    ++running;
+    threads.emplace_back([&, offset, length]() {
+      if (!fn(offset, length)) ++failed;
+      --running;
+    });
+  }
+  TransferProgress progress(verb, size);
+  while (running > 0) {
+    progress.update(done);
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  }
+  for (std::thread &t : threads) t.join();
+  if (failed == 0) progress.finish();
+  return failed == 0;
+}
+
+void Shell::handleCput(Process *process) {
+    int arg;
+    int streams = parse_streams(process, arg);
+    if (streams == 0) {
+        std::cerr << "Usage: cput -j <1-" << MAX_STREAMS << "> <local_file> <remote_file>\n";
+        last_status = 1;
+        return;
+    }
+    if (process->tok_index >= 2 && std::strcmp(process->cmdTokens[1], "-r") == 0) {
+        if (process->tok_index < 4) {
+            std::cerr << "Usage: cput -r <local_dir> <remote_prefix>\n";
+            last_status = 1;
+            return;
+        }
+        if (server_fd == -1) {
+            std::cerr << "Error: not connected to server.\n";
+            last_status = 1;
+            return;
+        }
+        putDirectory(process->cmdTokens[2], process->cmdTokens[3]);
+        return;
+    }
+    if (process->tok_index < arg + 2) {
+        std::cerr << "Usage: cput [-j streams] <local_file|-> <remote_file>\n";
+        std::cerr << "       cput -r <local_dir> <remote_prefix>\n";
+        last_status = 1;
+        return;
+    }
+    if (server_fd == -1) {
+        std::cerr << "Error: not connected to server.\n";
+        last_status = 1;
+        return;
+    }
+
+    std::string localfile  = process->cmdTokens[arg];
+    std::string remotefile = process->cmdTokens[arg + 1];
+    if (localfile == "-") {
+        putStream(process->in_fd >= 0 ? process->in_fd : STDIN_FILENO, remotefile);
+        return;
+    }
+
+    int file_fd = open(localfile.c_str(), O_RDONLY | O_CLOEXEC);
+    if (file_fd < 0) {
+        std::cerr << "Error: cannot open file " << localfile << "\n";
+        last_status = 1;
+        return;
+    }
+
+    struct stat st;
+    if (fstat(file_fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        std::cerr << "Error: failed to get file size for " << localfile << "\n";
+        last_status = 1;
+        close(file_fd);
+        return;
+    }
+    size_t filesize = static_cast<size_t>(st.st_size);
+
+    if (claimUpload(file_fd, filesize, remotefile)) {
+        close(file_fd);
+        return;
+    }
+    if (streams > 1 && server_parallel && filesize >= PARALLEL_MIN_SIZE) {
+        putParallel(file_fd, st, localfile, remotefile, streams);
+        close(file_fd);
+        return;
+    }
+    if (server_resume && filesize >= RESUME_MIN_SIZE) {
+        putResumable(file_fd, st, localfile, remotefile);
+        close(file_fd);
+        return;
+    }
+
+    // MSG_MORE: let the header share a segment with the first payload bytes
+    Request req{OP_UPLOAD, next_request_id++, false, remotefile, filesize};
+    if (!send_request(req, filesize > 0 ? MSG_MORE : 0)) {
+        std::cerr << "Error: failed to send UPLOAD header\n";
+        last_status = 1;
+        close(file_fd);
+        return;
+    }
+
+    TransferProgress progress("cput", filesize);
+    size_t done = 0;
+    ChunkEncoder encoder(compress_level);
+    if (!send_payload(server_fd, file_fd, 0, filesize, done, progress,
+                      server_deflate ? &encoder : nullptr)) {
+        std::cerr << "\nError: failed to send file data\n";
+        last_status = 1;
+        close(file_fd);
+        return;
+    }
+    close(file_fd);
+
+    Response response;
+    if (!read_reply(response)) {
+        std::cerr << "\nError: no response from server\n";
+        last_status = 1;
+        return;
+    }
+
+    progress.finish();
+    print_response(response);
+}
+
+/**
+ * @brief Offer a file's content hash so the upload can be skipped
+ * @return true if the server already had the content and stored the name
+ */
+bool Shell::claimUpload(int file_fd, size_t size, const std::string &remotefile)
+{
+  std::string key;
+  if (!server_dedup || !hash_file(file_fd, size, key)) return false;
+  Response response;
+  if (!send_request(Request{OP_CLAIM, next_request_id++, false, remotefile, size, key})
+      || !read_reply(response) || response.opcode != OP_OK) {
+    return false;
+  }
+  print_response(response);
+  return true;
+}
+
+/**
+ * @brief Upload through a partial upload on the server, resuming after a
+ * dropped connection (here, or when the same cput is run again later)
+ * The token is derived from the local file's identity and the remote
+ * name, so only a retry of the same transfer finds the partial data.
+ */
+void Shell::putResumable(int file_fd, const struct stat &st, const std::string &localfile,
+                         const std::string &remotefile)
+{
+  std::string identity = remotefile + '\0' + localfile + '\0' + std::to_string(st.st_dev) + ':'
+                         + std::to_string(st.st_ino) + ':' + std::to_string(st.st_size) + ':'
+                         + std::to_string(st.st_mtime);
+  char token[17];
+  std::snprintf(token, sizeof(token), "%016llx",
+                (unsigned long long)xxh64(identity.data(), identity.size()));
+  size_t filesize = st.st_size;
+
+  TransferProgress progress("cput", filesize);
+  for (int attempt = 0; attempt <= RESUME_ATTEMPTS; ++attempt) {
+    if (attempt > 0 && !reconnect()) break;
+
+    Response response;
+    if (!send_request(Request{OP_RESUME, next_request_id++, false, token, 0})
+        || !read_reply(response)) {
+      continue;
+    }
+    uint64_t offset = response.opcode == OP_OK ? strtoull(response.message.c_str(), nullptr, 10) : 0;
+    if (offset > filesize) offset = 0;  // not ours after all: start over
+    if (offset > 0) std::cout << "cput: resuming at " << offset << " bytes\n";
+
+    std::string range = std::to_string(offset) + "|" + token;
+    Request req{OP_UPLOAD, next_request_id++, false, remotefile, filesize - offset, range};
+    size_t done = offset;
+    ChunkEncoder encoder(compress_level);
+    if (!send_request(req, MSG_MORE)
+        || !send_payload(server_fd, file_fd, offset, filesize - offset, done, progress,
+                         server_deflate ? &encoder : nullptr)
+        || !read_reply(response)) {
+      std::cerr << "\nError: connection lost during upload\n";
+      continue;
+    }
+    if (response.opcode != OP_OK && response.message == "Resume offset mismatch") {
+      continue;  // someone else moved it on; ask again
+    }
+    if (response.opcode == OP_OK) progress.finish();
+    print_response(response);
+    return;
+  }
+  std::cerr << "Error: upload of " << localfile << " incomplete; run cput again to resume\n";
+  last_status = 1;
+}
+
+/**
+ * @brief Upload one file as streams ranges over as many connections,
+ * then COMMIT it on the main connection
+ */
+void Shell::putParallel(int file_fd, const struct stat &st, const std::string &localfile,
+                        const std::string &remotefile, int streams)
+{
+  std::string identity = remotefile + '\0' + localfile + '\0' + std::to_string(st.st_dev) + ':'
+                         + std::to_string(st.st_ino) + ':' + std::to_string(st.st_size) + ':'
+                         + std::to_string(st.st_mtime);
+  char token[19];
+  std::snprintf(token, sizeof(token), "%016llx-p",
+                (unsigned long long)xxh64(identity.data(), identity.size()));
+  uint64_t filesize = st.st_size;
+
+  std::atomic<size_t> done(0);
+  bool ok = run_streams("cput", filesize, streams, done, [&](uint64_t offset, uint64_t length) {
+    return upload_range(stream_pool, token, file_fd, offset, length, done);
+  });
+  if (!ok) {
+    std::cerr << "Error: parallel upload of " << localfile << " failed\n";
+    last_status = 1;
+    return;
+  }
+
+  Response response;
+  if (!send_request(Request{OP_COMMIT, next_request_id++, false, remotefile, filesize, token})
+      || !read_reply(response)) {
+    std::cerr << "Error: no response from server\n";
+    last_status = 1;
+    return;
+  }
+  print_response(response);
+}
+
+/**
+ * @brief Download one file as streams ranges over as many connections
+ * @return false if the file is too small to split (nothing was done)
+ */
+bool Shell::getParallel(const std::string &remotefile, const std::string &localfile, int streams)
+{
+  Response response;
+  if (!send_request(Request{OP_SIZE, next_request_id++, false, remotefile, 0})
+      || !read_reply(response)) {
+    std::cerr << "Error: no response from server\n";
+    last_status = 1;
+    return true;
+  }
+  if (response.opcode != OP_OK) {
+    std::cerr << "Error: server error: " << response.status_line() << "\n";
+    last_status = 1;
+    return true;
+  }
+  uint64_t filesize = strtoull(response.message.c_str(), nullptr, 10);
+  if (filesize < PARALLEL_MIN_SIZE) return false;
+
+  // Ranges land out of order, so a failed run leaves holes: never let the
+  // sequential resume see this file
+  std::string target = localfile + ".jpart";
+  int file_fd = open(target.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (file_fd < 0 || ftruncate(file_fd, filesize) != 0) {
+    std::cerr << "Error: cannot open file " << target << " for writing\n";
+    last_status = 1;
+    if (file_fd >= 0) close(file_fd);
+    return true;
+  }
+
+  std::atomic<size_t> done(0);
+  bool ok = run_streams("cget", filesize, streams, done, [&](uint64_t offset, uint64_t length) {
+    return download_range(stream_pool, remotefile, file_fd, offset, length, done);
+  });
+  if (close(file_fd) != 0) ok = false;
+  if (!ok || rename(target.c_str(), localfile.c_str()) != 0) {
+    unlink(target.c_str());
+    std::cerr << "Error: parallel download of " << remotefile << " failed\n";
+    last_status = 1;
+    return true;
+  }
+  std::cout << "File " << localfile << " downloaded successfully\n";
+  return true;
+}
+
+/**
+ * @brief Copy all of in_fd into an anonymous file, so a stream can be
+ * replayed to each replica or sent once its length is known
+ * The file is unlinked scratch space under $TMPDIR (memory only where
+ * that can't be had), read and written one slice at a time.
+ * @return the file, -1 on failure
+ */
+static int spool_input(int in_fd)
+{
+  const char *tmpdir = std::getenv("TMPDIR");
+  int fd = open(tmpdir && *tmpdir ? tmpdir : "/tmp", O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+  if (fd < 0) fd = memfd_create("cput-spool", MFD_CLOEXEC);
+  if (fd < 0) return -1;
+  std::vector<char> buf(STREAM_SLICE_SIZE);
+  while (true) {
+    ssize_t n = read(in_fd, buf.data(), buf.size());
+    if (n < 0 && errno == EINTR) continue;
+    if (n == 0) return fd;
+    if (n < 0 || !write_all(fd, buf.data(), n)) {
+      close(fd);
+      return -1;
+    }
+  }
+}
+
+/**
+ * @brief cput - : upload whatever in_fd produces until EOF
+ * The length isn't known up front, so the data goes out as PARTs on a
+ * pooled connection: each slice is whatever in_fd has ready, spliced
+ * into a pipe of ours, which says how much there is, and from there into
+ * the socket; COMMIT then names the total. Servers without PART get one ordinary
+ * UPLOAD, sent slice by slice from the input spooled to a scratch file.
+ */
+void Shell::putStream(int in_fd, const std::string &remotefile)
+{
+  TransferProgress progress("cput", 0);
+  if (!server_parallel) {
+    int spool = spool_input(in_fd);
+    struct stat st;
+    if (spool < 0 || fstat(spool, &st) != 0) {
+      std::perror("cput: read");
+      if (spool >= 0) close(spool);
+      last_status = 1;
+      return;
+    }
+    size_t size = st.st_size, done = 0;
+    progress.total = size;
+    ChunkEncoder encoder(compress_level);
+    Response response;
+    bool ok = send_request(Request{OP_UPLOAD, next_request_id++, false, remotefile, size},
+                           size > 0 ? MSG_MORE : 0)
+              && send_payload(server_fd, spool, 0, size, done, progress,
+                              server_deflate ? &encoder : nullptr)
+              && read_reply(response);
+    close(spool);
+    if (!ok) {
+      std::cerr << "Error: failed to upload " << remotefile << "\n";
+      last_status = 1;
+      return;
+    }
+    progress.finish();
+    print_response(response);
+    return;
+  }
+
+  std::string identity = remotefile + '\0' + std::to_string(getpid()) + ':'
+                         + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count());
+  char token[19];
+  std::snprintf(token, sizeof(token), "%016llx-p",
+                (unsigned long long)xxh64(identity.data(), identity.size()));
+
+  int relay[2];
+  if (pipe2(relay, O_CLOEXEC) != 0) {
+    std::perror("cput: pipe");
+    last_status = 1;
+    return;
+  }
+  fcntl(relay[1], F_SETPIPE_SZ, STREAM_SLICE_SIZE);
+  int capacity = fcntl(relay[1], F_GETPIPE_SZ);
+  if (capacity <= 0) capacity = 64 * 1024;
+
+  int sock = stream_pool.acquire();
+  SocketReader reader(sock);
+  auto acked = [&]() {
+    Response response;
+    return read_response(reader, false, false, response) && response.opcode == OP_OK;
+  };
+  bool ok = sock >= 0, eof = false, input_failed = false;
+  uint64_t offset = 0;
+  size_t unacked = 0;
+  while (ok && !eof) {
+    size_t n = splice_ready(in_fd, relay[1], capacity, eof);
+    if (n == 0) {
+      input_failed = !eof;
+      break;
+    }
+    std::string out;
+    encode_request(out, false, Request{OP_PART, 0, false, token, n, std::to_string(offset)});
+    bool unused;
+    ok = send_all(sock, out.data(), out.size(), MSG_MORE) && splice_bytes(relay[0], sock, n, unused) == n;
+    offset += n;
+    progress.update(offset);
+    // Acks are read behind the data, a window's worth at most
+    if (ok && ++unacked >= PIPELINE_WINDOW) {
+      ok = acked();
+      --unacked;
+    }
+  }
+  for (; ok && unacked > 0; --unacked) ok = acked();
+  close(relay[0]);
+  close(relay[1]);
+  if (sock >= 0) {
+    if (ok) {
+      stream_pool.release(sock);
+    } else {
+      close(sock);
+    }
+  }
+  if (!ok || input_failed) {
+    std::cerr << "Error: " << (input_failed ? "reading input for " : "upload of ") << remotefile
+              << " failed\n";
+    last_status = 1;
+    return;
+  }
+
+  Response response;
+  if (!send_request(Request{OP_COMMIT, next_request_id++, false, remotefile, offset, token})
+      || !read_reply(response)) {
+    std::cerr << "Error: no response from server\n";
+    last_status = 1;
+    return;
+  }
+  progress.total = offset;
+  progress.finish();
+  print_response(response);
+}
+
+/**
+ * @brief cget <remote> - : write a remote file to out_fd (the next
+ * stage's pipe, or stdout)
+ * Plain payloads are spliced from the socket. After a dropped connection
+ * a whole-file download asks for the rest by range, so nothing reaches
+ * out_fd twice. Nothing but the data is written to stdout.
+ */
+void Shell::getStream(const std::string &remotefile, const std::string &range, int out_fd)
+{
+  std::cout.flush();
+  uint64_t written = 0;
+  bool lost = false;
+  for (int attempt = 0; attempt <= RESUME_ATTEMPTS; ++attempt) {
+    if (lost && (!range.empty() || (written > 0 && !server_resume) || !reconnect())) break;
+    lost = false;
+
+    std::string want = written > 0 ? std::to_string(written) + "|0" : range;
+    Response response;
+    if (!send_request(Request{OP_DOWNLOAD, next_request_id++, false, remotefile, 0, want})
+        || !read_reply(response)) {
+      lost = true;
+      continue;
+    }
+    if (response.opcode != OP_DATA) {
+      std::cerr << "Error: server error: " << response.status_line() << "\n";
+      last_status = 1;
+      return;
+    }
+
+    uint64_t remaining = response.payload_len;
+    bool out_ok = true;
+    if (server_deflate) {
+      ChunkDecoder decoder;
+      while (remaining > 0 && out_ok) {
+        if (!decoder.next(server_reader, remaining)) {
+          if (decoder.is_corrupt()) shutdown(server_fd, SHUT_RDWR);
+          break;
+        }
+        out_ok = write_all(out_fd, decoder.data(), decoder.size());
+        remaining -= decoder.size();
+        written += decoder.size();
+      }
+    } else {
+      // Whatever arrived with the status line is already buffered
+      std::vector<char> chunk(std::min(server_reader.buffered(), (size_t)remaining));
+      if (!chunk.empty()) {
+        server_reader.read_exact(chunk.data(), chunk.size());
+        out_ok = write_all(out_fd, chunk.data(), chunk.size());
+        remaining -= chunk.size();
+        written += chunk.size();
+      }
+      while (remaining > 0 && out_ok) {
+        bool eof;
+        size_t n = splice_bytes(server_fd, out_fd, remaining, eof);
+        remaining -= n;
+        written += n;
+        if (n == 0 || (remaining > 0 && !eof)) {
+          out_ok = eof || errno != EPIPE;
+          break;
+        }
+      }
+    }
+    if (remaining == 0) return;
+    // A reader that went away (head, grep -q) ends the transfer; the
+    // unread rest makes the next command reconnect
+    if (!out_ok) return;
+    lost = true;
+  }
+  std::cerr << "Error: download of " << remotefile << " incomplete\n";
+  last_status = 1;
+}
+
+void Shell::putDirectory(const std::string &localdir, const std::string &prefix)
+{
+  std::vector<std::pair<std::string, std::string>> files;
+  std::string root = localdir;
+  while (root.size() > 1 && root.back() == '/') root.pop_back();
+  collect_files(root, "", files);
+  if (files.empty()) {
+    std::cerr << "Error: no files under " << localdir << "\n";
+    last_status = 1;
+    return;
+  }
+
+  // Servers without batch support get one UPLOAD per file
+  if (!server_batch) {
+    for (auto &file : files) {
+      Process p(false, false);
+      std::string remote = prefix + file.second;
+      p.add_token((char *)"cput");
+      p.add_token(&file.first[0]);
+      p.add_token(&remote[0]);
+      handleCput(&p);
+    }
+    return;
+  }
+
+  // Pipeline a CLAIM per file first; only content the server lacks is sent
+  if (server_dedup) {
+    std::vector<std::string> remotes(files.size()), keys(files.size());
+    std::vector<Request> claims;
+    std::vector<size_t> offered;
+    for (size_t i = 0; i < files.size(); ++i) {
+      int fd = open(files[i].first.c_str(), O_RDONLY | O_CLOEXEC);
+      struct stat st;
+      if (fd >= 0 && fstat(fd, &st) == 0 && hash_file(fd, st.st_size, keys[i])) {
+        remotes[i] = prefix + files[i].second;
+        claims.push_back(Request{OP_CLAIM, 0, false, remotes[i], (uint64_t)st.st_size, keys[i]});
+        offered.push_back(i);
+      }
+      if (fd >= 0) close(fd);
+    }
+    std::vector<Response> responses = transact(claims);
+    std::vector<bool> stored(files.size(), false);
+    size_t skipped = 0;
+    for (size_t i = 0; i < offered.size(); ++i) {
+      if (responses[i].opcode == OP_OK) {
+        stored[offered[i]] = true;
+        ++skipped;
+      }
+    }
+    std::vector<std::pair<std::string, std::string>> missing;
+    for (size_t i = 0; i < files.size(); ++i) {
+      if (!stored[i]) missing.push_back(files[i]);
+    }
+    files.swap(missing);
+    if (skipped) std::cout << "Already on server: " << skipped << " files\n";
+    if (files.empty()) return;
+  }
+
+  Request req{OP_MUPLOAD, next_request_id++, false, "", files.size()};
+  if (!send_request(req, MSG_MORE)) {
+    std::cerr << "Error: failed to send MUPLOAD header\n";
+    last_status = 1;
+    return;
+  }
+
+  // Entries with an unreadable source are still sent (empty) to keep the
+  // announced count; the server stores them as empty files
+  size_t total = 0;
+  std::vector<std::pair<int, size_t>> sources;
+  for (auto &file : files) {
+    int fd = open(file.first.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    size_t size = (fd >= 0 && fstat(fd, &st) == 0) ? st.st_size : 0;
+    if (fd < 0) {
+      std::cerr << "Error: cannot open file " << file.first << "\n";
+      last_status = 1;
+    }
+    sources.emplace_back(fd, size);
+    total += size;
+  }
+
+  TransferProgress progress("cput", total);
+  size_t done = 0;
+  bool ok = true;
+  ChunkEncoder encoder(compress_level);
+  for (size_t i = 0; i < files.size(); ++i) {
+    std::string header;
+    encode_batch_entry(header, server_binary, prefix + files[i].second, sources[i].second);
+    if (ok) {
+      ok = send_all(server_fd, header.data(), header.size(), MSG_MORE)
+           && send_payload(server_fd, sources[i].first, 0, sources[i].second, done, progress,
+                           server_deflate ? &encoder : nullptr);
+    }
+    if (sources[i].first >= 0) close(sources[i].first);
+  }
+  if (!ok) {
+    std::cerr << "\nError: failed to send file data\n";
+    last_status = 1;
+    return;
+  }
+
+  Response response;
+  if (!read_reply(response)) {
+    std::cerr << "\nError: no response from server\n";
+    last_status = 1;
+    return;
+  }
+  progress.finish();
+  print_response(response);
+}
+
+/**
+ * @brief Split a "host:port" node name
+ */
+static bool parse_node(const std::string &node, std::string &host, int &port)
+{
+  size_t colon = node.rfind(':');
+  if (colon == std::string::npos || colon == 0) return false;
+  host = node.substr(0, colon);
+  port = std::atoi(node.c_str() + colon + 1);
+  return port > 0;
+}
+
+void Shell::handleCcon(Process *process)
+{
+  // -z <level>: ask for compressed payloads, sending ours at that level
+  int arg = 1;
+  int level = 0;
+  if (process->tok_index > 2 && std::strcmp(process->cmdTokens[1], "-z") == 0) {
+    level = std::atoi(process->cmdTokens[2]);
+    arg = 3;
+  }
+  if (process->tok_index < arg + 2 || level < 0 || level > 9) {
+    std::cerr << "Usage: ccon [-z level] <server_ip> <server_port> [host:port ...]\n";
+    last_status = 1;
+    return;
+  }
+  if (server_fd != -1) {
+    std::cerr << "Already connected to a server. Disconnect first.\n";
+    last_status = 1;
+    return;
+  }
+
+  // Further host:port arguments are more seeds, tried in order until one
+  // answers; a seed that belongs to a cluster brings in all of it
+  std::vector<std::pair<std::string, int>> seeds;
+  seeds.emplace_back(process->cmdTokens[arg], std::atoi(process->cmdTokens[arg + 1]));
+  for (int i = arg + 2; i < process->tok_index; ++i) {
+    std::string host;
+    int port;
+    if (!parse_node(process->cmdTokens[i], host, port)) {
+      std::cerr << "ccon: bad seed " << process->cmdTokens[i] << ", expected host:port\n";
+      last_status = 1;
+      return;
+    }
+    seeds.emplace_back(host, port);
+  }
+
+  compress_level = level;
+  for (auto &seed : seeds) {
+    std::vector<std::string> nodes;
+    int replicas = 1;
+    int clustered = query_cluster(seed.first, seed.second, nodes, replicas);
+    if (clustered < 0) {
+      if (seeds.size() > 1) std::cerr << "Seed " << seed.first << ":" << seed.second << " unreachable\n";
+      continue;
+    }
+    if (!connect_server(seed.first, seed.second)) continue;
+    if (clustered > 0) {
+      set_cluster(nodes, replicas);
+      std::cout << "Connected to cluster of " << nodes.size() << " nodes (" << cluster_replicas
+                << " replicas) through " << seed.first << " on port " << seed.second << "\n";
+    } else {
+      std::cout << "Connected to server " << seed.first << " on port " << seed.second << "\n";
+    }
+    return;
+  }
+  if (seeds.size() > 1) std::cerr << "Error: no seed node reachable\n";
+  last_status = 1;
+}
+
+/**
+ * @brief Ask a node for its cluster's membership, on a plain connection
+ * of its own
+ * @return 1 with nodes and replicas filled in, 0 if the node runs alone
+ * (or predates CLUSTER), -1 if it can't be reached
+ */
+int Shell::query_cluster(const std::string &host, int port, std::vector<std::string> &nodes, int &replicas)
+{
+  for (int attempt = 0; ; ++attempt) {
+    ServerAddress address;
+    if (!dns_cache.resolve(host, port, address)) return -1;
+    int fd = connect_address(address);
+    if (fd < 0) return -1;
+    std::string out;
+    encode_request(out, false, Request{OP_CLUSTER, 0, false, "", 0});
+    SocketReader reader(fd);
+    Response response;
+    bool ok = send_all(fd, out.data(), out.size()) && read_response(reader, false, false, response);
+    close(fd);
+    if (!ok) return -1;
+
+    // Busy isn't "not clustered": that would quietly send every name to one node
+    int busy = busy_retry_after(response);
+    if (busy >= 0) {
+      if (attempt == BUSY_ATTEMPTS) return -1;
+      busy_backoff(busy, attempt);
+      continue;
+    }
+    std::vector<std::string> parts = split_string(response.message, '|');
+    if (response.opcode != OP_OK || parts.size() < 2) return 0;
+    replicas = std::max(1, std::atoi(parts[0].c_str()));
+    nodes.assign(parts.begin() + 1, parts.end());
+    return 1;
+  }
+}
+
+/**
+ * @brief Enter cluster mode over nodes (none: leave it)
+ */
+void Shell::set_cluster(const std::vector<std::string> &nodes, int replicas)
+{
+  cluster.reset(nodes);
+  cluster_replicas = std::max(1, std::min(replicas, (int)nodes.size()));
+  cluster_sessions.clear();
+  cluster_sessions.resize(nodes.size());
+}
+
+/**
+ * @brief Open and negotiate a connection; remembered for reconnect()
+ */
+bool Shell::connect_server(const std::string &host, int port)
+{
+  for (int attempt = 0; ; ++attempt) {
+    // A cached address that stopped answering gets one fresh lookup
+    ServerAddress address;
+    for (int fresh = 0; fresh < 2; ++fresh) {
+      if (!dns_cache.resolve(host, port, address)) {
+        std::cerr << "Cannot resolve server " << host << "\n";
+        return false;
+      }
+      server_fd = connect_address(address);
+      if (server_fd >= 0) break;
+      dns_cache.forget(host, port);
+    }
+    if (server_fd < 0) {
+      std::perror("Connection failed");
+      server_fd = -1;
+      return false;
+    }
+    if (host != server_host || port != server_port) stream_pool.reset(address);
+    server_host = host;
+    server_port = port;
+    server_reader.reset(server_fd);
+    int busy = negotiate_features();
+    if (busy < 0) return true;
+
+    close(server_fd);
+    server_fd = -1;
+    server_reader.reset(-1);
+    if (attempt == BUSY_ATTEMPTS) {
+      std::cerr << "Server busy, try again later\n";
+      return false;
+    }
+    busy_backoff(busy, attempt);
+  }
+}
+
+/**
+ * @brief Drop the current connection and open a fresh one to the same server
+ */
+bool Shell::reconnect()
+{
+  if (server_fd != -1) close(server_fd);
+  server_fd = -1;
+  server_reader.reset(-1);
+  if (server_host.empty()) return false;
+  std::cerr << "Reconnecting to " << server_host << ":" << server_port << "\n";
+  return connect_server(server_host, server_port);
+}
+
+/**
+ * @brief Health-check the idle main connection, reconnecting if it died
+ * (server restart, idle timeout) so commands don't fail on a stale socket
+ */
+bool Shell::ensure_connection()
+{
+  if (server_fd == -1) return false;
+  if (connection_idle_ok(server_fd) && server_reader.buffered() == 0) return true;
+  std::cerr << "Connection to server lost\n";
+  return reconnect();
+}
+
+/**
+ * @brief Agree on optional features with a freshly connected server
+ * @return the server's retry delay in ms if it turned us away busy, else -1
+ */
+int Shell::negotiate_features()
+{
+  // Servers without HELLO answer ERROR|Unknown command: stay on plain mode
+  server_pipelined = false;
+  server_binary = false;
+  server_batch = false;
+  server_dedup = false;
+  server_resume = false;
+  server_parallel = false;
+  server_deflate = false;
+  std::string hello = std::string(CMD_HELLO) + "|" + FEATURE_PIPELINE + "|" + FEATURE_BINARY
+                      + "|" + FEATURE_BATCH + "|" + FEATURE_DEDUP + "|" + FEATURE_RESUME
+                      + "|" + FEATURE_PARALLEL;
+  if (compress_level > 0) hello += std::string("|") + FEATURE_DEFLATE;
+  if (!send_line(server_fd, hello)) {
+    return -1;
+  }
+  std::string line = read_line(server_reader);
+  Response response;
+  if (!line.empty() && parse_response_line(line, false, response) && busy_retry_after(response) >= 0) {
+    return busy_retry_after(response);
+  }
+  std::vector<std::string> parts = split_string(line, '|');
+  if (parts.size() < 2 || parts[0] != RESP_OK || parts[1] != CMD_HELLO) {
+    return -1;
+  }
+  for (size_t i = 2; i < parts.size(); ++i) {
+    if (parts[i] == FEATURE_PIPELINE) server_pipelined = true;
+    if (parts[i] == FEATURE_BINARY) server_binary = true;
+    if (parts[i] == FEATURE_BATCH) server_batch = true;
+    if (parts[i] == FEATURE_DEDUP) server_dedup = true;
+    if (parts[i] == FEATURE_RESUME) server_resume = true;
+    if (parts[i] == FEATURE_PARALLEL) server_parallel = true;
+    if (parts[i] == FEATURE_DEFLATE) server_deflate = true;
+  }
+  return -1;
+}
+
+bool Shell::send_request(const Request &req, int flags)
+{
+  std::string out;
+  encode_request(out, server_binary, req);
+  return send_all(server_fd, out.data(), out.size(), flags);
+}
+
+bool Shell::read_reply(Response &resp)
+{
+  return read_response(server_reader, server_binary, server_pipelined, resp);
+}
+
+/**
+ * @brief Print a command's final server response; one that isn't OK
+ * fails the command
+ */
+void Shell::print_response(const Response &resp)
+{
+  std::cout << "Server response: " << resp.status_line() << "\n";
+  if (resp.opcode != OP_OK) last_status = 1;
+}
+
+std::vector<Response> Shell::transact(std::vector<Request> requests)
+{
+  // Send bodyless requests and collect one status response each.
+  // Pipelined/binary servers get a window of tagged requests per round
+  // trip and responses are matched by id; otherwise it is one request per
+  // round trip. Unanswered requests are left with opcode 0.
+  std::vector<Response> responses(requests.size(), Response{0, 0, false, "", 0});
+  if (!server_pipelined && !server_binary) {
+    for (size_t i = 0; i < requests.size(); ++i) {
+      if (!send_request(requests[i]) || !read_reply(responses[i])) break;
+    }
+    return responses;
+  }
+
+  for (size_t start = 0; start < requests.size(); start += PIPELINE_WINDOW) {
+    size_t count = std::min((size_t)PIPELINE_WINDOW, requests.size() - start);
+    if (next_request_id + count > UINT32_MAX) next_request_id = 1;  // frame ids are 32 bit
+    uint64_t base = next_request_id;
+    next_request_id += count;
+
+    std::string batch;
+    for (size_t i = 0; i < count; ++i) {
+      requests[start + i].id = base + i;
+      requests[start + i].tagged = true;
+      encode_request(batch, server_binary, requests[start + i]);
+    }
+    if (!send_all(server_fd, batch.data(), batch.size())) break;
+
+    for (size_t got = 0; got < count; ++got) {
+      Response resp;
+      if (!read_reply(resp)) return responses;
+      if (!resp.tagged || resp.id < base || resp.id >= base + count) {
+        std::cerr << "Error: unexpected response: " << resp.status_line() << "\n";
+        continue;
+      }
+      responses[start + (resp.id - base)] = resp;
+    }
+  }
+  return responses;
+}
+
+/**
+ * @brief Where a background job's session connects: wherever this shell
+ * is connected when the job starts
+ */
+struct SessionTarget {
+  std::string host;
+  int port;
+  int level;
+  std::vector<std::string> nodes;
+  int replicas;
+
+  /**
+   * @brief Connect session (unless it already is), on the job's thread
+   */
+  void attach(Shell &session) const {
+    if (session.server_fd == -1) {
+      session.compress_level = level;
+      session.connect_server(host, port);
+    }
+    if (session.cluster.members() != nodes) session.set_cluster(nodes, replicas);
+  }
+};
+
+/**
+ * @brief A session for a background job: one a finished job left idle,
+ * else a new (unconnected) one
+ */
+std::unique_ptr<Shell> Shell::take_session()
+{
+  if (idle_sessions.empty()) return std::unique_ptr<Shell>(new Shell);
+  std::unique_ptr<Shell> session = std::move(idle_sessions.back());
+  idle_sessions.pop_back();
+  return session;
+}
+
+/**
+ * @brief Run a cput/cget in the background on a session of its own
+ * Sessions (negotiated connections) of finished jobs are reused; each job
+ * otherwise opens one to the server the shell is connected to.
+ */
+void Shell::startTransferJob(Process *process)
+{
+  std::string cmd = process->cmdTokens[0];
+  if (cmd != "cput" && cmd != "cget") {
+    std::cerr << cmd << ": cannot run in the background, running it now\n";
+    handleBuiltin(process);
+    return;
+  }
+  if (server_fd == -1) {
+    std::cerr << "Error: not connected to server.\n";
+    return;
+  }
+
+  std::unique_ptr<TransferJob> job(new TransferJob);
+  job->id = next_job_id++;
+  for (int i = 0; i < process->tok_index; ++i) {
+    job->args.push_back(process->cmdTokens[i]);
+    job->command += (i ? " " : "") + job->args.back();
+  }
+  job->session = take_session();
+  job->start = std::chrono::steady_clock::now();
+
+  TransferJob *raw = job.get();
+  SessionTarget target{server_host, server_port, compress_level, cluster.members(), cluster_replicas};
+  raw->thread = std::thread([raw, target]() {
+    current_job = raw;
+    Shell &session = *raw->session;
+    target.attach(session);
+    if (session.server_fd != -1) {
+      Process p(false, false);
+      for (std::string &arg : raw->args) p.add_token(&arg[0]);
+      session.handleBuiltin(&p);
+    }
+    raw->end = std::chrono::steady_clock::now();
+    raw->finished = true;
+  });
+  std::cout << "[" << raw->id << "] " << raw->command << "\n";
+  jobs.push_back(std::move(job));
+}
+
+/**
+ * @brief Run a background pipeline's builtin stage on a thread of job's,
+ * over a session of its own: the line it came from, and this shell's
+ * connection, move on without it
+ * The stage takes over proc's ends of the neighbouring pipes.
+ */
+void Shell::startJobStage(TransferJob &job, Process *proc)
+{
+  std::vector<std::string> args(proc->cmdTokens, proc->cmdTokens + proc->tok_index);
+  int in_fd = proc->in_fd, out_fd = proc->out_fd;
+  proc->in_fd = proc->out_fd = -1;
+  bool last = !proc->pipe_out;
+  bool server = needs_server(proc);
+
+  job.stage_sessions.push_back(take_session());
+  Shell *session = job.stage_sessions.back().get();
+  TransferJob *raw = &job;
+  SessionTarget target{server_host, server_port, compress_level, cluster.members(), cluster_replicas};
+  ++job.stages_running;
+  job.stages.emplace_back([raw, session, target, args, in_fd, out_fd, last, server]() mutable {
+    current_job = raw;
+    if (server) target.attach(*session);
+    Process p(false, false);
+    for (std::string &arg : args) p.add_token(&arg[0]);
+    p.in_fd = in_fd;
+    p.out_fd = out_fd;
+    session->handleBuiltin(&p, false);
+    session->close_pipe(in_fd);
+    session->close_pipe(out_fd);
+    if (last) raw->stage_status = session->last_status.load();
+    --raw->stages_running;
+  });
+}
+
+/**
+ * @brief Keep a background pipeline's children, and the builtin stages
+ * already running on job (if any), as a job
+ */
+void Shell::startPipelineJob(std::vector<pid_t> &pids, const std::string &command,
+                             std::unique_ptr<TransferJob> job)
+{
+  if (pids.empty() && !job) return;
+  if (!job) job.reset(new TransferJob);
+  job->id = next_job_id++;
+  job->command = command;
+  job->pids.swap(pids);
+  job->start = std::chrono::steady_clock::now();
+  if (job->pids.empty()) {
+    std::cout << "[" << job->id << "] " << job->command << "\n";
+  } else {
+    std::cout << "[" << job->id << "] " << job->pids.back() << "\n";
+  }
+  jobs.push_back(std::move(job));
+}
+
+/**
+ * @brief Reap a pipeline job's children that have exited; it is finished
+ * once they and its builtin stages are done
+ * @param block wait for all of them
+ */
+static void reap_pipeline(TransferJob &job, bool block)
+{
+  for (size_t i = 0; i < job.pids.size(); ) {
+    int st;
+    pid_t r = waitpid(job.pids[i], &st, block ? 0 : WNOHANG);
+    if (r == 0 || (r < 0 && errno == EINTR)) {
+      ++i;
+      continue;
+    }
+    if (r > 0 && i + 1 == job.pids.size()) {
+      job.status = WIFEXITED(st) ? WEXITSTATUS(st) : 128 + WTERMSIG(st);
+    }
+    job.pids.erase(job.pids.begin() + i);
+  }
+  if (block) {
+    for (std::thread &stage : job.stages) {
+      if (stage.joinable()) stage.join();
+    }
+  }
+  if (job.pids.empty() && job.stages_running == 0 && !job.finished) {
+    if (job.stage_status >= 0) job.status = job.stage_status;
+    job.end = std::chrono::steady_clock::now();
+    job.finished = true;
+  }
+}
+
+/**
+ * @brief Collect finished jobs: report them and keep their sessions
+ */
+void Shell::reapJobs()
+{
+  for (size_t i = 0; i < jobs.size(); ) {
+    TransferJob &job = *jobs[i];
+    if (!job.session) reap_pipeline(job, false);
+    if (!job.finished) {
+      ++i;
+      continue;
+    }
+    if (job.thread.joinable()) job.thread.join();
+    if (!job.session) {
+      for (std::thread &stage : job.stages) {
+        if (stage.joinable()) stage.join();
+      }
+      for (std::unique_ptr<Shell> &session : job.stage_sessions) {
+        if (session->server_fd != -1 && session->server_host == server_host
+            && session->server_port == server_port && idle_sessions.size() < POOL_MAX_IDLE) {
+          idle_sessions.push_back(std::move(session));
+        }
+      }
+      if (job.status == 0) {
+        std::printf("[%d] Done     %s\n", job.id, job.command.c_str());
+      } else {
+        std::printf("[%d] Exit %-3d %s\n", job.id, job.status, job.command.c_str());
+      }
+      jobs.erase(jobs.begin() + i);
+      continue;
+    }
+    double secs = std::chrono::duration<double>(job.end - job.start).count();
+    std::printf("[%d] Done     %s (%zu bytes, %.2f MB/s)\n", job.id, job.command.c_str(),
+                job.done.load(), secs > 0 ? job.done / secs / (1024.0 * 1024.0) : 0.0);
+    if (job.session->server_fd != -1 && job.session->server_host == server_host
+        && job.session->server_port == server_port && idle_sessions.size() < POOL_MAX_IDLE) {
+      idle_sessions.push_back(std::move(job.session));
+    }
+    jobs.erase(jobs.begin() + i);
+  }
+  std::fflush(stdout);
+}
+
+/**
+ * @brief jobs: list background jobs still running
+ */
+void Shell::handleJobs(Process *)
+{
+  reapJobs();
+  for (auto &job : jobs) {
+    if (!job->session) {
+      std::printf("[%d] Running  %s &\n", job->id, job->command.c_str());
+      continue;
+    }
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - job->start).count();
+    size_t done = job->done, total = job->total;
+    std::printf("[%d] Running  %s  %zu/%zu bytes %.1f MB/s\n", job->id, job->command.c_str(),
+                done, total, secs > 0 ? done / secs / (1024.0 * 1024.0) : 0.0);
+  }
+  std::fflush(stdout);
+}
+
+/**
+ * @brief wait [id...]: block until the given (default: all) jobs finish
+ * With ids the status is the last named pipeline's, as in sh.
+ */
+void Shell::handleWait(Process *process)
+{
+  last_status = 0;
+  for (auto &job : jobs) {
+    bool wanted = process->tok_index < 2;
+    for (int i = 1; i < process->tok_index && !wanted; ++i) {
+      wanted = std::atoi(process->cmdTokens[i]) == job->id;
+    }
+    if (!wanted) continue;
+    if (job->thread.joinable()) job->thread.join();
+    if (!job->session) {
+      reap_pipeline(*job, true);
+      if (process->tok_index > 1) last_status = job->status;
+    }
+  }
+  reapJobs();
+}
+
+/**
+ * @brief fg [id]: wait in the foreground for a job (default: the newest)
+ * There is no terminal job control here, so this is wait with the
+ * command shown and its status taken.
+ */
+void Shell::handleFg(Process *process)
+{
+  reapJobs();
+  TransferJob *job = nullptr;
+  if (process->tok_index < 2) {
+    if (!jobs.empty()) job = jobs.back().get();
+  } else {
+    int id = std::atoi(process->cmdTokens[1][0] == '%' ? process->cmdTokens[1] + 1 : process->cmdTokens[1]);
+    for (auto &j : jobs) {
+      if (j->id == id) job = j.get();
+    }
+  }
+  if (!job) {
+    std::cerr << "fg: no such job\n";
+    last_status = 1;
+    return;
+  }
+  std::cout << job->command << std::endl;
+  if (job->session) {
+    // A transfer's report (and its session) go the usual way
+    if (job->thread.joinable()) job->thread.join();
+    last_status = job->session->last_status.load();
+    reapJobs();
+    return;
+  }
+  // Finished in the foreground: nothing to report at the next prompt
+  reap_pipeline(*job, true);
+  last_status = job->status;
+  for (size_t i = 0; i < jobs.size(); ++i) {
+    if (jobs[i].get() == job) jobs.erase(jobs.begin() + i);
+  }
+}
+
+/**
+ * @brief A descriptor that becomes readable when pid exits, or -1 where
+ * the kernel has no pidfds (before 5.3)
+ */
+static int open_pidfd(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+  return (int)syscall(SYS_pidfd_open, pid, 0);
+#else
+  return -1;
+#endif
+}
+
+/**
+ * @brief parallel [-j N] command [args...] ::: item...: run command once
+ * per item, N at a time (default: one per core)
+ * Each item replaces a "{}" argument, or is appended when there is none.
+ * The shell sleeps in poll() on the children's pidfds and starts the
+ * next item as soon as one exits. The status is the number of failed
+ * runs, at most 101, as with GNU parallel.
+ */
+void Shell::handleParallel(Process *process)
+{
+  int width = (int)std::max(1u, std::thread::hardware_concurrency());
+  int arg = 1;
+  if (arg + 1 < process->tok_index && std::strcmp(process->cmdTokens[arg], "-j") == 0) {
+    width = std::max(1, std::atoi(process->cmdTokens[arg + 1]));
+    arg += 2;
+  }
+  int sep = arg;
+  while (sep < process->tok_index && std::strcmp(process->cmdTokens[sep], ":::") != 0) ++sep;
+  if (sep == arg || sep == process->tok_index) {
+    std::cerr << "Usage: parallel [-j N] <command> [args...] ::: <item> [item...]\n";
+    last_status = 2;
+    return;
+  }
+
+  bool placeholder = false;
+  for (int i = arg; i < sep; ++i) placeholder |= std::strcmp(process->cmdTokens[i], "{}") == 0;
+  int devnull = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+  std::vector<pid_t> running;
+  std::vector<struct pollfd> exits;
+  int failures = 0;
+  std::cout.flush();
+  for (int next = sep + 1; next < process->tok_index || !running.empty(); ) {
+    while ((int)running.size() < width && next < process->tok_index) {
+      Process child(false, false);
+      for (int i = arg; i < sep; ++i) {
+        bool item = std::strcmp(process->cmdTokens[i], "{}") == 0;
+        child.add_token(item ? process->cmdTokens[next] : process->cmdTokens[i]);
+      }
+      if (!placeholder) child.add_token(process->cmdTokens[next]);
+      if (devnull != -1) child.add_redirect(STDIN_FILENO, REDIRECT_DUP, nullptr, devnull);
+      ++next;
+      pid_t pid = spawn_process(&child, -1);
+      if (pid < 0) {
+        ++failures;
+        continue;
+      }
+      running.push_back(pid);
+      exits.push_back(pollfd{open_pidfd(pid), POLLIN, 0});
+    }
+    if (running.empty()) continue;
+
+    bool pidfds = true;
+    for (auto &e : exits) pidfds &= e.fd != -1;
+    int n = poll(exits.data(), exits.size(), pidfds ? -1 : PARALLEL_POLL_MS);
+    if (n < 0 && errno != EINTR) {
+      std::perror("parallel: poll");
+      break;
+    }
+    for (size_t i = 0; i < running.size(); ) {
+      int st;
+      if (waitpid(running[i], &st, WNOHANG) != running[i]) {
+        ++i;
+        continue;
+      }
+      if (!WIFEXITED(st) || WEXITSTATUS(st) != 0) ++failures;
+      if (exits[i].fd != -1) close(exits[i].fd);
+      running.erase(running.begin() + i);
+      exits.erase(exits.begin() + i);
+    }
+  }
+  // Only reached early on a poll failure: don't leave zombies behind
+  for (pid_t pid : running) {
+    int st;
+    if (waitpid(pid, &st, 0) == pid && (!WIFEXITED(st) || WEXITSTATUS(st) != 0)) ++failures;
+  }
+  for (auto &e : exits) {
+    if (e.fd != -1) close(e.fd);
+  }
+  if (devnull != -1) close(devnull);
+  last_status = std::min(failures, 101);
+}
+
+void Shell::handleCrm(Process *process)
+{
+  if (process->tok_index < 2) {
+    std::cerr << "Usage: crm <remote_file> [remote_file...]\n";
+    last_status = 1;
+    return;
+  }
+
+  if (server_fd == -1) {
+    std::cerr << "Error: not connected to server.\n";
+    last_status = 1;
+    return;
+  }
+
+  if (server_batch && process->tok_index > 2) {
+    // One MDELETE with an entry per name, one response for all of them
+    std::string batch;
+    encode_request(batch, server_binary,
+                   Request{OP_MDELETE, next_request_id++, false, "", (uint64_t)process->tok_index - 1});
+    for (int i = 1; i < process->tok_index; ++i) {
+      encode_batch_entry(batch, server_binary, process->cmdTokens[i], 0);
+    }
+    Response response;
+    if (!send_all(server_fd, batch.data(), batch.size()) || !read_reply(response)) {
+      std::cerr << "Error: no response from server\n";
+      last_status = 1;
+      return;
+    }
+    print_response(response);
+    return;
+  }
+
+  std::vector<Request> requests;
+  for (int i = 1; i < process->tok_index; ++i) {
+    requests.push_back(Request{OP_DELETE, 0, false, process->cmdTokens[i], 0});
+  }
+  std::vector<Response> responses = transact(requests);
+  for (size_t i = 0; i < responses.size(); ++i) {
+    if (responses[i].opcode == 0) {
+      std::cerr << "Error: no response from server\n";
+      last_status = 1;
+      return;
+    }
+    if (responses.size() > 1) std::cout << process->cmdTokens[i + 1] << ": ";
+    print_response(responses[i]);
+  }
+}
+
+/**
+ * @brief The version named in a .part's .ver file, empty if there is none
+ */
+static std::string read_version(const std::string &path)
+{
+  std::ifstream in(path);
+  std::string version;
+  std::getline(in, version);
+  return version;
+}
+
+/**
+ * @brief Record version in a .part's .ver file; an empty version removes it
+ * @return false if no version is recorded
+ */
+static bool write_version(const std::string &path, const std::string &version)
+{
+  if (version.empty()) {
+    unlink(path.c_str());
+    return false;
+  }
+  std::ofstream out(path, std::ios::trunc);
+  out << version << "\n";
+  out.close();
+  if (out) return true;
+  unlink(path.c_str());
+  return false;
+}
+
+/**
+ * @brief What SIZE says of remotefile: its size and, from servers that
+ * report one, the version after it (it changes whenever the file is
+ * replaced). version is left empty by servers that report only the size.
+ * @return false if the server had no answer or no such file
+ */
+bool Shell::remote_version(const std::string &remotefile, std::string &version)
+{
+  Response response;
+  if (!send_request(Request{OP_SIZE, next_request_id++, false, remotefile, 0})
+      || !read_reply(response) || response.opcode != OP_OK) {
+    return false;
+  }
+  version = response.message.find('|') != std::string::npos ? response.message : "";
+  return true;
+}
+
+void Shell::handleCget(Process *process)
+{
+  int arg;
+  int streams = parse_streams(process, arg);
+  if (streams == 0 || process->tok_index < arg + 2) {
+    std::cerr << "Usage: cget [-j streams] <remote_file> <local_file|-> [offset [length]]\n";
+    std::cerr << "       cget '<glob>' <local_dir>\n";
+    last_status = 1;
+      return;
+  }
+  if (server_fd == -1) {
+    std::cerr << "Error: not connected to server.\n";
+    last_status = 1;
+    return;
+  }
+  if (has_glob(process->cmdTokens[arg])) {
+    getMatching(process->cmdTokens[arg], process->cmdTokens[arg + 1]);
+    return;
+  }
+  std::string remotefile  = process->cmdTokens[arg];
+  std::string localfile = process->cmdTokens[arg + 1];
+
+  // An explicit byte range goes straight into the local file
+  std::string range;
+  if (process->tok_index > arg + 2) {
+    if (!server_resume) {
+      std::cerr << "Error: server does not support ranged downloads\n";
+      last_status = 1;
+      return;
+    }
+    range = std::string(process->cmdTokens[arg + 2]) + "|"
+            + (process->tok_index > arg + 3 ? process->cmdTokens[arg + 3] : "0");
+  }
+  if (localfile == "-") {
+    getStream(remotefile, range, process->out_fd >= 0 ? process->out_fd : STDOUT_FILENO);
+    return;
+  }
+  if (!range.empty()) {
+    // ranged: straight into the local file
+  } else if (streams > 1 && server_resume && getParallel(remotefile, localfile, streams)) {
+    return;
+  }
+
+  // Whole files are fetched into <local>.part and renamed when complete.
+  // <local>.part.ver names the remote version (SIZE's answer) the .part
+  // holds the start of; a .part left by an interrupted cget is resumed
+  // from its end only while the server still has that version
+  struct stat st;
+  bool staged = range.empty() && server_resume
+                && (stat(localfile.c_str(), &st) != 0 || S_ISREG(st.st_mode));
+  std::string target = staged ? localfile + ".part" : localfile;
+  std::string version_file = target + ".ver";
+  std::string version;
+  bool resumable = false, resumed = false;
+  if (staged) {
+    if (!remote_version(remotefile, version)) version.clear();
+    resumable = !version.empty() && read_version(version_file) == version;
+    if (!resumable && !write_version(version_file, version)) version.clear();
+  }
+
+  bool lost = false;
+  for (int attempt = 0; attempt <= RESUME_ATTEMPTS; ++attempt) {
+    if (lost && !reconnect()) break;
+    lost = false;
+
+    size_t offset = 0;
+    if (staged && resumable && stat(target.c_str(), &st) == 0) offset = st.st_size;
+    if (staged) range = offset > 0 ? std::to_string(offset) + "|0" : "";
+    if (offset > 0) {
+      std::cout << "cget: resuming at " << offset << " bytes\n";
+      resumed = true;
+    }
+    if (!send_request(Request{OP_DOWNLOAD, next_request_id++, false, remotefile, 0, range})) {
+      std::cerr << "Error: failed to send DOWNLOAD request\n";
+      lost = true;
+      continue;
+    }
+    Response response;
+    if (!read_reply(response)) {
+      std::cerr << "Error: no response from server\n";
+      lost = true;
+      continue;
+    }
+    if (response.opcode != OP_DATA && offset > 0) {
+      // Remote file shrank (or changed) since: fetch it again from scratch
+      unlink(target.c_str());
+      --attempt;
+      continue;
+    }
+    if (response.opcode != OP_DATA) {
+      std::cerr << "Error: server error: " << response.status_line() << "\n";
+      last_status = 1;
+      return;
+    }
+    size_t filesize = offset + response.payload_len;
+
+    // Still consume the payload if the local file can't be written so the
+    // connection stays usable for the next command
+    int flags = O_WRONLY | O_CREAT | O_CLOEXEC | (offset > 0 ? O_APPEND : O_TRUNC);
+    int file_fd = open(target.c_str(), flags, 0644);
+    if (file_fd < 0) {
+      std::cerr << "Error: cannot open file " << target << " for writing\n";
+      last_status = 1;
+    }
+    if (offset == 0) resumable = !version.empty();  // the .part now holds version
+
+    TransferProgress progress("cget", filesize);
+    size_t done = offset;
+    bool write_ok;
+    if (!receive_payload(server_reader, file_fd, response.payload_len, done, progress, write_ok,
+                         server_deflate)) {
+      std::cerr << "\nError: failed to receive file data\n";
+      if (file_fd >= 0) close(file_fd);
+      lost = true;  // downloads are idempotent: go again (from the .part's end)
+      continue;
+    }
+
+    if (file_fd < 0) return;
+    if (close(file_fd) != 0 || !write_ok) {
+      std::cerr << "Error: failed to write " << localfile << "\n";
+      last_status = 1;
+      return;
+    }
+    // Pieces from more than one DOWNLOAD only make the file if it wasn't
+    // replaced in between
+    std::string now;
+    if (resumed && (!remote_version(remotefile, now) || now != version)) {
+      std::cerr << "cget: " << remotefile << " changed during the download, starting over\n";
+      unlink(target.c_str());
+      resumable = resumed = false;
+      version = write_version(version_file, now) ? now : "";
+      continue;
+    }
+    if (staged && rename(target.c_str(), localfile.c_str()) != 0) {
+      std::cerr << "Error: failed to write " << localfile << "\n";
+      last_status = 1;
+      return;
+    }
+    if (staged) unlink(version_file.c_str());
+    progress.finish();
+    std::cout << "File " << localfile << " downloaded successfully\n";
+    return;
+  }
+  std::cerr << "Error: download of " << remotefile << " incomplete; run cget again to resume\n";
+  last_status = 1;
+}
+
+void Shell::getMatching(const std::string &pattern, const std::string &localdir)
+{
+  if (!server_batch) {
+    std::cerr << "Error: server does not support batch downloads\n";
+    last_status = 1;
+    return;
+  }
+  if (!send_request(Request{OP_MDOWNLOAD, next_request_id++, false, pattern, 0})) {
+    std::cerr << "Error: failed to send MDOWNLOAD request\n";
+    last_status = 1;
+    return;
+  }
+
+  // Total size isn't known up front; progress shows bytes so far
+  TransferProgress progress("cget", 0);
+  size_t done = 0;
+  while (true) {
+    bool is_entry;
+    std::string name;
+    uint64_t size;
+    Response response;
+    if (!read_batch_item(server_reader, server_binary, server_pipelined,
+                         is_entry, name, size, response)) {
+      std::cerr << "\nError: failed to receive batch\n";
+      last_status = 1;
+      return;
+    }
+    if (!is_entry) {
+      progress.total = done;
+      progress.finish();
+      print_response(response);
+      return;
+    }
+
+    int file_fd = -1;
+    std::string localfile = localdir + "/" + name;
+    if (!is_safe_relative_path(name)) {
+      std::cerr << "Error: refusing unsafe name " << name << "\n";
+      last_status = 1;
+    } else if (!make_parent_dirs(localfile)
+               || (file_fd = open(localfile.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0) {
+      std::cerr << "Error: cannot open file " << localfile << " for writing\n";
+      last_status = 1;
+    }
+    bool write_ok;
+    bool alive = receive_payload(server_reader, file_fd, size, done, progress, write_ok, server_deflate);
+    if (file_fd >= 0 && (close(file_fd) != 0 || !write_ok)) {
+      std::cerr << "Error: failed to write " << localfile << "\n";
+      last_status = 1;
+    }
+    if (!alive) {
+      std::cerr << "\nError: failed to receive file data\n";
+      last_status = 1;
+      return;
     }
-    templen = strlen(tempbuf);
-    input = (char *)realloc(input, inputlen + templen + 1);
-    strcpy(input + inputlen, tempbuf);
-    inputlen += templen;
-  } while (templen == MAX_LINE - 1 && tempbuf[MAX_LINE - 2] != '\n');
-
-  return input;
+  }
 }
 
-void Shell::sanitize(char *cmd) {
-  size_t len = strlen(cmd);
-  while (len > 0 && (cmd[len - 1] == '\n' || cmd[len - 1] == '\r' ||
-                     cmd[len - 1] == ' '  || cmd[len - 1] == '\t')) {
-    cmd[--len] = '\0';
+void Shell::handleCls(Process *process)
+{
+  if (server_fd == -1) {
+      std::cerr << "Error: cannot ls file direcotory if not coonected to a server\n";
+      last_status = 1;
+      return;
   }
+  // cls [prefix]: fetched a page at a time so huge listings start printing early
+  listFiles(process->tok_index > 1 ? process->cmdTokens[1] : "", nullptr);
 }
 
-bool Shell::isQuit(Process *p) const {
-  return p && p->cmdTokens && p->cmdTokens[0]
-         && std::strcmp(p->cmdTokens[0], "quit") == 0;
+/**
+ * @brief Every name under prefix, a LIST page at a time
+ * @param names collects them; nullptr prints them as they arrive
+ * @return false (having said why) if the listing is incomplete
+ */
+bool Shell::listFiles(const std::string &prefix, std::vector<std::string> *names)
+{
+  std::string after;
+  bool header = false;
+  int attempts = 0;
+  while (true) {
+    // A lost connection is replaced and the listing picks up after the
+    // last name printed
+    Request request{OP_LIST, next_request_id++, false, prefix, LIST_PAGE_SIZE, after};
+    Response response;
+    if (!send_request(request) || !read_reply(response)) {
+        if (attempts++ < RESUME_ATTEMPTS && reconnect()) continue;
+        std::cerr << "Error: no response from server\n";
+        last_status = 1;
+        return false;
+    }
+    if (!header && !names) std::cout << "Response: " << response.status_line() << "\n";
+    if (response.opcode != OP_OK) {
+        std::cerr << "Error: server error: " << response.status_line() << "\n";
+        last_status = 1;
+        return false;
+    }
+    std::vector<std::string> page;
+    bool complete = read_file_list(server_reader, server_binary, response, page);
+    if (!header && !names) std::cout << "Files on server:\n";
+    header = true;
+    for (const std::string &name : page) {
+      if (names) {
+        names->push_back(name);
+      } else {
+        std::cout << " - " << name << "\n";
+      }
+    }
+    if (!page.empty()) after = page.back();
+    if (!complete) {
+      if (attempts++ < RESUME_ATTEMPTS && reconnect()) continue;
+      std::cerr << "Error: file list truncated\n";
+      last_status = 1;
+      return false;
+    }
+    if (!list_has_more(response) || page.empty()) return true;
+  }
 }
 
-bool Shell::isBuiltin(Process *process) const
+/**
+ * @brief The session for cluster node index, connected on first use and
+ * replaced if its connection died
+ * @return nullptr (having said so) if the node can't be reached
+ */
+Shell *Shell::node_session(size_t index)
 {
-  if (!process || !process->cmdTokens || !process->cmdTokens[0]) {
-    return false;
+  std::unique_ptr<Shell> &session = cluster_sessions[index];
+  if (!session) {
+    session.reset(new Shell);
+    session->compress_level = compress_level;
   }
-  std::string cmd(process->cmdTokens[0]);
-  return (cmd == "cput" || cmd == "cget" || cmd == "crm" || cmd == "cls" || cmd == "ccon" || cmd == "cdisc");
+  std::string host;
+  int port;
+  if (session->server_fd != -1 ? session->ensure_connection()
+      : parse_node(cluster.node(index), host, port) && session->connect_server(host, port)) {
+    return session.get();
+  }
+  std::cerr << "Node " << cluster.node(index) << " unreachable\n";
+  return nullptr;
 }
 
+/**
+ * @brief Whether the connected server stores remotefile
+ */
+bool Shell::has_file(const std::string &remotefile)
+{
+  return transact({Request{OP_SIZE, 0, false, remotefile, 0}})[0].opcode == OP_OK;
+}
 
-void Shell::handleBuiltin(Process *process) {
-  
+/**
+ * @brief Run cput, cget, crm or cls against the cluster
+ * Uploads and deletes go to every node owning the name, downloads to the
+ * first of them that has it (copying it to owners found without it),
+ * listings to all nodes. Each node gets the
+ * command over its own session, with every feature that node negotiated.
+ * last_status is 1 when a node the command needed was unreachable or
+ * failed the command.
+ */
+void Shell::handleClusterCommand(Process *process)
+{
+  last_status = 0;
   switch (process->cmdTokens[0][1]) {
     case 'p':  // cput
-      handleCput(process);
-      // Implement file upload logic here
+      clusterPut(process);
       break;
     case 'g':  // cget
-      handleCget(process);
+      clusterGet(process);
       break;
     case 'r':  // crm
-      handleCrm(process);
-      break;
-    case 'l':  // cls
-      handleCls(process);
-      break;
-    case 'c':
-      handleCcon(process);
-      break;
-    case 'd':  // cdisc
-      if (server_fd != -1) {
-          close(server_fd);
-          server_fd = -1;
-          std::cout << "Disconnected from server.\n";
-      } else {
-          std::cerr << "Not connected to any server.\n";
-      }
+      clusterRemove(process);
       break;
-    default:
-      std::cerr << "Unknown builtin command\n";
+    case 'l': {  // cls
+      std::vector<std::string> names;
+      bool complete = clusterNames(process->tok_index > 1 ? process->cmdTokens[1] : "", names);
+      std::cout << "Files in cluster (" << cluster.size() << " nodes):\n";
+      for (const std::string &name : names) std::cout << " - " << name << "\n";
+      if (!complete) std::cerr << "Warning: listing is missing unreachable nodes\n";
       break;
-  }
-}
-
-void Shell::handleCput(Process *process) {
-    if (process->tok_index < 3) {
-        std::cerr << "Usage: cput <local_file> <remote_file>\n";
-        return;
-    }
-    if (server_fd == -1) {
-        std::cerr << "Error: not connected to server.\n";
-        return;
-    }
-
-    std::string localfile  = process->cmdTokens[1];
-    std::string remotefile = process->cmdTokens[2];
-
-    std::ifstream file(localfile, std::ios::binary | std::ios::ate);
-    if (!file.is_open()) {
-        std::cerr << "Error: cannot open file " << localfile << "\n";
-        return;
-    }
-    
-    std::streampos pos = file.tellg();
-    if (pos < 0) {
-        std::cerr << "Error: failed to get file size for " << localfile << "\n";
-        file.close();
-        return;
-    }
-    size_t filesize = static_cast<size_t>(pos);
-    file.seekg(0, std::ios::beg);
-    
-
-    std::vector<char> buffer(filesize);
-    if (filesize > 0) {
-        if (!file.read(buffer.data(), filesize)) {
-            std::cerr << "Error: cannot read file " << localfile << "\n";
-            file.close();
-            return;
-        }
-    }
-    file.close();
-
-    std::string header = std::string(CMD_UPLOAD) + "|" +
-                         remotefile + "|" +
-                         std::to_string(filesize);
-
-    if (!send_line(server_fd, header)) {
-        std::cerr << "Error: failed to send UPLOAD header\n";
-        return;
-    }
-
-    if (filesize > 0 && !send_all(server_fd, buffer.data(), filesize)) {
-        std::cerr << "Error: failed to send file data\n";
-        return;
-    }
-
-    std::string response = read_line(server_fd);
-    if (response.empty()) {
-        std::cerr << "Error: no response from server\n";
-        return;
     }
-
-    std::cout << "Server response: " << response << "\n";
+  }
 }
 
-void Shell::handleCcon(Process *process)
+void Shell::clusterPut(Process *process)
 {
-  if (process->tok_index < 3) {
-    std::cerr << "Usage: ccon <server_ip> <server_port>\n";
+  int arg;
+  int streams = parse_streams(process, arg);
+  bool recursive = process->tok_index >= 4 && std::strcmp(process->cmdTokens[1], "-r") == 0;
+  if (!recursive && (streams == 0 || process->tok_index < arg + 2)) {
+    handleCput(process);  // prints the usage
+    last_status = 1;
     return;
   }
-  if (server_fd != -1) {
-    std::cerr << "Already connected to a server. Disconnect first.\n";
+
+  // cput -r: each file goes to its own nodes
+  if (recursive) {
+    std::vector<std::pair<std::string, std::string>> files;
+    std::string root = process->cmdTokens[2];
+    while (root.size() > 1 && root.back() == '/') root.pop_back();
+    collect_files(root, "", files);
+    int status = 0;
+    for (auto &file : files) {
+      Process p(false, false);
+      std::string remote = process->cmdTokens[3] + file.second;
+      p.add_token((char *)"cput");
+      p.add_token(&file.first[0]);
+      p.add_token(&remote[0]);
+      clusterPut(&p);
+      status = std::max(status, last_status.load());
+    }
+    if (files.empty()) std::cerr << "Error: no files under " << process->cmdTokens[2] << "\n";
+    last_status = files.empty() ? 1 : status;
     return;
   }
 
-  std::string server_ip = process->cmdTokens[1];
-  int server_port = std::atoi(process->cmdTokens[2]);
-  server_fd = socket(AF_INET, SOCK_STREAM, 0);
-  if (server_fd < 0) {
-    std::perror("Socket creation failed");
-    server_fd = -1;
+  std::string localfile = process->cmdTokens[arg];
+  std::string remotefile = process->cmdTokens[arg + 1];
+  std::vector<size_t> owners = cluster.owners(remotefile, cluster_replicas);
+  int in_fd = process->in_fd >= 0 ? process->in_fd : STDIN_FILENO;
+  int spool = -1;
+  if (localfile == "-" && owners.size() > 1 && (spool = spool_input(in_fd)) < 0) {
+    std::cerr << "Error: cannot buffer input for " << owners.size() << " replicas\n";
+    last_status = 1;
     return;
   }
-  struct sockaddr_in server_addr;
-  std::memset(&server_addr, 0, sizeof(server_addr));
-  server_addr.sin_family = AF_INET;
-  server_addr.sin_port = htons(server_port);
-  if (inet_pton(AF_INET, server_ip.c_str(), &server_addr.sin_addr) <= 0) {
-    std::cerr << "Invalid server IP address\n";
-    close(server_fd);
-    server_fd = -1;
-    return;
+
+  size_t reached = 0;
+  for (size_t index : owners) {
+    Shell *session = node_session(index);
+    if (!session) continue;
+    ++reached;
+    std::cout << "[" << cluster.node(index) << "] ";
+    session->last_status = 0;
+    if (localfile != "-") {
+      session->handleCput(process);
+    } else if (spool < 0) {
+      session->putStream(in_fd, remotefile);
+    } else if (lseek(spool, 0, SEEK_SET) == 0) {
+      session->putStream(spool, remotefile);
+    } else {
+      session->last_status = 1;
+    }
+    if (session->last_status != 0) last_status = 1;
   }
-  if (connect(server_fd, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-    std::perror("Connection failed");
-    close(server_fd);
-    server_fd = -1;
-    return;
+  if (spool >= 0) close(spool);
+  if (reached < owners.size()) {
+    std::cerr << "Warning: " << remotefile << " stored on " << reached << " of " << owners.size()
+              << " nodes\n";
+    last_status = 1;
   }
-  std::cout << "Connected to server " << server_ip << " on port " << server_port << "\n";
 }
 
-void Shell::handleCrm(Process *process)
+void Shell::clusterGet(Process *process)
 {
-  if (process->tok_index < 2) {
-    std::cerr << "Usage: crm <remote_file>\n";
+  int arg;
+  int streams = parse_streams(process, arg);
+  if (streams == 0 || process->tok_index < arg + 2) {
+    handleCget(process);  // prints the usage
+    last_status = 1;
     return;
   }
 
-  if (server_fd == -1) {
-    std::cerr << "Error: not connected to server.\n";
+  // cget '<glob>' dir: match against the whole cluster's listing
+  std::string remotefile = process->cmdTokens[arg];
+  if (has_glob(remotefile.c_str())) {
+    std::string localdir = process->cmdTokens[arg + 1];
+    std::vector<std::string> names;
+    bool complete = clusterNames(remotefile.substr(0, remotefile.find_first_of("*?[\\")), names);
+    int status = complete ? 0 : 1;
+    for (std::string &name : names) {
+      if (fnmatch(remotefile.c_str(), name.c_str(), 0) != 0) continue;
+      std::string localfile = localdir + "/" + name;
+      if (!is_safe_relative_path(name) || !make_parent_dirs(localfile)) {
+        std::cerr << "Error: cannot create " << localfile << "\n";
+        status = 1;
+        continue;
+      }
+      Process p(false, false);
+      p.add_token((char *)"cget");
+      p.add_token(&name[0]);
+      p.add_token(&localfile[0]);
+      clusterGet(&p);
+      status = std::max(status, last_status.load());
+    }
+    last_status = status;
     return;
   }
 
-  std::string remotefile = process->cmdTokens[1];
-  std::string request = std::string(CMD_DELETE) + "|" + remotefile;
-  if (!send_line(server_fd, request)) {
-    std::cerr << "Error: failed to send DELETE request\n";
-    return;
-  }
-  std::string response = read_line(server_fd);
-  if (response.empty()) {
-    std::cerr << "Error: no response from server\n";
+  // A replica that was down when the file was written won't have it, so
+  // ask before fetching and fall through to the next owner
+  std::vector<size_t> owners = cluster.owners(remotefile, cluster_replicas);
+  for (size_t i = 0; i < owners.size(); ++i) {
+    Shell *session = node_session(owners[i]);
+    if (!session || !session->has_file(remotefile)) continue;
+    session->last_status = 0;
+    session->handleCget(process);
+    last_status = session->last_status.load();
+
+    // Read repair: a whole file fetched into a local file is copied back
+    // to the (reachable) owners without one
+    std::string localfile = process->cmdTokens[arg + 1];
+    if (last_status != 0 || process->tok_index != arg + 2 || localfile == "-") return;
+    std::vector<size_t> lacking;
+    for (size_t j = 0; j < owners.size(); ++j) {
+      Shell *other = j == i ? nullptr : node_session(owners[j]);
+      if (other && !other->has_file(remotefile)) lacking.push_back(owners[j]);
+    }
+    repairReplicas(remotefile, localfile, lacking);
     return;
   }
-  std::cout << "Server response: " << response << "\n";
+  std::cerr << "Error: " << remotefile << " not found on any of its nodes\n";
+  last_status = 1;
 }
 
-void Shell::handleCget(Process *process)
+/**
+ * @brief Upload localfile, a current copy of remotefile, to the owners in
+ * lacking, which answered without it
+ * Only replicas that missed a write are fixed this way, and only when the
+ * file is read: nothing moves files when the cluster's membership changes.
+ */
+void Shell::repairReplicas(const std::string &remotefile, const std::string &localfile,
+                           const std::vector<size_t> &lacking)
 {
-  if (process->tok_index < 3) {
-    std::cerr << "Usage: cget <remote_file> <local_file>\n";
-      return;
-  }
-  if (server_fd == -1) {
-    std::cerr << "Error: not connected to server.\n";
-    return;
-  }
-  std::string remotefile  = process->cmdTokens[1];
-  std::string localfile = process->cmdTokens[2];
-  std::string request = std::string(CMD_DOWNLOAD) + "|" + remotefile;
-  if (!send_line(server_fd, request)) {
-    std::cerr << "Error: failed to send DOWNLOAD request\n";
-    return;
-  }
-  std::string response = read_line(server_fd);
-  if (response.empty()) {
-    std::cerr << "Error: no response from server\n";
-    return;
+  for (size_t index : lacking) {
+    Shell *session = node_session(index);
+    if (!session) continue;
+    Process p(false, false);
+    std::string local = localfile, remote = remotefile;
+    p.add_token((char *)"cput");
+    p.add_token(&local[0]);
+    p.add_token(&remote[0]);
+    std::cout << "[" << cluster.node(index) << "] repairing " << remotefile << ": ";
+    session->last_status = 0;
+    session->handleCput(&p);
   }
-  std::vector<std::string> parts = split_string(response, '|');
-  if (parts.size() < 2 || parts[0] != RESP_OK) {
-    std::cerr << "Error: server error: " << response << "\n";
+}
+
+void Shell::clusterRemove(Process *process)
+{
+  if (process->tok_index < 2) {
+    handleCrm(process);  // prints the usage
+    last_status = 1;
     return;
   }
-  size_t filesize = std::stoull(parts[2]);
-  std::vector<char> filedata(filesize);
-  size_t total_received = 0;
-  while (total_received < filesize) {
-    ssize_t n = recv(server_fd, filedata.data() + total_received, filesize - total_received, 0);
-    if (n <= 0) {
-      std::cerr << "Error: failed to receive file data\n";
-      return;
+  // One crm per node, naming everything it holds a copy of
+  std::vector<std::vector<std::string>> by_node(cluster.size());
+  for (int i = 1; i < process->tok_index; ++i) {
+    for (size_t index : cluster.owners(process->cmdTokens[i], cluster_replicas)) {
+      by_node[index].push_back(process->cmdTokens[i]);
     }
-    total_received += n;
   }
-
-  std::ofstream file(localfile, std::ios::binary);
-  if (!file.is_open()) {
-    std::cerr << "Error: cannot open file " << localfile << " for writing\n";
-    return; 
+  for (size_t index = 0; index < by_node.size(); ++index) {
+    if (by_node[index].empty()) continue;
+    Shell *session = node_session(index);
+    if (!session) {
+      last_status = 1;
+      continue;
+    }
+    Process p(false, false);
+    p.add_token((char *)"crm");
+    for (std::string &name : by_node[index]) p.add_token(&name[0]);
+    std::cout << "[" << cluster.node(index) << "] ";
+    session->last_status = 0;
+    session->handleCrm(&p);
+    if (session->last_status != 0) last_status = 1;
   }
-  file.write(filedata.data(), filesize);
-  file.close();
-  std::cout << "File " << localfile << " downloaded successfully\n";
-
 }
 
-void Shell::handleCls(Process *process)
+/**
+ * @brief The sorted union of every node's names under prefix
+ * @return false if some node couldn't be listed
+ */
+bool Shell::clusterNames(const std::string &prefix, std::vector<std::string> &names)
 {
-  if (server_fd == -1) {
-      std::cerr << "Error: cannot ls file direcotory if not coonected to a server\n";
-      return;
-  }
-  std::string request = std::string(CMD_LIST);
-  if (!send_line(server_fd, request)) {
-      std::cerr << "Error: failed to send LIST request\n";
-      return;
-  }
-  std::string response = read_line(server_fd);
-  std::cout << "Response: " << response << "\n";
-  if (response.empty()) {
-      std::cerr << "Error: no response from server\n";
-      return;
-  }
-  std::vector<std::string> parts = split_string(response, '|');
-  if (parts.size() < 2 || parts[0] != RESP_OK) {
-      std::cerr << "Error: server error: " << response << "\n";
-      return;
-  }
-  std::cout << "Files on server:\n";
-  std::string file_entry = read_line(server_fd);
-  while (!file_entry.empty()) {
-    std::cout << " - " << file_entry << "\n";
-    file_entry = read_line(server_fd); 
+  bool complete = true;
+  for (size_t index = 0; index < cluster.size(); ++index) {
+    Shell *session = node_session(index);
+    if (!session || !session->listFiles(prefix, &names)) complete = false;
   }
+  std::sort(names.begin(), names.end());
+  names.erase(std::unique(names.begin(), names.end()), names.end());
+  if (!complete) last_status = 1;
+  return complete;
 }
 
 bool Shell::isCd(Process *process) const
@@ -345,29 +2551,43 @@ bool Shell::isCd(Process *process) const
 }
 
 void Shell::parse_input(char *cmd) {
-  Process *currProcess = new Process(false, false);
+  // Processes and their argv live in line_arena until cleanup(); a
+  // Process abandoned for having no tokens simply stays there unused
+  auto new_process = [&]() { return line_arena.make<Process>(false, false, &line_arena); };
+  Process *currProcess = new_process();
   char *tok_start = nullptr;
+  size_t pipeline_start = 0;  // process_list index of the current pipeline's first stage
+  // A redirection operator waiting for its target word
+  bool pending = false;
+  int pending_fd = -1;
+  RedirectKind pending_kind = REDIRECT_IN;
+  const char *error = nullptr;
 
   auto flush_cmd = [&](size_t i) {
     if (tok_start) {
       cmd[i] = '\0';
-      currProcess->add_token(tok_start);
+      if (!pending) {
+        currProcess->add_token(tok_start);
+      } else if (!currProcess->add_redirect(pending_fd, pending_kind, tok_start)) {
+        error = "too many redirections";
+      }
+      pending = false;
       tok_start = nullptr;
     }
   };
 
   auto flush_process = [&](bool allocate_next) {
+    if (pending) error = "redirection without a target";
     if (currProcess->tok_index > 0) {
-      currProcess->cmdTokens[currProcess->tok_index] = nullptr;
       process_list.push_back(currProcess);
-    } else {
-      delete currProcess;
+    } else if (currProcess->redirect_count > 0) {
+      error = "redirection without a command";
     }
-    currProcess = allocate_next ? new Process(false, false) : nullptr;
+    currProcess = allocate_next ? new_process() : nullptr;
   };
 
   const size_t n = std::strlen(cmd);
-  for (size_t i = 0; i < n; ++i) {
+  for (size_t i = 0; i < n && !error; ++i) {
     char c = cmd[i];
     switch (c) {
       case ' ':
@@ -388,15 +2608,58 @@ void Shell::parse_input(char *cmd) {
         break;
       }
 
+      case '&':
       case ';': {
         bool had_tokens = (currProcess->tok_index > 0) || (tok_start != nullptr);
         flush_cmd(i);
         if (had_tokens) {
+          currProcess->background = c == '&';
           flush_process(true);
+          // '&' sends the whole pipeline to the background
+          for (size_t k = pipeline_start; k < process_list.size(); ++k) {
+            process_list[k]->background = c == '&';
+          }
+        } else {
+          currProcess = new_process();
+        }
+        pipeline_start = process_list.size();
+        break;
+      }
+
+      case '<':
+      case '>': {
+        // Digits right against the operator name the descriptor: 2>file
+        int fd = c == '<' ? STDIN_FILENO : STDOUT_FILENO;
+        bool numbered = tok_start != nullptr;
+        for (char *p = tok_start; numbered && p < &cmd[i]; ++p) numbered = std::isdigit((unsigned char)*p);
+        if (numbered) {
+          fd = std::atoi(tok_start);
+          tok_start = nullptr;
         } else {
-          delete currProcess;
-          currProcess = new Process(false, false);
+          flush_cmd(i);
+        }
+        if (pending) {
+          error = "redirection without a target";
+          break;
+        }
+
+        RedirectKind kind = c == '<' ? REDIRECT_IN : REDIRECT_OUT;
+        if (c == '<' && cmd[i + 1] == '<' && cmd[i + 2] == '<') {
+          kind = REDIRECT_HERE;
+          i += 2;
+        } else if (c == '>' && cmd[i + 1] == '>') {
+          kind = REDIRECT_APPEND;
+          ++i;
+        } else if (c == '>' && cmd[i + 1] == '&' && std::isdigit((unsigned char)cmd[i + 2])) {
+          int source = 0;
+          for (i += 2; i < n && std::isdigit((unsigned char)cmd[i]); ++i) source = source * 10 + (cmd[i] - '0');
+          --i;
+          if (!currProcess->add_redirect(fd, REDIRECT_DUP, nullptr, source)) error = "too many redirections";
+          break;
         }
+        pending = true;
+        pending_fd = fd;
+        pending_kind = kind;
         break;
       }
 
@@ -406,19 +2669,23 @@ void Shell::parse_input(char *cmd) {
     }
   }
 
-  if (tok_start) {
-    currProcess->add_token(tok_start);
-    tok_start = nullptr;
+  if (!error) {
+    flush_cmd(n);
+    flush_process(false);
+  }
+  if (error) {
+    std::cerr << "syntax error: " << error << "\n";
+    last_status = 2;
+    release_processes();
+    return;
   }
-  flush_process(false);
 
   if (!process_list.empty()) {
     Process* last = process_list.back();
     if (last->pipe_in && last->tok_index == 0) {
-      delete last;
       process_list.pop_back();
     }
-    if (last && last->pipe_out) {
+    if (last->pipe_out) {
       last->pipe_out = false;
     }
   }
@@ -437,9 +2704,211 @@ void Shell::handle_cd(Process *proc)
     path = const_cast<char*>(home);
   }
 
+  last_status = 0;
   if (chdir(path) != 0) {
     std::perror("cd");
+    last_status = 1;
+  }
+}
+
+/**
+ * @brief Full path of a command, from the hash table when possible
+ * Names containing a '/' are used as they are. The table is dropped
+ * whenever $PATH changes; "hash -r" drops it by hand.
+ * @return "" if no $PATH directory has it
+ */
+std::string Shell::resolve_command(const std::string &name)
+{
+  if (name.find('/') != std::string::npos) return name;
+  const char *env = std::getenv("PATH");
+  std::string search = env ? env : "/bin:/usr/bin";
+  if (search != hashed_path) {
+    command_hash.clear();
+    hashed_path = search;
+  }
+  auto it = command_hash.find(name);
+  if (it != command_hash.end()) return it->second;
+
+  for (size_t start = 0; start <= search.size(); ) {
+    size_t end = search.find(':', start);
+    if (end == std::string::npos) end = search.size();
+    std::string dir = end > start ? search.substr(start, end - start) : ".";
+    std::string path = dir + "/" + name;
+    struct stat st;
+    if (stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode) && access(path.c_str(), X_OK) == 0) {
+      command_hash[name] = path;
+      return path;
+    }
+    start = end + 1;
+  }
+  return "";
+}
+
+/**
+ * @brief Open what proc's redirections name, in the parent
+ * Files are opened here rather than by the spawn so a bad name is
+ * reported as such; a here-string goes into a memfd, so the command
+ * reads it like a file with nothing on disk and no writer to wait for.
+ * @return false (with a message) if something could not be opened
+ */
+bool Shell::open_redirects(Process *proc)
+{
+  for (int i = 0; i < proc->redirect_count; ++i) {
+    Redirect &r = proc->redirects[i];
+    switch (r.kind) {
+      case REDIRECT_IN:
+        r.source = open(r.target, O_RDONLY | O_CLOEXEC);
+        break;
+      case REDIRECT_OUT:
+        r.source = open(r.target, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+        break;
+      case REDIRECT_APPEND:
+        r.source = open(r.target, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0666);
+        break;
+      case REDIRECT_HERE: {
+        r.source = memfd_create("here-string", MFD_CLOEXEC);
+        std::string text = std::string(r.target) + "\n";
+        if (r.source != -1 && (!write_all(r.source, text.data(), text.size())
+                               || lseek(r.source, 0, SEEK_SET) != 0)) {
+          close(r.source);
+          r.source = -1;
+        }
+        break;
+      }
+      case REDIRECT_DUP:
+        continue;
+    }
+    if (r.source == -1) {
+      std::cerr << (r.kind == REDIRECT_HERE ? "here-string" : r.target) << ": "
+                << std::strerror(errno) << "\n";
+      proc->close_redirects();
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * @brief Hand a builtin the files its stdin/stdout were redirected to
+ * Builtins read and write only through in_fd/out_fd (cput -, cget -), so
+ * other descriptors and duplications don't apply to them.
+ */
+static void take_redirects(Process *proc)
+{
+  for (int i = 0; i < proc->redirect_count; ++i) {
+    Redirect &r = proc->redirects[i];
+    if (r.kind == REDIRECT_DUP || (r.fd != STDIN_FILENO && r.fd != STDOUT_FILENO)) continue;
+    int &end = r.fd == STDIN_FILENO ? proc->in_fd : proc->out_fd;
+    if (end != -1) close(end);
+    end = r.source;
+    r.source = -1;
+  }
+}
+
+/**
+ * @brief Start one pipeline stage with posix_spawn()
+ * glibc implements it with clone(CLONE_VM | CLONE_VFORK), so a launch
+ * costs the same however much memory the shell has mapped; the pipe
+ * plumbing becomes file actions. A hashed path that has disappeared is
+ * looked up again once.
+ * @param stdin_fd read end of the previous stage's pipe, or -1
+ * @return the child's pid, -1 if it could not be started (reported)
+ */
+pid_t Shell::spawn_process(Process *proc, int stdin_fd)
+{
+  const char *cmd = proc->cmdTokens[0];
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  if (proc->pipe_out) {
+    posix_spawn_file_actions_adddup2(&actions, proc->pipe_fd[1], STDOUT_FILENO);
+    posix_spawn_file_actions_addclose(&actions, proc->pipe_fd[0]);
+    posix_spawn_file_actions_addclose(&actions, proc->pipe_fd[1]);
+  }
+  if (proc->pipe_in && stdin_fd != -1) {
+    posix_spawn_file_actions_adddup2(&actions, stdin_fd, STDIN_FILENO);
+    posix_spawn_file_actions_addclose(&actions, stdin_fd);
+  }
+  // After the pipes, so a redirection wins over them as in sh
+  for (int i = 0; i < proc->redirect_count; ++i) {
+    posix_spawn_file_actions_adddup2(&actions, proc->redirects[i].source, proc->redirects[i].fd);
   }
+  // The shell ignores SIGPIPE; its children must not inherit that
+  posix_spawnattr_t attr;
+  posix_spawnattr_init(&attr);
+  sigset_t defaults;
+  sigemptyset(&defaults);
+  sigaddset(&defaults, SIGPIPE);
+  posix_spawnattr_setsigdefault(&attr, &defaults);
+  posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF);
+
+  pid_t pid = -1;
+  int err = ENOENT;
+  for (int fresh = 0; fresh < 2 && err == ENOENT; ++fresh) {
+    if (fresh) command_hash.erase(cmd);
+    std::string path = resolve_command(cmd);
+    if (path.empty()) break;
+    err = posix_spawn(&pid, path.c_str(), &actions, &attr, proc->cmdTokens, environ);
+    if (std::strchr(cmd, '/')) break;
+  }
+  posix_spawnattr_destroy(&attr);
+  posix_spawn_file_actions_destroy(&actions);
+
+  if (err == 0) return pid;
+  if (err == ENOENT && !std::strchr(cmd, '/')) {
+    std::cerr << cmd << ": command not found\n";
+  } else {
+    std::cerr << cmd << ": " << std::strerror(err) << "\n";
+  }
+  return -1;
+}
+
+/**
+ * @brief hash: list the remembered command paths; "hash -r" forgets
+ * them, "hash name..." looks names up now
+ */
+void Shell::handleHash(Process *process)
+{
+  last_status = 0;
+  if (process->tok_index == 1) {
+    std::vector<std::pair<std::string, std::string>> entries(command_hash.begin(), command_hash.end());
+    std::sort(entries.begin(), entries.end());
+    for (auto &entry : entries) std::cout << entry.first << "\t" << entry.second << "\n";
+    return;
+  }
+  if (process->tok_index == 2 && std::strcmp(process->cmdTokens[1], "-r") == 0) {
+    command_hash.clear();
+    return;
+  }
+  for (int i = 1; i < process->tok_index; ++i) {
+    if (resolve_command(process->cmdTokens[i]).empty()) {
+      std::cerr << "hash: " << process->cmdTokens[i] << ": not found\n";
+      last_status = 1;
+    }
+  }
+}
+
+/**
+ * @brief Reap a pipeline's children; its exit status is the last one's
+ */
+void Shell::wait_children(std::vector<pid_t> &pids)
+{
+  for (pid_t cpid : pids) {
+    int st;
+    if (waitpid(cpid, &st, 0) == cpid && cpid == pids.back()) {
+      last_status = WIFEXITED(st) ? WEXITSTATUS(st) : 128 + WTERMSIG(st);
+    }
+  }
+  pids.clear();
+}
+
+/**
+ * @brief Wait for a pipeline: builtin stages first, then the children
+ */
+void Shell::finish_pipeline(std::vector<std::thread> &stages, std::vector<pid_t> &pids)
+{
+  for (std::thread &stage : stages) stage.join();
+  stages.clear();
+  wait_children(pids);
 }
 
 bool Shell::run_commands() {
@@ -451,6 +2920,11 @@ bool Shell::run_commands() {
 
   std::vector<pid_t> pids;
   pids.reserve(process_list.size());
+  std::vector<std::thread> stages;   // builtins feeding later stages
+  int server_stages = 0;
+  int builtin_status = -1;
+  std::string job_command;           // the background pipeline, as typed
+  std::unique_ptr<TransferJob> job;  // ...and its builtin stages, if it has any
 
   int prev_read_end = -1;
   for (Process* proc : process_list) {
@@ -465,98 +2939,219 @@ bool Shell::run_commands() {
       handle_cd(proc);
       continue;
     }
-    if (isBuiltin(proc)) {
-      std::cout << "Handling builtin command: " << proc->cmdTokens[0] << std::endl;
-      handleBuiltin(proc);
-      continue;
+    if (proc->background) {
+      if (!proc->pipe_in) job_command.clear();
+      for (int i = 0; i < proc->tok_index; ++i) {
+        job_command += (job_command.empty() ? "" : (i == 0 ? " | " : " ")) + std::string(proc->cmdTokens[i]);
+      }
     }
-
     if (proc->pipe_out) {
-      if (pipe(proc->pipe_fd) == -1) {
+      if (pipe2(proc->pipe_fd, O_CLOEXEC) == -1) {
         std::perror("Pipe error");
         close_pipe(prev_read_end);
+        finish_pipeline(stages, pids);
+        if (job) startPipelineJob(pids, job_command, std::move(job));
         return false;
       }
     }
 
-    pid_t pid = fork();
-    if (pid < 0) {
-      std::perror("Fork error");
-      close_pipe(prev_read_end);
-      close_pipe(proc->pipe_fd[0]);
-      close_pipe(proc->pipe_fd[1]);
-      for (pid_t cpid : pids) { int st; waitpid(cpid, &st, 0); }
-      return false;
-    }
-
-    if (pid == 0) {
-      // child
+    if (isBuiltin(proc)) {
+      // With "-" for a file the data is stdout: keep the chatter off it
+      bool streams = false;
+      for (int i = 1; i < proc->tok_index; ++i) streams |= std::strcmp(proc->cmdTokens[i], "-") == 0;
+      (streams ? std::cerr : std::cout) << "Handling builtin command: " << proc->cmdTokens[0] << "\n";
+
+      // In a pipeline the builtin reads and writes the neighbouring
+      // stages' pipes, which it owns from here on
+      proc->in_fd = prev_read_end;
+      prev_read_end = -1;
       if (proc->pipe_out) {
-        if (dup2(proc->pipe_fd[1], STDOUT_FILENO) == -1) {
-          std::perror("dup2 error");
-          _exit(EXIT_FAILURE);
-        }
+        proc->out_fd = proc->pipe_fd[1];
+        prev_read_end = proc->pipe_fd[0];
+        proc->pipe_fd[0] = proc->pipe_fd[1] = -1;
+      }
+      if (!open_redirects(proc)) {
+        close_pipe(proc->in_fd);
+        close_pipe(proc->out_fd);
+        proc->in_fd = proc->out_fd = -1;
+        if (!proc->pipe_out) builtin_status = 1;
+        continue;
       }
-      if (proc->pipe_in) {
-        if (prev_read_end == -1) {
-          std::perror("prev pipe not initialized");
-          _exit(EXIT_FAILURE);
+      take_redirects(proc);
+
+      if (!proc->pipe_in && !proc->pipe_out) {
+        if (proc->background) {
+          startTransferJob(proc);
+        } else {
+          handleBuiltin(proc);
         }
-        if (dup2(prev_read_end, STDIN_FILENO) == -1) {
-          std::perror("dup2 error");
-          _exit(EXIT_FAILURE);
+        close_pipe(proc->in_fd);
+        close_pipe(proc->out_fd);
+        proc->in_fd = proc->out_fd = -1;
+        builtin_status = -1;
+        continue;
+      }
+      if (needs_server(proc)) {
+        if (++server_stages > 1) {
+          std::cerr << proc->cmdTokens[0] << ": only one server command per pipeline\n";
+          close_pipe(proc->in_fd);
+          close_pipe(proc->out_fd);
+          proc->in_fd = proc->out_fd = -1;
+          builtin_status = 1;
+          continue;
         }
+        if (!proc->background) ensure_connection();
       }
-
-      if (proc->pipe_in) close(prev_read_end);
-      if (proc->pipe_out) {
-        close(proc->pipe_fd[0]);
-        close(proc->pipe_fd[1]);
+      if (proc->background) {
+        // Part of a job: the prompt doesn't wait for it
+        if (!job) job.reset(new TransferJob);
+        startJobStage(*job, proc);
+        if (!proc->pipe_out) {
+          startPipelineJob(pids, job_command, std::move(job));
+          last_status = 0;
+          builtin_status = -1;
+        }
+      } else if (proc->pipe_out) {
+        // Upstream of other stages: it has to run alongside them
+        stages.emplace_back([this, proc]() {
+          handleBuiltin(proc, false);
+          close_pipe(proc->in_fd);
+          close_pipe(proc->out_fd);
+          proc->in_fd = proc->out_fd = -1;
+        });
+      } else {
+        handleBuiltin(proc, false);
+        builtin_status = last_status;
+        close_pipe(proc->in_fd);
+        proc->in_fd = -1;
       }
+      continue;
+    }
 
-      execvp(proc->cmdTokens[0], proc->cmdTokens);
-      perror("execvp failed");
-      _exit(EXIT_FAILURE);
+    // Output is only flushed per line by the prompt: get ours out ahead of the child's
+    std::cout.flush();
+    // Background jobs don't compete with the shell for the terminal
+    bool reads_stdin = !proc->pipe_in;
+    for (int i = 0; i < proc->redirect_count; ++i) reads_stdin &= proc->redirects[i].fd != STDIN_FILENO;
+    if (proc->background && reads_stdin) proc->add_redirect(STDIN_FILENO, REDIRECT_IN, "/dev/null");
+
+    int failed_status = 1;
+    pid_t pid = -1;
+    if (open_redirects(proc)) {
+      pid = spawn_process(proc, prev_read_end);
+      failed_status = 127;
+      proc->close_redirects();
     }
+    if (pid > 0) pids.push_back(pid);
 
-    // parent
-    pids.push_back(pid);
+    // The child has its copies; ours are closed and forgotten so the
+    // Process destructor can't close whatever reuses the numbers
     if (proc->pipe_out) {
       close_pipe(proc->pipe_fd[1]);
       close_pipe(prev_read_end);
       prev_read_end = proc->pipe_fd[0];
+      proc->pipe_fd[0] = proc->pipe_fd[1] = -1;
+    } else if (proc->background) {
+      // The children, and any builtin stages, carry on as a job
+      close_pipe(prev_read_end);
+      prev_read_end = -1;
+      startPipelineJob(pids, job_command, std::move(job));
+      last_status = pid < 0 ? failed_status : 0;
+      builtin_status = -1;
     } else {
       close_pipe(prev_read_end);
       prev_read_end = -1;
-      for (pid_t cpid : pids) { int st; waitpid(cpid, &st, 0); }
-      pids.clear();
+      finish_pipeline(stages, pids);
+      if (pid < 0) last_status = failed_status;
+      builtin_status = -1;
     }
   }
 
-  for (pid_t cpid : pids) {
-    int st;
-    waitpid(cpid, &st, 0);
-  }
-
+  close_pipe(prev_read_end);
+  finish_pipeline(stages, pids);
+  if (job) startPipelineJob(pids, job_command, std::move(job));
+  // A pipeline ending in a builtin has that builtin's status
+  if (builtin_status >= 0) last_status = builtin_status;
   return is_quit;
 }
 
+/**
+ * @brief Parse and run one line (modified in place)
+ * @return true on quit
+ */
+bool Shell::execute_line(char *line)
+{
+  sanitize(line);
+  if (line[0] == '\0') return false;
+  parse_input(line);
+  bool quit = run_commands();
+  release_processes();
+  return quit;
+}
+
+void Shell::finish_jobs()
+{
+  if (!jobs.empty()) {
+    std::cout << "Waiting for " << jobs.size() << " background jobs\n";
+    Process all(false, false);
+    handleWait(&all);
+  }
+}
+
 void Shell::run() {
+  // A server dropping the connection mid-transfer must surface as a failed
+  // send we can recover from, not kill the shell (children get it back)
+  signal(SIGPIPE, SIG_IGN);
+  bool interactive = isatty(STDIN_FILENO);
   bool quit = false;
   while (!quit) {
-    display_prompt();
+    reapJobs();
+    if (interactive) {
+      display_prompt();
+    } else {
+      std::cout << "$ " << std::flush;
+    }
     char *input_line = read_input();
     if (input_line == nullptr) {
       cleanup(input_line);
       break;
     }
-    sanitize(input_line);
-    if (input_line[0] == '\0') {
-      free(input_line);
-      continue;
-    }
-    parse_input(input_line);
-    quit = run_commands();
-    cleanup(input_line);
+    quit = execute_line(input_line);
+    free(input_line);
+  }
+  finish_jobs();
+}
+
+/**
+ * @brief Run a whole script held in memory, without prompts
+ * Lines are copied one at a time into a reused buffer, so the script can
+ * be a read-only mapping. Blank lines and lines starting with '#' (a
+ * shebang included) are skipped.
+ * @param stop_on_error stop after the first line whose status is non-zero
+ * @return the status of the last line run
+ */
+int Shell::run_script(const char *data, size_t len, bool stop_on_error)
+{
+  signal(SIGPIPE, SIG_IGN);
+  std::vector<char> line;
+  last_status = 0;
+  for (size_t pos = 0; pos < len; ) {
+    const char *start = data + pos;
+    const char *nl = (const char *)memchr(start, '\n', len - pos);
+    size_t n = nl ? (size_t)(nl - start) : len - pos;
+    pos += n + 1;
+
+    size_t skip = 0;
+    while (skip < n && (start[skip] == ' ' || start[skip] == '\t')) ++skip;
+    if (skip == n || start[skip] == '#') continue;
+
+    line.assign(start, start + n);
+    line.push_back('\0');
+    if (!jobs.empty()) reapJobs();
+    if (execute_line(line.data())) break;
+    if (stop_on_error && last_status != 0) break;
   }
+  finish_jobs();
+  std::cout.flush();
+  return last_status;
 }
@@ -0,0 +1,96 @@
+#include <benchmark/benchmark.h>
+#include <string>
+#include <vector>
+
+#include "shell.h"
+
+/*
+ * Shell microbenchmarks: parse_input on wide and deeply piped lines, and
+ * what it costs to launch a command or a pipeline and wait for it.
+ * Built and run by "make bench".
+ */
+
+/**
+ * @brief "echo a0 a1 ..." with tokens words in all
+ */
+static std::string wide_line(int tokens) {
+  std::string line = "echo";
+  for (int i = 1; i < tokens; ++i) line += " a" + std::to_string(i);
+  return line;
+}
+
+/**
+ * @brief stages commands joined by pipes
+ */
+static std::string piped_line(int stages, const std::string &command) {
+  std::string line;
+  for (int i = 0; i < stages; ++i) line += (i ? " | " : "") + command;
+  return line;
+}
+
+/**
+ * @brief Parse (a fresh copy of) line over and over
+ */
+static void parse_repeatedly(benchmark::State &state, const std::string &line) {
+  Shell shell;
+  std::vector<char> buffer(line.size() + 1);
+  for (auto _ : state) {
+    // parse_input cuts the line up in place
+    std::copy(line.c_str(), line.c_str() + line.size() + 1, buffer.begin());
+    shell.parse_input(buffer.data());
+    benchmark::DoNotOptimize(shell.process_list.data());
+    shell.release_processes();
+  }
+  state.SetBytesProcessed(state.iterations() * (int64_t)line.size());
+}
+
+static void BM_ParseWideLine(benchmark::State &state) {
+  parse_repeatedly(state, wide_line((int)state.range(0)));
+}
+BENCHMARK(BM_ParseWideLine)->RangeMultiplier(8)->Range(8, 4096);
+
+static void BM_ParseDeepPipeline(benchmark::State &state) {
+  parse_repeatedly(state, piped_line((int)state.range(0), "grep -v x"));
+}
+BENCHMARK(BM_ParseDeepPipeline)->RangeMultiplier(4)->Range(2, 512);
+
+static void BM_ParseRedirections(benchmark::State &state) {
+  parse_repeatedly(state, "sort -r < in.txt 2>&1 >> out.txt | tr a-z A-Z <<< word > up.txt");
+}
+BENCHMARK(BM_ParseRedirections);
+
+/**
+ * @brief Run line through the whole shell: parse, spawn, wait
+ */
+static void execute_repeatedly(benchmark::State &state, const std::string &line) {
+  Shell shell;
+  std::vector<char> buffer(line.size() + 1);
+  for (auto _ : state) {
+    std::copy(line.c_str(), line.c_str() + line.size() + 1, buffer.begin());
+    shell.execute_line(buffer.data());
+  }
+  if (shell.last_status != 0) state.SkipWithError("command failed");
+}
+
+static void BM_LaunchAbsolute(benchmark::State &state) {
+  execute_repeatedly(state, "/bin/true");
+}
+BENCHMARK(BM_LaunchAbsolute)->UseRealTime();
+
+// Looked up on $PATH once, then from the command hash
+static void BM_LaunchHashed(benchmark::State &state) {
+  execute_repeatedly(state, "true");
+}
+BENCHMARK(BM_LaunchHashed)->UseRealTime();
+
+static void BM_LaunchPipeline(benchmark::State &state) {
+  execute_repeatedly(state, piped_line((int)state.range(0), "true"));
+}
+BENCHMARK(BM_LaunchPipeline)->RangeMultiplier(4)->Range(2, 32)->UseRealTime();
+
+static void BM_LaunchRedirected(benchmark::State &state) {
+  execute_repeatedly(state, "cat <<< hello > /dev/null");
+}
+BENCHMARK(BM_LaunchRedirected)->UseRealTime();
+
+BENCHMARK_MAIN();
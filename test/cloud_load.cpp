@@ -0,0 +1,308 @@
+#include <fcntl.h>
+#include <ftw.h>
+#include <getopt.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "connection_pool.h"
+#include "protocol.h"
+
+/*
+ * cloud_load: closed-loop load generator for cloud_server
+ *
+ * Each client is a thread with one plain (un-negotiated) connection that
+ * sends its next request as soon as the last one is answered. Every
+ * scenario (operation x file size x client count) runs for a fixed time
+ * and reports throughput and latency percentiles. DELETE alternates with
+ * an UPLOAD that puts the file back; only the deletes are timed and
+ * counted. With -S the server is started in a scratch directory first
+ * and stopped at the end. Run by "make bench".
+ */
+
+using Clock = std::chrono::steady_clock;
+
+static std::string host = "127.0.0.1";
+static int port = 9790;
+static std::vector<int> client_counts = {1, 8};
+static std::vector<size_t> file_sizes = {4096, 1024 * 1024};
+static double seconds = 2.0;
+static std::vector<char> payload;   // what every UPLOAD sends, length max(file_sizes)
+
+/**
+ * @brief One client's connection to the server
+ */
+struct Client {
+  int fd = -1;
+  SocketReader reader;
+  std::vector<char> sink;   // DOWNLOAD payloads land here
+
+  bool open(const ServerAddress &address) {
+    fd = connect_address(address);
+    reader.reset(fd);
+    return fd >= 0;
+  }
+
+  ~Client() {
+    if (fd >= 0) close(fd);
+  }
+
+  bool request(const Request &req, const char *data, Response &resp) {
+    std::string out;
+    encode_request(out, false, req);
+    if (!send_all(fd, out.data(), out.size(), data ? MSG_MORE : 0)) return false;
+    if (data && !send_all(fd, data, req.payload_len)) return false;
+    return read_response(reader, false, false, resp);
+  }
+
+  bool upload(const std::string &name, size_t size) {
+    Response resp;
+    return request(Request{OP_UPLOAD, 0, false, name, size}, payload.data(), resp)
+           && resp.opcode == OP_OK;
+  }
+
+  bool download(const std::string &name) {
+    Response resp;
+    if (!request(Request{OP_DOWNLOAD, 0, false, name, 0}, nullptr, resp) || resp.opcode != OP_DATA) {
+      return false;
+    }
+    for (uint64_t left = resp.payload_len; left > 0; ) {
+      size_t n = (size_t)std::min<uint64_t>(left, sink.size());
+      if (!reader.read_exact(sink.data(), n)) return false;
+      left -= n;
+    }
+    return true;
+  }
+
+  bool list() {
+    Response resp;
+    std::vector<std::string> names;
+    return request(Request{OP_LIST, 0, false, "", 0}, nullptr, resp) && resp.opcode == OP_OK
+           && read_file_list(reader, false, resp, names);
+  }
+
+  bool remove(const std::string &name) {
+    Response resp;
+    return request(Request{OP_DELETE, 0, false, name, 0}, nullptr, resp) && resp.opcode == OP_OK;
+  }
+};
+
+enum Operation { LIST, UPLOAD, DOWNLOAD, DELETE };
+static const char *operation_names[] = {"LIST", "UPLOAD", "DOWNLOAD", "DELETE"};
+
+/**
+ * @brief What one client measured
+ */
+struct Sample {
+  std::vector<uint32_t> latencies_ns;
+  uint64_t errors = 0;
+};
+
+static void run_client(const ServerAddress &address, Operation op, size_t size, int id,
+                       Clock::time_point end, Sample &sample) {
+  Client client;
+  client.sink.resize(256 * 1024);
+  if (!client.open(address)) {
+    ++sample.errors;
+    return;
+  }
+  std::string name = "load-" + std::to_string(id) + "-" + std::to_string(size);
+  // DOWNLOAD and DELETE need the file there first
+  if ((op == DOWNLOAD || op == DELETE) && !client.upload(name, size)) {
+    ++sample.errors;
+    return;
+  }
+  sample.latencies_ns.reserve(1 << 16);
+  while (Clock::now() < end) {
+    Clock::time_point start = Clock::now();
+    bool ok = false;
+    switch (op) {
+      case LIST:     ok = client.list(); break;
+      case UPLOAD:   ok = client.upload(name, size); break;
+      case DOWNLOAD: ok = client.download(name); break;
+      case DELETE:   ok = client.remove(name); break;
+    }
+    Clock::time_point done = Clock::now();
+    if (!ok) {
+      ++sample.errors;
+      // A broken connection stays broken: start over on a new one
+      close(client.fd);
+      if (!client.open(address)) return;
+      continue;
+    }
+    sample.latencies_ns.push_back((uint32_t)std::min<int64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(done - start).count(), UINT32_MAX));
+    if (op == DELETE && !client.upload(name, size)) ++sample.errors;
+  }
+}
+
+/**
+ * @brief Run one scenario and print its line of the report
+ */
+static void run_scenario(const ServerAddress &address, Operation op, size_t size, int clients) {
+  std::vector<Sample> samples(clients);
+  std::vector<std::thread> threads;
+  Clock::time_point start = Clock::now();
+  Clock::time_point end = start + std::chrono::duration_cast<Clock::duration>(
+                                      std::chrono::duration<double>(seconds));
+  for (int i = 0; i < clients; ++i) {
+    threads.emplace_back(run_client, std::cref(address), op, size, i, end, std::ref(samples[i]));
+  }
+  for (std::thread &t : threads) t.join();
+  double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+
+  std::vector<uint32_t> all;
+  uint64_t errors = 0;
+  for (Sample &sample : samples) {
+    all.insert(all.end(), sample.latencies_ns.begin(), sample.latencies_ns.end());
+    errors += sample.errors;
+  }
+  std::sort(all.begin(), all.end());
+  auto percentile_us = [&](double p) {
+    if (all.empty()) return 0.0;
+    size_t index = std::min(all.size() - 1, (size_t)(p * all.size()));
+    return all[index] / 1000.0;
+  };
+  std::string size_text = op == LIST ? "-" : std::to_string(size);
+  std::printf("%-9s %9s %7d %12.1f %10.1f %10.1f %10.1f %8llu\n", operation_names[op],
+              size_text.c_str(), clients, all.size() / elapsed, percentile_us(0.50),
+              percentile_us(0.99), percentile_us(0.999), (unsigned long long)errors);
+  std::fflush(stdout);
+}
+
+static std::vector<long long> parse_list(const char *text) {
+  std::vector<long long> values;
+  for (const std::string &item : split_string(text, ',')) {
+    if (!item.empty()) values.push_back(std::atoll(item.c_str()));
+  }
+  return values;
+}
+
+static int remove_entry(const char *path, const struct stat *, int, struct FTW *) {
+  return ::remove(path);
+}
+
+/**
+ * @brief Start server_bin on port in a scratch directory
+ * @return its pid, -1 on failure
+ */
+static pid_t start_server(const char *server_bin, std::string &dir) {
+  char scratch[] = "/tmp/cloud_load.XXXXXX";
+  if (!mkdtemp(scratch)) return -1;
+  dir = scratch;
+  char *bin = realpath(server_bin, nullptr);
+  if (!bin) return -1;
+  pid_t pid = fork();
+  if (pid == 0) {
+    if (chdir(scratch) != 0) _exit(127);
+    int log = open("server.log", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (log >= 0) {
+      dup2(log, STDOUT_FILENO);
+      dup2(log, STDERR_FILENO);
+    }
+    std::string port_text = std::to_string(port);
+    execl(bin, bin, port_text.c_str(), (char *)nullptr);
+    _exit(127);
+  }
+  free(bin);
+  return pid;
+}
+
+static void usage(const char *prog) {
+  std::fprintf(stderr,
+               "Usage: %s [-H host] [-p port] [-c clients,...] [-s sizes,...] [-t seconds] [-S server]\n"
+               "  -c  client counts to run each scenario with (default 1,8)\n"
+               "  -s  file sizes in bytes for UPLOAD/DOWNLOAD (default 4096,1048576)\n"
+               "  -t  seconds per scenario (default 2)\n"
+               "  -S  start this cloud_server binary first, in a scratch directory\n",
+               prog);
+}
+
+int main(int argc, char *argv[]) {
+  const char *server_bin = nullptr;
+  int opt;
+  while ((opt = getopt(argc, argv, "H:p:c:s:t:S:h")) != -1) {
+    switch (opt) {
+      case 'H': host = optarg; break;
+      case 'p': port = std::atoi(optarg); break;
+      case 'c':
+        client_counts.clear();
+        for (long long n : parse_list(optarg)) client_counts.push_back((int)std::max(1LL, n));
+        break;
+      case 's':
+        file_sizes.clear();
+        for (long long n : parse_list(optarg)) file_sizes.push_back((size_t)std::max(0LL, n));
+        break;
+      case 't': seconds = std::atof(optarg); break;
+      case 'S': server_bin = optarg; break;
+      default:
+        usage(argv[0]);
+        return opt == 'h' ? 0 : 2;
+    }
+  }
+  signal(SIGPIPE, SIG_IGN);
+
+  std::string scratch;
+  pid_t server = -1;
+  if (server_bin) {
+    server = start_server(server_bin, scratch);
+    if (server < 0) {
+      std::perror("cloud_load: starting server");
+      return 1;
+    }
+  }
+
+  DnsCache dns;
+  ServerAddress address;
+  if (!dns.resolve(host, port, address)) {
+    std::fprintf(stderr, "cloud_load: cannot resolve %s\n", host.c_str());
+    return 1;
+  }
+  // A server just started needs a moment before it accepts
+  bool up = false;
+  for (int i = 0; i < 100 && !up; ++i) {
+    int fd = connect_address(address);
+    up = fd >= 0;
+    if (up) {
+      close(fd);
+    } else {
+      std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+  }
+
+  int status = 0;
+  if (!up) {
+    std::fprintf(stderr, "cloud_load: nothing listening on %s:%d\n", host.c_str(), port);
+    status = 1;
+  } else {
+    size_t largest = file_sizes.empty() ? 0 : *std::max_element(file_sizes.begin(), file_sizes.end());
+    payload.resize(std::max(largest, (size_t)1));
+    std::minstd_rand rng(42);
+    for (char &c : payload) c = (char)rng();
+
+    std::printf("%-9s %9s %7s %12s %10s %10s %10s %8s\n", "op", "size", "clients", "ops/s",
+                "p50 us", "p99 us", "p999 us", "errors");
+    for (int clients : client_counts) {
+      for (size_t size : file_sizes) run_scenario(address, UPLOAD, size, clients);
+      for (size_t size : file_sizes) run_scenario(address, DOWNLOAD, size, clients);
+      run_scenario(address, LIST, 0, clients);
+      run_scenario(address, DELETE, file_sizes.empty() ? 0 : file_sizes.front(), clients);
+    }
+  }
+
+  if (server > 0) {
+    kill(server, SIGTERM);
+    waitpid(server, nullptr, 0);
+    nftw(scratch.c_str(), remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+  }
+  return status;
+}
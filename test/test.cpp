@@ -11,6 +11,16 @@
 
 #include "shell.h"    // NEW: Shell class
 #include "process.h"  // NEW: Process class
+#include "protocol.h"
+#include "file_cache.h"
+#include "file_index.h"
+#include "xxhash64.h"
+#include "sha256.h"
+#include "compress.h"
+#include "metrics.h"
+#include "async_log.h"
+#include "hash_ring.h"
+#include <sys/socket.h>
 
 using namespace std;
 
@@ -72,8 +82,8 @@ static std::vector<Process*> to_vec(const std::list<Process*>& lst) {
   return std::vector<Process*>(lst.begin(), lst.end());
 }
 
+// Parsed processes live in the shell's line arena; the shell reclaims them
 static void free_list(std::list<Process*>& lst) {
-  for (auto* p : lst) delete p;
   lst.clear();
 }
 
@@ -129,6 +139,28 @@ TEST(ParseInputTest, MixedSemicolonAndPipe) {
   free_list(plist);
 }
 
+TEST(ParseInputTest, AmpersandMarksBackgroundAndSeparates) {
+  Shell shell;
+  char cmd[] = "cput a.bin a.bin & cget b b&ls";
+  std::list<Process*> plist;
+  shell.parse_input(cmd);
+  for (auto* p : shell.process_list) {
+    plist.push_back(p);
+  }
+  shell.process_list.clear();
+
+  auto v = to_vec(plist);
+  ASSERT_EQ(v.size(), 3u);
+  expect_proc(*v[0], {"cput", "a.bin", "a.bin"}, /*in=*/false, /*out=*/false);
+  expect_proc(*v[1], {"cget", "b", "b"},         /*in=*/false, /*out=*/false);
+  expect_proc(*v[2], {"ls"},                     /*in=*/false, /*out=*/false);
+  EXPECT_TRUE(v[0]->background);
+  EXPECT_TRUE(v[1]->background);
+  EXPECT_FALSE(v[2]->background);
+
+  free_list(plist);
+}
+
 TEST(ParseInputTest, EmptyInputProducesNoProcess) {
   Shell shell;                    // NEW
   char cmd[] = "";
@@ -184,6 +216,154 @@ TEST(ShellTest, TestSimpleRun) {
                                          << expected_output;
 }
 
+TEST(ShellTest, CommandHashRemembersPathLookups) {
+  Shell shell;
+  std::string saved = getenv("PATH") ? getenv("PATH") : "";
+  setenv("PATH", "/nonexistent:/bin:/usr/bin", 1);
+
+  std::string sh = shell.resolve_command("sh");
+  ASSERT_FALSE(sh.empty());
+  EXPECT_EQ(sh.substr(sh.size() - 3), "/sh");
+  EXPECT_EQ(shell.command_hash.count("sh"), 1u);
+  EXPECT_EQ(shell.resolve_command("./local/tool"), "./local/tool");
+  EXPECT_EQ(shell.resolve_command("no-such-command-here"), "");
+
+  // A different $PATH invalidates everything found so far
+  setenv("PATH", "/nonexistent", 1);
+  EXPECT_EQ(shell.resolve_command("sh"), "");
+  EXPECT_TRUE(shell.command_hash.empty());
+  setenv("PATH", saved.c_str(), 1);
+}
+
+TEST(ShellTest, BuiltinPipelineStageHandsOnEndOfInput) {
+  Shell shell;
+  // Not connected: cget fails, and the stage after it still sees EOF
+  char line[] = "cget remote - | wc -c";
+  EXPECT_FALSE(shell.execute_line(line));
+  EXPECT_EQ(shell.last_status, 0);
+
+  // The builtin, last in the pipeline, sets the status
+  char tail[] = "true | cls";
+  EXPECT_FALSE(shell.execute_line(tail));
+  EXPECT_EQ(shell.last_status, 1);
+}
+
+TEST(ParseInputTest, RedirectionsAreNotArguments) {
+  Shell shell;
+  char cmd[] = "sort -r <in.txt 2>&1 >> out.txt | tr a-z A-Z <<< word";
+  shell.parse_input(cmd);
+  ASSERT_EQ(shell.process_list.size(), 2u);
+
+  Process *sort = shell.process_list[0];
+  ASSERT_EQ(sort->tok_index, 2);
+  EXPECT_STREQ(sort->cmdTokens[1], "-r");
+  ASSERT_EQ(sort->redirect_count, 3);
+  EXPECT_EQ(sort->redirects[0].kind, REDIRECT_IN);
+  EXPECT_STREQ(sort->redirects[0].target, "in.txt");
+  EXPECT_EQ(sort->redirects[1].kind, REDIRECT_DUP);
+  EXPECT_EQ(sort->redirects[1].fd, 2);
+  EXPECT_EQ(sort->redirects[1].source, 1);
+  EXPECT_EQ(sort->redirects[2].kind, REDIRECT_APPEND);
+  EXPECT_EQ(sort->redirects[2].fd, 1);
+  EXPECT_STREQ(sort->redirects[2].target, "out.txt");
+
+  Process *tr = shell.process_list[1];
+  ASSERT_EQ(tr->tok_index, 3);
+  ASSERT_EQ(tr->redirect_count, 1);
+  EXPECT_EQ(tr->redirects[0].kind, REDIRECT_HERE);
+  EXPECT_STREQ(tr->redirects[0].target, "word");
+  shell.release_processes();
+
+  char dangling[] = "cat > | wc";
+  shell.parse_input(dangling);
+  EXPECT_TRUE(shell.process_list.empty());
+  EXPECT_EQ(shell.last_status, 2);
+}
+
+TEST(ShellTest, RedirectionsReachTheCommand) {
+  Shell shell;
+  std::string out = "/tmp/dk_shell_redirect_test.txt";
+  unlink(out.c_str());
+
+  std::string first = "tr a-z A-Z <<< hello > " + out;
+  std::string second = "ls /nonexistent-dk-shell >> " + out + " 2>&1";
+  EXPECT_FALSE(shell.execute_line(&first[0]));
+  EXPECT_FALSE(shell.execute_line(&second[0]));
+  EXPECT_NE(shell.last_status, 0);
+
+  std::ifstream in(out);
+  std::string line;
+  ASSERT_TRUE(std::getline(in, line));
+  EXPECT_EQ(line, "HELLO");
+  ASSERT_TRUE(std::getline(in, line));
+  EXPECT_NE(line.find("nonexistent-dk-shell"), std::string::npos);
+
+  std::string missing = "cat < /nonexistent-dk-shell";
+  EXPECT_FALSE(shell.execute_line(&missing[0]));
+  EXPECT_EQ(shell.last_status, 1);
+  unlink(out.c_str());
+}
+
+TEST(ShellTest, BackgroundPipelinesBecomeJobs) {
+  Shell shell;
+  char line[] = "sleep 0.2 | sh -c exit & true";
+  EXPECT_FALSE(shell.execute_line(line));
+  ASSERT_EQ(shell.jobs.size(), 1u);
+  EXPECT_EQ(shell.jobs[0]->command, "sleep 0.2 | sh -c exit");
+  EXPECT_EQ(shell.jobs[0]->pids.size(), 2u);
+
+  char wait[] = "wait 1";
+  EXPECT_FALSE(shell.execute_line(wait));
+  EXPECT_TRUE(shell.jobs.empty());
+  EXPECT_EQ(shell.last_status, 0);
+
+  // A builtin stage runs with the job too, not before the prompt returns
+  auto start = std::chrono::steady_clock::now();
+  char builtin[] = "parallel sleep ::: 0.5 | cat &";
+  EXPECT_FALSE(shell.execute_line(builtin));
+  double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  EXPECT_LT(secs, 0.3);
+  ASSERT_EQ(shell.jobs.size(), 1u);
+  EXPECT_EQ(shell.jobs[0]->stages.size(), 1u);
+
+  char fg[] = "fg";
+  EXPECT_FALSE(shell.execute_line(fg));
+  EXPECT_TRUE(shell.jobs.empty());
+  EXPECT_EQ(shell.last_status, 0);
+}
+
+TEST(ShellTest, ParallelCountsFailedRuns) {
+  Shell shell;
+  // Eight runs of a 0.2 s command four at a time take two rounds, not eight
+  auto start = std::chrono::steady_clock::now();
+  char line[] = "parallel -j 4 sleep ::: 0.2 0.2 0.2 0.2 0.2 0.2 0.2 0.2";
+  EXPECT_FALSE(shell.execute_line(line));
+  double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  EXPECT_EQ(shell.last_status, 0);
+  EXPECT_LT(secs, 1.2);
+
+  char failing[] = "parallel -j 2 test {} = ok ::: ok bad ok bad bad";
+  EXPECT_FALSE(shell.execute_line(failing));
+  EXPECT_EQ(shell.last_status, 3);
+}
+
+TEST(ShellTest, StopOnErrorEndsAtAFailedBuiltin) {
+  Shell shell;
+  // Connected (to a peer that never answers): cput fails on the local file
+  int sv[2];
+  ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+  shell.server_fd = sv[0];
+  shell.server_reader.reset(sv[0]);
+
+  testing::internal::CaptureStdout();
+  const char script[] = "cput /nonexistent-dk-shell r1\necho AFTER\n";
+  int status = shell.run_script(script, sizeof(script) - 1, true);
+  std::string output = testing::internal::GetCapturedStdout();
+  EXPECT_EQ(status, 1);
+  EXPECT_EQ(output.find("AFTER"), std::string::npos) << output;
+  close(sv[1]);
+}
+
 TEST(ParseInputTest, Exactly25TokensAccepted) {
   Shell shell;  // NEW
 
@@ -215,6 +395,504 @@ TEST(ParseInputTest, Exactly25TokensAccepted) {
   free_list(plist);
 }
 
+TEST(ParseInputTest, WideLinesAreNotTruncated) {
+  Shell shell;
+  std::string line = "echo";
+  for (int i = 0; i < 500; ++i) line += " a" + std::to_string(i);
+  line += " | wc -w";
+
+  // Parse it twice: the second line reuses the arena the first one grew
+  for (int round = 0; round < 2; ++round) {
+    std::vector<char> cmd(line.begin(), line.end());
+    cmd.push_back('\0');
+    shell.parse_input(cmd.data());
+    ASSERT_EQ(shell.process_list.size(), 2u);
+    Process *echo = shell.process_list[0];
+    ASSERT_EQ(echo->get_size(), 501);
+    EXPECT_STREQ(echo->get_token(500), "a499");
+    EXPECT_EQ(echo->cmdTokens[501], nullptr);
+    expect_proc(*shell.process_list[1], {"wc", "-w"}, /*in=*/true, /*out=*/false);
+    shell.release_processes();
+  }
+
+  Process standalone(false, false);
+  for (int i = 0; i < 100; ++i) standalone.add_token((char *)"x");
+  EXPECT_EQ(standalone.get_size(), 100);
+  EXPECT_EQ(standalone.cmdTokens[100], nullptr);
+}
+
+TEST(ProtocolTest, ReaderPassesPayloadThroughAfterHeader) {
+  int sv[2];
+  ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+
+  // header, payload and the next header arrive in a single write
+  const char wire[] = "UPLOAD|a.txt|5\r\nhelloLIST\n";
+  ASSERT_TRUE(send_all(sv[0], wire, sizeof(wire) - 1));
+  close(sv[0]);
+
+  SocketReader reader(sv[1]);
+  EXPECT_EQ(read_line(reader), "UPLOAD|a.txt|5");
+  char payload[5];
+  ASSERT_TRUE(recv_all(reader, payload, sizeof(payload)));
+  EXPECT_EQ(std::string(payload, sizeof(payload)), "hello");
+  EXPECT_EQ(read_line(reader), "LIST");
+  EXPECT_EQ(read_line(reader), "") << "EOF should read as an empty line";
+
+  close(sv[1]);
+}
+
+TEST(ProtocolTest, SendFileSendsRequestedRange) {
+  const char *filename = "send_file.txt";
+  write_line(filename, "0123456789");
+  int file_fd = open(filename, O_RDONLY);
+  ASSERT_GE(file_fd, 0);
+
+  int sv[2];
+  ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+  ASSERT_TRUE(send_file(sv[0], file_fd, 3, 5));
+  close(sv[0]);
+
+  SocketReader reader(sv[1]);
+  char got[5];
+  ASSERT_TRUE(recv_all(reader, got, sizeof(got)));
+  EXPECT_EQ(std::string(got, sizeof(got)), "34567");
+
+  close(sv[1]);
+  close(file_fd);
+  remove(filename);
+}
+
+TEST(ProtocolTest, RequestTagRoundTrip) {
+  uint64_t id = 0;
+  std::string rest;
+  ASSERT_TRUE(parse_request_tag(request_tag(42) + "DELETE|a|b", id, rest));
+  EXPECT_EQ(id, 42u);
+  EXPECT_EQ(rest, "DELETE|a|b");
+
+  EXPECT_FALSE(parse_request_tag("DELETE|a", id, rest));
+  EXPECT_FALSE(parse_request_tag("#|DELETE", id, rest));
+  EXPECT_FALSE(parse_request_tag("#4x|DELETE", id, rest));
+}
+
+TEST(ProtocolTest, TextRequestParsesInPlace) {
+  Request req;
+  std::string line = "#7|UPLOAD|notes.txt|1234";
+  ASSERT_EQ(parse_text_request(line, true, req), nullptr);
+  EXPECT_EQ(req.opcode, OP_UPLOAD);
+  EXPECT_TRUE(req.tagged);
+  EXPECT_EQ(req.id, 7u);
+  EXPECT_EQ(req.name, "notes.txt");
+  EXPECT_EQ(req.payload_len, 1234u);
+
+  std::string bad_size = "UPLOAD|a|12x";
+  EXPECT_STREQ(parse_text_request(bad_size, false, req), "Invalid UPLOAD size");
+  std::string unknown = "FETCH|a";
+  EXPECT_STREQ(parse_text_request(unknown, false, req), "Unknown command");
+}
+
+TEST(ProtocolTest, BinaryFramesRoundTrip) {
+  int sv[2];
+  ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+
+  // '|' is fine in names once they are length prefixed
+  std::string name = "a|b.txt";
+  std::string out;
+  encode_request(out, true, Request{OP_DOWNLOAD, 9, true, name, 0});
+  encode_response(out, true, Response{OP_DATA, 9, true, "", 42});
+  // Status messages (STATS, batch failures) may run well past a filename
+  std::string stats(4000, 's');
+  encode_response(out, true, Response{OP_OK, 10, true, stats, 0});
+  ASSERT_TRUE(send_all(sv[0], out.data(), out.size()));
+
+  SocketReader reader(sv[1]);
+  Request req;
+  ASSERT_TRUE(next_frame_request(reader, req));
+  EXPECT_EQ(req.opcode, OP_DOWNLOAD);
+  EXPECT_EQ(req.id, 9u);
+  EXPECT_EQ(req.name, name);
+
+  Response resp;
+  ASSERT_TRUE(read_response(reader, true, true, resp));
+  EXPECT_EQ(resp.opcode, OP_DATA);
+  EXPECT_EQ(resp.id, 9u);
+  EXPECT_EQ(resp.payload_len, 42u);
+  EXPECT_EQ(resp.status_line(), "OK|DATA|42");
+  ASSERT_TRUE(read_response(reader, true, true, resp));
+  EXPECT_EQ(resp.message, stats);
+
+  close(sv[0]);
+  close(sv[1]);
+}
+
+TEST(FileCacheTest, EvictsLeastRecentlyUsedAndInvalidates) {
+  // Small enough that each shard holds two 100-byte files
+  FileCache cache;
+  cache.set_capacity(FILE_CACHE_SHARDS * 200);
+  ASSERT_EQ(cache.max_object_size(), 200u);
+
+  // Find three keys that land in the same shard
+  std::vector<std::string> keys;
+  size_t shard = std::hash<std::string>{}("k0") % FILE_CACHE_SHARDS;
+  for (int i = 0; keys.size() < 3; ++i) {
+    std::string key = "k" + std::to_string(i);
+    if (std::hash<std::string>{}(key) % FILE_CACHE_SHARDS == shard) keys.push_back(key);
+  }
+
+  FileCache::Data data = std::make_shared<std::string>(100, 'x');
+  cache.put(keys[0], data);
+  cache.put(keys[1], data);
+  EXPECT_TRUE(cache.get(keys[0]));  // keys[1] is now the oldest
+  cache.put(keys[2], data);
+
+  EXPECT_TRUE(cache.get(keys[0]));
+  EXPECT_FALSE(cache.get(keys[1]));
+  EXPECT_TRUE(cache.get(keys[2]));
+
+  cache.invalidate(keys[0]);
+  EXPECT_FALSE(cache.get(keys[0]));
+  cache.put("big", std::make_shared<std::string>(201, 'x'));
+  EXPECT_FALSE(cache.get("big"));
+
+  FileCacheStats st = cache.stats();
+  EXPECT_EQ(st.entries, 1u);
+  EXPECT_EQ(st.bytes, 100u);
+  EXPECT_EQ(st.hits, 3u);
+  EXPECT_EQ(st.misses, 3u);
+}
+
+TEST(FileIndexTest, PrefixPagesResumeAfterCursor) {
+  FileIndex index;
+  index.reset({"b/2", "a", "b/1", "b/3", "c"});
+  index.add("b/0");
+  index.remove("b/3");
+
+  std::vector<std::string> page;
+  EXPECT_TRUE(index.list("b/", "", 2, page));
+  EXPECT_EQ(page, (std::vector<std::string>{"b/0", "b/1"}));
+
+  page.clear();
+  EXPECT_FALSE(index.list("b/", "b/1", 2, page));
+  EXPECT_EQ(page, (std::vector<std::string>{"b/2"}));
+
+  page.clear();
+  EXPECT_FALSE(index.list("", "", 0, page));
+  EXPECT_EQ(page.size(), 5u);
+}
+
+TEST(ProtocolTest, ListRequestCarriesPrefixAndCursor) {
+  for (bool binary : {false, true}) {
+    int sv[2];
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+    std::string out;
+    encode_request(out, binary, Request{OP_LIST, 3, binary, "logs/", 50, "logs/a|b"});
+    ASSERT_TRUE(send_all(sv[0], out.data(), out.size()));
+
+    SocketReader reader(sv[1]);
+    Request req;
+    std::string line;
+    if (binary) {
+      ASSERT_TRUE(next_frame_request(reader, req));
+    } else {
+      ASSERT_TRUE(reader.next_line(line));
+      ASSERT_EQ(parse_text_request(line, false, req), nullptr);
+    }
+    EXPECT_EQ(req.opcode, OP_LIST);
+    EXPECT_EQ(req.name, "logs/");
+    EXPECT_EQ(req.payload_len, 50u);
+    EXPECT_EQ(req.arg, "logs/a|b");
+    close(sv[0]);
+    close(sv[1]);
+  }
+}
+
+TEST(ProtocolTest, RangedRequestsRoundTrip) {
+  for (bool binary : {false, true}) {
+    int sv[2];
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+    std::string out;
+    encode_request(out, binary, Request{OP_DOWNLOAD, 1, binary, "log.txt", 0, "100|50"});
+    encode_request(out, binary, Request{OP_UPLOAD, 2, binary, "big.bin", 7, "4096|tok-1"});
+    ASSERT_TRUE(send_all(sv[0], out.data(), out.size()));
+
+    SocketReader reader(sv[1]);
+    Request req;
+    std::string line;
+    uint64_t offset;
+    std::string_view rest;
+    for (uint8_t opcode : {OP_DOWNLOAD, OP_UPLOAD}) {
+      if (binary) {
+        ASSERT_TRUE(next_frame_request(reader, req));
+      } else {
+        ASSERT_TRUE(reader.next_line(line));
+        ASSERT_EQ(parse_text_request(line, false, req), nullptr);
+      }
+      EXPECT_EQ(req.opcode, opcode);
+      ASSERT_TRUE(parse_offset_arg(req.arg, offset, rest));
+      if (opcode == OP_DOWNLOAD) {
+        EXPECT_EQ(req.name, "log.txt");
+        EXPECT_EQ(offset, 100u);
+        EXPECT_EQ(rest, "50");
+      } else {
+        EXPECT_EQ(req.name, "big.bin");
+        EXPECT_EQ(req.payload_len, 7u);
+        EXPECT_EQ(offset, 4096u);
+        EXPECT_TRUE(valid_resume_token(rest));
+      }
+    }
+    close(sv[0]);
+    close(sv[1]);
+  }
+  EXPECT_FALSE(valid_resume_token("../etc"));
+}
+
+TEST(ProtocolTest, ParallelRequestsRoundTrip) {
+  for (bool binary : {false, true}) {
+    int sv[2];
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+    std::string out;
+    encode_request(out, binary, Request{OP_SIZE, 1, binary, "big.bin", 0});
+    encode_request(out, binary, Request{OP_PART, 2, binary, "tok-p", 5, "8388608"});
+    encode_request(out, binary, Request{OP_COMMIT, 3, binary, "big.bin", 16777216, "tok-p"});
+    ASSERT_TRUE(send_all(sv[0], out.data(), out.size()));
+
+    SocketReader reader(sv[1]);
+    Request req;
+    std::string line;
+    for (uint8_t opcode : {OP_SIZE, OP_PART, OP_COMMIT}) {
+      if (binary) {
+        ASSERT_TRUE(next_frame_request(reader, req));
+      } else {
+        ASSERT_TRUE(reader.next_line(line));
+        ASSERT_EQ(parse_text_request(line, false, req), nullptr);
+      }
+      EXPECT_EQ(req.opcode, opcode);
+      if (opcode == OP_SIZE) {
+        EXPECT_EQ(req.name, "big.bin");
+        EXPECT_TRUE(req.arg.empty());
+      } else if (opcode == OP_PART) {
+        EXPECT_EQ(req.name, "tok-p");
+        EXPECT_EQ(req.payload_len, 5u);
+        EXPECT_EQ(req.arg, "8388608");
+      } else {
+        EXPECT_EQ(req.name, "big.bin");
+        EXPECT_EQ(req.payload_len, 16777216u);
+        EXPECT_EQ(req.arg, "tok-p");
+      }
+    }
+    close(sv[0]);
+    close(sv[1]);
+  }
+}
+
+TEST(ProtocolTest, BusyRejectionCarriesRetryDelay) {
+  for (bool binary : {false, true}) {
+    int sv[2];
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+    std::string out;
+    encode_response(out, binary, Response{OP_ERROR, 0, false, std::string(RESP_BUSY) + "|250", 0});
+    encode_response(out, binary, Response{OP_ERROR, 0, false, "File not found", 0});
+    ASSERT_TRUE(send_all(sv[0], out.data(), out.size()));
+
+    SocketReader reader(sv[1]);
+    Response resp;
+    ASSERT_TRUE(read_response(reader, binary, true, resp));
+    EXPECT_EQ(busy_retry_after(resp), 250);
+    ASSERT_TRUE(read_response(reader, binary, true, resp));
+    EXPECT_EQ(busy_retry_after(resp), -1);
+    close(sv[0]);
+    close(sv[1]);
+  }
+}
+
+TEST(ContentKeyTest, Xxh64MatchesReferenceVectors) {
+  std::string text = "Nobody inspects the spammish repetition";
+  EXPECT_EQ(xxh64("", 0), 0xEF46DB3751D8E999ULL);
+  EXPECT_EQ(xxh64("abc", 3), 0x44BC2CF5AD770999ULL);
+  EXPECT_EQ(xxh64(text.data(), text.size()), 0xFBCEA83C8A378BF1ULL);
+
+  // Streaming in odd pieces gives the same digest
+  Xxh64 hash;
+  for (size_t i = 0; i < text.size(); i += 5) {
+    hash.update(text.data() + i, std::min((size_t)5, text.size() - i));
+  }
+  EXPECT_EQ(hash.digest(), 0xFBCEA83C8A378BF1ULL);
+}
+
+TEST(ContentKeyTest, Sha256MatchesReferenceVectors) {
+  std::string text = "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+  Sha256 empty, abc;
+  abc.update("abc", 3);
+  EXPECT_EQ(empty.hex(), "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855");
+  EXPECT_EQ(abc.hex(), "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+
+  // Streaming in odd pieces gives the same digest; 56 bytes pads to two blocks
+  Sha256 hash;
+  for (size_t i = 0; i < text.size(); i += 5) {
+    hash.update(text.data() + i, std::min((size_t)5, text.size() - i));
+  }
+  std::string digest = "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1";
+  EXPECT_EQ(hash.hex(), digest);
+  EXPECT_EQ(content_key(hash.hex(), text.size()), digest + "-56");
+}
+
+TEST(CompressTest, ChunksRoundTripAndRejectCorruption) {
+  std::string text;
+  while (text.size() < 3 * COMPRESS_CHUNK_SIZE + 100) text += "GET /index.html 200 OK\n";
+  std::string noise(COMPRESS_CHUNK_SIZE + 7, '\0');
+  uint64_t x = 88172645463325252ULL;
+  for (char &c : noise) {
+    x ^= x << 13, x ^= x >> 7, x ^= x << 17;
+    c = (char)x;
+  }
+
+  int sv[2];
+  ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+  std::string wire;
+  ChunkEncoder encoder(6);
+  for (const std::string *payload : {&text, &noise}) {
+    for (size_t i = 0; i < payload->size(); i += COMPRESS_CHUNK_SIZE) {
+      encoder.encode(payload->data() + i, std::min((size_t)COMPRESS_CHUNK_SIZE, payload->size() - i), wire);
+    }
+  }
+  EXPECT_LT(wire.size(), text.size() / 4 + noise.size() + 64);
+  ASSERT_TRUE(send_all(sv[0], wire.data(), wire.size()));
+
+  SocketReader reader(sv[1]);
+  ChunkDecoder decoder;
+  for (const std::string *payload : {&text, &noise}) {
+    std::string got;
+    while (got.size() < payload->size()) {
+      ASSERT_TRUE(decoder.next(reader, payload->size() - got.size()));
+      got.append(decoder.data(), decoder.size());
+    }
+    EXPECT_EQ(got, *payload);
+  }
+
+  // A chunk announcing more than the payload still owes is refused
+  std::string bad;
+  ChunkEncoder(1).encode(text.data(), 100, bad);
+  ASSERT_TRUE(send_all(sv[0], bad.data(), bad.size()));
+  EXPECT_FALSE(decoder.next(reader, 50));
+  EXPECT_TRUE(decoder.is_corrupt());
+  close(sv[0]);
+  close(sv[1]);
+}
+
+TEST(MetricsTest, HistogramPercentilesStayWithinABucket) {
+  // Every value lands in a bucket whose bounds hold it, 1/16 wide at most
+  for (uint64_t v : {0ULL, 1ULL, 15ULL, 16ULL, 17ULL, 1000ULL, 123456789ULL, (1ULL << 40) - 1}) {
+    size_t i = LatencyHistogram::index(v);
+    EXPECT_LE(v, LatencyHistogram::upper_bound(i));
+    if (i > 0) {
+      EXPECT_GT(v, LatencyHistogram::upper_bound(i - 1));
+    }
+    EXPECT_LE(LatencyHistogram::upper_bound(i) - v, v / 16);
+  }
+  EXPECT_EQ(LatencyHistogram::index(1ULL << 50), (size_t)HISTOGRAM_BUCKETS - 1);
+
+  LatencyHistogram h;
+  EXPECT_EQ(h.percentile(0.5), 0u);
+  for (uint64_t v = 1; v <= 1000; ++v) h.record(v * 1000);
+  EXPECT_EQ(h.count(), 1000u);
+  EXPECT_EQ(h.total_value(), 500500000u);
+  for (double q : {0.5, 0.99, 0.999}) {
+    uint64_t exact = (uint64_t)(q * 1000 + 1) * 1000;
+    EXPECT_GE(h.percentile(q), exact);
+    EXPECT_LE(h.percentile(q), exact + exact / 16);
+  }
+  EXPECT_GE(h.percentile(1.0), 1000000u);
+}
+
+TEST(AsyncLogTest, FiltersByLevelAndDropsPastTheRate) {
+  int fds[2];
+  ASSERT_EQ(pipe(fds), 0);
+  std::string got;
+  {
+    AsyncLog log;
+    log.set_level(LOG_WARN);
+    ASSERT_TRUE(log.start(fds[1]));
+    EXPECT_FALSE(log.enabled(LOG_DEBUG));
+    // The drop count is only exact if the burst stays inside one second
+    time_t window = time(nullptr);
+    log.write(LOG_INFO, "hidden");
+    log.write(LOG_WARN, "shown");
+    int sent = 0;
+    while (sent < LOG_RATE_PER_SEC + 100 && time(nullptr) == window) {
+      log.write(LOG_WARN, "flood");
+      ++sent;
+    }
+    log.write(LOG_ERROR, "error");
+    if (time(nullptr) == window) {
+      EXPECT_EQ(log.dropped(), (uint64_t)(sent + 1 - LOG_RATE_PER_SEC));
+    }
+    log.stop();
+  }
+  close(fds[1]);
+  char buf[65536];
+  ssize_t n;
+  while ((n = read(fds[0], buf, sizeof(buf))) > 0) got.append(buf, n);
+  close(fds[0]);
+  EXPECT_EQ(got.find("hidden"), std::string::npos);
+  EXPECT_EQ(got.compare(0, 6, "shown\n"), 0);
+  EXPECT_NE(got.find("error\n"), std::string::npos);
+}
+
+TEST(HashRingTest, ReplicasAreDistinctAndMostNamesStayPut) {
+  HashRing ring;
+  EXPECT_TRUE(ring.owners("a.txt", 2).empty());
+  ring.reset({"n1:1", "n2:1", "n3:1"});
+  std::vector<std::vector<size_t>> before;
+  std::vector<int> primaries(3, 0);
+  for (int i = 0; i < 3000; ++i) {
+    std::vector<size_t> owners = ring.owners("file-" + std::to_string(i), 2);
+    ASSERT_EQ(owners.size(), 2u);
+    EXPECT_NE(owners[0], owners[1]);
+    ++primaries[owners[0]];
+    before.push_back(owners);
+  }
+  // Every node owns a fair share
+  for (int count : primaries) EXPECT_GT(count, 600);
+  EXPECT_EQ(ring.owners("x", 5).size(), 3u);
+
+  // A fourth node takes names from the others but moves nothing else
+  ring.reset({"n1:1", "n2:1", "n3:1", "n4:1"});
+  int moved = 0;
+  for (int i = 0; i < 3000; ++i) {
+    size_t primary = ring.owners("file-" + std::to_string(i), 1)[0];
+    if (primary != before[i][0]) {
+      EXPECT_EQ(primary, 3u);
+      ++moved;
+    }
+  }
+  EXPECT_GT(moved, 400);
+  EXPECT_LT(moved, 1200);
+}
+
+TEST(ProtocolTest, ClusterRequestRoundTrip) {
+  for (bool binary : {false, true}) {
+    std::string out;
+    encode_request(out, binary, Request{OP_CLUSTER, 0, false, "", 0});
+    if (!binary) {
+      EXPECT_EQ(out, "CLUSTER\n");
+    }
+    int sv[2];
+    ASSERT_EQ(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), 0);
+    ASSERT_TRUE(send_all(sv[0], out.data(), out.size()));
+    SocketReader reader(sv[1]);
+    Request req;
+    if (binary) {
+      ASSERT_TRUE(next_frame_request(reader, req));
+    } else {
+      std::string line;
+      ASSERT_TRUE(reader.next_line(line));
+      ASSERT_EQ(parse_text_request(line, false, req), nullptr);
+    }
+    EXPECT_EQ(req.opcode, OP_CLUSTER);
+    close(sv[0]);
+    close(sv[1]);
+  }
+}
+
 int main(int argc, char **argv) {
   testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
@@ -199,6 +199,52 @@ class Worker(threading.Thread):
                 )
 
 
+class Reader(threading.Thread):
+    """Download-only client: measures how well reads of one file scale."""
+
+    def __init__(self, idx, host, port, filename, iterations, all_payloads,
+                 errors, lock):
+        super().__init__()
+        self.idx = idx
+        self.host = host
+        self.port = port
+        self.filename = filename
+        self.iterations = iterations
+        self.all_payloads = all_payloads
+        self.errors = errors
+        self.lock = lock
+        self.downloads = 0
+
+    def run(self):
+        try:
+            sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+            sock.connect((self.host, self.port))
+        except Exception as e:
+            with self.lock:
+                self.errors.append(f"[READER {self.idx}] Failed to connect: {e}")
+            return
+
+        for i in range(self.iterations):
+            try:
+                send_line(sock, f"DOWNLOAD|{self.filename}")
+                parts = read_line(sock).split("|")
+                if len(parts) < 3 or parts[0] != "OK":
+                    continue  # not uploaded yet
+                data = recv_all(sock, int(parts[2]))
+                if data not in self.all_payloads:
+                    with self.lock:
+                        self.errors.append(
+                            f"[READER {self.idx}] Iter {i}: CORRUPT DATA (len={len(data)})"
+                        )
+                self.downloads += 1
+            except Exception as e:
+                with self.lock:
+                    self.errors.append(f"[READER {self.idx}] Iter {i}: Exception: {e}")
+                break
+
+        sock.close()
+
+
 def main():
     parser = argparse.ArgumentParser(
         description="Stress-test the cloud storage server for thread safety."
@@ -213,6 +259,8 @@ def main():
                         help="Server-side filename to use in the test")
     parser.add_argument("--payload-len", type=int, default=4096,
                         help="Bytes per uploaded file")
+    parser.add_argument("--readers", type=int, default=0,
+                        help="Extra download-only clients hitting the same file")
     args = parser.parse_args()
 
     print(
@@ -221,6 +269,7 @@ def main():
         f"Iterations: {args.iterations} per thread\n"
         f"Filename:   {args.filename}\n"
         f"PayloadLen: {args.payload_len} bytes\n"
+        f"Readers:    {args.readers}\n"
     )
 
     all_payloads = []
@@ -239,6 +288,12 @@ def main():
                args.payload_len, all_payloads, errors, lock)
         for i in range(args.threads)
     ]
+    readers = [
+        Reader(i, args.host, args.port, args.filename, args.iterations,
+               all_payloads, errors, lock)
+        for i in range(args.readers)
+    ]
+    workers += readers
 
     start = time.time()
     for w in workers:
@@ -249,6 +304,9 @@ def main():
     end = time.time()
 
     print(f"\nTest completed in {end - start:.2f} seconds.")
+    if readers:
+        downloads = sum(r.downloads for r in readers)
+        print(f"Reader downloads: {downloads} ({downloads / (end - start):.1f}/s)")
 
     if errors:
         print("\n=== ERRORS / POSSIBLE THREAD-SAFETY ISSUES DETECTED ===")